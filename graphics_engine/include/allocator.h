@@ -3,12 +3,18 @@
 #include "logger.h"
 #include "device.h"
 #include "instance.h"
+#include <cstdint>
 
 class DeviceMemoryManager {
 public:
     void initialize(Device* device, Instance* instance);
     void cleanup();
 
+    // @brief Device local memory that can still be allocated before going over the OS/driver budget
+    uint64_t available_device_local_bytes();
+    // @brief Total size of the device local heaps
+    uint64_t device_local_heap_bytes();
+
     Device* device;
     Instance* instance;
     VmaAllocator allocator;
@@ -1,32 +1,221 @@
 #pragma once
+#include "collision_mesh.h"
+#include "image.h"
 #include "mesh.h"
+#include "thread_pool.h"
 #include <cstdint>
 #include <fastgltf/glm_element_traits.hpp>
 #include <fastgltf/tools.hpp>
+#include <filesystem>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <optional>
 
 class Renderer;
 
+class TextureAsset {
+public:
+    std::string name;
+    AllocatedImage image;
+    uint32_t bindless_index; // Slot of image in Renderer::bindless_descriptors. UINT32_MAX if the table was full
+};
+
+enum MaterialAlphaMode {
+    MATERIAL_ALPHA_MODE_OPAQUE,
+    MATERIAL_ALPHA_MODE_MASK,
+    MATERIAL_ALPHA_MODE_BLEND,
+};
+
+class MaterialAsset {
+public:
+    std::string name;
+    glm::vec4 base_color_factor;
+    std::shared_ptr<TextureAsset> base_color_texture; // nullptr if the material isn't textured
+    MaterialAlphaMode alpha_mode;
+    float alpha_cutoff;
+    bool double_sided;
+};
+
 struct GeometricSurface {
     uint32_t index;
     uint32_t count;
+    std::shared_ptr<MaterialAsset> material; // nullptr if the primitive has no material
+
+    // Object space bounds of just this surface's triangles
+    glm::vec3 aabb_min;
+    glm::vec3 aabb_max;
+    glm::vec4 bounding_sphere; // Center in xyz, radius in w
 };
 
 class MeshAsset {
 public:
-    void cleanup();
+    std::string name;
+    std::vector<GeometricSurface> surfaces;
+    std::shared_ptr<GPUMeshBuffer> GPU_mesh_buffers; // Shared between meshes with identical geometry
+    std::shared_ptr<CollisionMesh> collision_mesh;   // Shared the same way. nullptr if AssetManager::build_collision_meshes was off
+    glm::vec4 bounding_sphere; // Object space center in xyz, radius in w
+
+    // One world transform per node that places this mesh, so the whole set can be drawn with a single instanced draw
+    std::vector<glm::mat4> instance_transforms;
+};
+
+// A node of the imported glTF hierarchy
+struct SceneNodeAsset {
+    std::string name;
+    int32_t parent_index; // -1 for root nodes
+    int32_t mesh_index;   // -1 if the node doesn't place a mesh
+    glm::mat4 local_transform;
+    glm::mat4 world_transform;
+};
+
+class SceneAsset {
+public:
+    std::vector<SceneNodeAsset> nodes; // Sorted so that parents always come before their children
+    std::vector<std::shared_ptr<MeshAsset>> meshes;
+};
 
+// CPU-side result of parsing a mesh, before anything touches the GPU
+struct MeshData {
     std::string name;
     std::vector<GeometricSurface> surfaces;
-    GPUMeshBuffer GPU_mesh_buffers;
+    std::vector<MeshVertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<glm::mat4> instance_transforms;
+    std::vector<int32_t> surface_materials; // Index into SceneData::materials for each surface, -1 for none
+};
+
+// Decoded pixels of one glTF image. PNG/JPEG decode to a single RGBA8 level that gets mipmapped on upload,
+// KTX2 files keep their own format and precomputed mip levels
+struct ImageData {
+    std::string name;
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    std::vector<uint8_t> pixels;       // Empty if decoding failed
+    std::vector<size_t> level_offsets; // Only set for images with precomputed mips
+};
+
+struct MaterialData {
+    std::string name;
+    glm::vec4 base_color_factor;
+    int32_t base_color_image;          // Index into SceneData::images, -1 for none
+    int32_t base_color_fallback_image; // Used when base_color_image can't be loaded on this GPU, -1 for none
+    MaterialAlphaMode alpha_mode;
+    float alpha_cutoff;
+    bool double_sided;
+};
+
+struct SceneData {
+    std::vector<SceneNodeAsset> nodes;
+    std::vector<MeshData> meshes;
+    std::vector<ImageData> images;
+    std::vector<MaterialData> materials;
 };
 
+using MeshLoadResult = std::optional<std::vector<std::shared_ptr<MeshAsset>>>;
+using MeshLoadCallback = std::function<void(const MeshLoadResult& meshes)>;
+
 class AssetManager {
 public:
     void initialize(Renderer* renderer);
-    std::optional<std::vector<std::shared_ptr<MeshAsset>>> load_mesh_GLTF(std::filesystem::path filepath);
+    void cleanup();
+
+    // @brief Parses and uploads a glTF file, blocking until the meshes are resident on the GPU
+    std::optional<SceneAsset> load_scene_GLTF(std::filesystem::path filepath);
+
+    // @brief Same as load_scene_GLTF, but only returns the meshes
+    MeshLoadResult load_mesh_GLTF(std::filesystem::path filepath);
+
+    // @brief Same as load_mesh_GLTF, but the parsing and uploading happen on the thread pool and this returns immediately
+    // @param on_loaded - called on the main thread from publish_completed_loads() once the upload has finished
+    std::shared_future<MeshLoadResult> load_mesh_GLTF_async(std::filesystem::path filepath, MeshLoadCallback on_loaded = nullptr);
+
+    // @brief Runs the callbacks of every async load that has finished. Call once per frame from the main thread
+    void publish_completed_loads();
+
+    // @brief Parses a glTF file into CPU-side data. Images are decoded in parallel on the thread pool
+    std::optional<SceneData> parse_scene_GLTF(const std::filesystem::path& filepath, std::span<const std::byte> file_bytes);
+    std::vector<std::shared_ptr<MeshAsset>> upload_meshes(std::vector<MeshData>& mesh_data, const std::vector<std::shared_ptr<MaterialAsset>>& materials);
+    std::vector<std::shared_ptr<MaterialAsset>> upload_materials(std::vector<ImageData>& image_data, const std::vector<MaterialData>& material_data);
+    // @brief Hands decoded image data to the texture streamer. Returns nullptr if the data is empty or the GPU can't sample its format
+    std::shared_ptr<TextureAsset> upload_texture(ImageData& image_data);
+
+    // @brief Loads a standalone KTX2 texture, typically block-compressed with precomputed mips
+    std::shared_ptr<TextureAsset> load_texture_KTX2(std::filesystem::path filepath);
+
+    // @brief Returns the GPU buffers for this geometry, uploading them only if no identical copy is resident
+    std::shared_ptr<GPUMeshBuffer> find_or_upload_geometry(MeshData& mesh_data);
+    // @brief Same as find_or_upload_geometry, for the CPU copy used by ray queries
+    std::shared_ptr<CollisionMesh> find_or_build_collision_mesh(const MeshData& mesh_data);
 
     Renderer* renderer;
+    ThreadPool thread_pool;
+    bool build_collision_meshes; // Keep a triangle BVH of every loaded mesh on the CPU for picking
+
+private:
+    struct PendingLoad {
+        std::string canonical_path;
+        std::shared_future<MeshLoadResult> result;
+        MeshLoadCallback on_loaded;
+    };
+    // Only touched from the main thread, so it doesn't need a lock
+    std::vector<PendingLoad> pending_loads;
+
+    // Remembers the content hash of each file so unchanged files don't need to be re-read and re-hashed
+    struct FileRecord {
+        uint64_t content_hash;
+        uintmax_t file_size;
+        std::filesystem::file_time_type last_write_time;
+    };
+
+    // The file a cached scene was parsed from, as it was at the time
+    struct SceneSource {
+        std::string path;
+        uintmax_t file_size;
+        std::filesystem::file_time_type last_write_time;
+
+        inline bool operator==(const SceneSource& other) const { return path == other.path && file_size == other.file_size && last_write_time == other.last_write_time; }
+    };
+
+    struct CachedScene {
+        std::vector<SceneNodeAsset> nodes;
+        std::vector<std::weak_ptr<MeshAsset>> meshes;
+        SceneSource source;
+    };
+
+    // Geometry is found by one hash and confirmed by a second, differently seeded one plus the sizes,
+    // so nothing gets shared on a single 64-bit match without keeping a copy of every mesh around
+    struct GeometryHash {
+        uint64_t key;
+        uint64_t check;
+    };
+
+    struct CachedGeometry {
+        uint64_t check_hash;
+        size_t vertex_count;
+        size_t index_count;
+        std::weak_ptr<GPUMeshBuffer> buffers;
+        std::weak_ptr<CollisionMesh> collision_mesh;
+    };
+
+    // Meshes are held weakly: the cache never keeps an asset alive on its own
+    std::mutex cache_mutex;
+    std::unordered_map<std::string, FileRecord> file_records;         // canonical path -> content hash
+    std::unordered_map<uint64_t, CachedScene> scene_cache;            // file content hash -> scene
+    std::unordered_multimap<uint64_t, CachedGeometry> geometry_cache; // GeometryHash::key -> buffers and triangle BVH
+
+    std::optional<SceneAsset> find_cached_scene(uint64_t content_hash, const SceneSource& expected_source);
+    // @brief True if the file a cached scene came from is unchanged since then and holds exactly these bytes
+    static bool source_file_matches(const SceneSource& source, std::span<const std::byte> file_bytes);
+    static GeometryHash hash_geometry(const MeshData& mesh_data);
+    // @brief Also drops the entries under the same key that nothing holds anymore
+    CachedGeometry* find_cached_geometry(const GeometryHash& geometry_hash, const MeshData& mesh_data);
+    CachedGeometry& find_or_add_cached_geometry(const GeometryHash& geometry_hash, const MeshData& mesh_data);
+    void prune_geometry_cache();
 };
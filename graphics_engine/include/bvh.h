@@ -0,0 +1,81 @@
+#pragma once
+#include "frustum_culling.h"
+#include "glm/glm.hpp"
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+struct AABB {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// 32 bytes so two nodes share a cache line. Interior nodes have count 0 and their children at first and first + 1,
+// leaves own primitive_indices[first, first + count)
+struct BVHNode {
+    glm::vec3 aabb_min;
+    uint32_t first;
+    glm::vec3 aabb_max;
+    uint32_t count;
+
+    inline bool is_leaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy over a set of boxes, referred to by their index in primitive_bounds.
+// build() splits with a binned surface area heuristic, which is the expensive part and meant for when the set of
+// primitives changes. Primitives that only move can be updated in primitive_bounds and refit() instead, which keeps
+// the tree and just grows or shrinks the boxes on the way up from their leaves. Lots of movement makes the tree
+// looser over time, another build() tightens it again.
+//
+// Splitting partitions primitive_indices in place, so every subtree covers one contiguous range of it. A tree built
+// from spheres keeps them in that order too, and query_frustum tests whole runs of partially visible leaves at once
+// with FrustumCulling::cull_spheres.
+class BVH {
+public:
+    void build(std::vector<AABB>&& bounds);
+    // @brief Builds over the boxes around the spheres (center in xyz, radius in w), which are kept for query_frustum
+    void build(const BoundingSphereSoA& spheres);
+    // @brief Moves a primitive of a tree built from spheres. Call refit() once every moved one is set
+    void set_sphere(uint32_t primitive, const glm::vec4& sphere);
+    // @brief Updates the boxes above the given primitives after their entries in primitive_bounds changed
+    void refit(std::span<const uint32_t> moved_primitives);
+    void clear();
+
+    // @brief Appends every primitive that touches the frustum: its sphere if the tree has them, otherwise its box.
+    // Subtrees entirely inside skip the per-primitive tests
+    void query_frustum(const FrustumPlanes& planes, std::vector<uint32_t>& result) const;
+    // @brief Appends every primitive whose box overlaps the given one
+    void query_aabb(const AABB& box, std::vector<uint32_t>& result) const;
+    // @brief Finds the closest primitive along a ray. intersect gets each primitive whose box the ray enters and
+    // returns its own hit distance, or a negative value for a miss. Nodes farther than the best hit so far are skipped
+    // @return the primitive index, or UINT32_MAX if nothing was hit. hit_distance is only written on a hit
+    uint32_t raycast(glm::vec3 origin, glm::vec3 direction, float max_distance,
+                     const std::function<float(uint32_t primitive)>& intersect, float& hit_distance) const;
+
+    inline bool empty() const { return nodes.empty(); }
+
+    std::vector<BVHNode> nodes; // Root first, children always after their parent
+    std::vector<uint32_t> primitive_indices;
+    std::vector<AABB> primitive_bounds;
+    BoundingSphereSoA ordered_spheres; // Sphere of primitive_indices[i] at i, empty for trees built from boxes
+
+    uint32_t max_leaf_size = 4;
+
+private:
+    struct BuildPrimitive {
+        AABB bounds;
+        glm::vec3 centroid;
+    };
+
+    void update_node_bounds(uint32_t node_index);
+    void set_build_bounds(uint32_t node_index);
+    void subdivide(uint32_t node_index);
+    float find_split(const BVHNode& node, int& axis, float& position) const;
+
+    std::vector<uint32_t> node_parents;            // For walking up during refit
+    std::vector<uint32_t> primitive_leaves;        // Leaf each primitive ended up in
+    std::vector<uint32_t> primitive_positions;     // Where each primitive ended up in primitive_indices
+    std::vector<BuildPrimitive> build_primitives; // Only needed while building, ordered like primitive_indices
+    mutable std::vector<uint8_t> sphere_visibility; // Scratch for query_frustum, indexed like ordered_spheres
+};
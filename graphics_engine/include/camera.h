@@ -1,8 +1,20 @@
 #pragma once
 
 #include "glm/glm.hpp"
+#include "frustum_culling.h"
 #define GLM_FORCE_RADIANS
 
+// Camera data as the shaders see it. The renderer keeps one copy per frame in flight
+struct GPUCameraData {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 view_projection;
+	glm::vec4 position; // World space, w unused
+	// Camera of the frame before, which is what the depth pyramid was built from
+	glm::mat4 previous_view;
+	glm::mat4 previous_projection;
+};
+
 class Camera {
 public:
 	// @brief Sets the projection matrix member to an orthographic projection
@@ -38,6 +50,16 @@ public:
 	// @param rotation - Euler angles of the camera direction in YXZ ordering (pitch, yaw, roll)
 	void set_view_euler_yxz(glm::vec3 position, glm::vec3 rotation);
 
+	// @brief Returns the world space frustum planes of projection * view, normals pointing inwards
+	FrustumPlanes frustum_planes() const;
+
+	// @brief Builds the world space ray through a point on the screen, for picking
+	// @param pixel - position in the viewport, origin at the top left, e.g. InputManager::mouse_pos_x/y
+	// @param viewport_size - size of the viewport in the same units as pixel
+	// @param origin - set to the point on the near plane
+	// @param direction - set to the normalized direction towards the far plane
+	void screen_ray(glm::vec2 pixel, glm::vec2 viewport_size, glm::vec3& origin, glm::vec3& direction) const;
+
 	glm::mat4 projection{ 1.f };
 	glm::mat4 view{ 1.f };
 };
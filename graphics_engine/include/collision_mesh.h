@@ -0,0 +1,30 @@
+#pragma once
+#include "bvh.h"
+#include "glm/glm.hpp"
+#include <cstdint>
+#include <span>
+#include <vector>
+
+struct MeshVertex;
+
+// CPU copy of a mesh's triangles for ray queries, with a BVH over them so a ray only tests the few triangles near it.
+// Lives next to the GPU buffers of the same geometry and is shared the same way
+class CollisionMesh {
+public:
+    void build(std::span<const MeshVertex> vertices, std::span<const uint32_t> indices);
+
+    // @brief Finds the closest triangle along an object space ray. Only triangles in [first_triangle, first_triangle + triangle_count)
+    // count as hits, so a single surface can be picked without the mesh's other surfaces getting in the way
+    // @return the triangle index (its first index / 3), or UINT32_MAX if nothing was hit. hit_distance is only written on a hit
+    uint32_t raycast(glm::vec3 origin, glm::vec3 direction, float max_distance, float& hit_distance,
+                     uint32_t first_triangle = 0, uint32_t triangle_count = UINT32_MAX) const;
+
+    inline uint32_t triangle_count() const { return static_cast<uint32_t>(triangle_vertices.size() / 3); }
+
+    // Three positions per triangle, unindexed so a hit test touches one spot in memory
+    std::vector<glm::vec3> triangle_vertices;
+    BVH bvh;
+};
+
+// @brief Möller-Trumbore. Returns the distance along direction to the hit, negative on a miss. Both sides count as a hit
+float intersect_ray_triangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
@@ -5,6 +5,7 @@
 #include "vulkan/vulkan_core.h"
 #include <functional>
 #include <memory>
+#include <mutex>
 
 class Device;
 class Command;
@@ -27,6 +28,8 @@ public:
     void begin();
     void end();
     void submit_to_queue(VkQueue queue, FrameSync* frame_sync, Semaphore* render_semaphore);
+    // @brief Global memory barrier, for buffers and GENERAL layout images that don't need a layout transition
+    void memory_barrier(VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access);
 
     static VkCommandBufferBeginInfo command_buffer_begin_info(VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 
@@ -48,5 +51,6 @@ public:
     Command command;
     CommandPool pool;
     Fence submit_fence;
+    std::mutex mutex; // Immediate commands can come from the asset loader threads as well as the main thread
 };
 
@@ -0,0 +1,64 @@
+#pragma once
+#include "image.h"
+#include "pipeline.h"
+#include "command.h"
+#include "vulkan/vulkan.h"
+#include "glm/glm.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Renderer;
+
+struct GPUDepthReducePushConstants {
+    uint32_t source_index;      // Bindless image slot of the level being reduced (or the depth image)
+    uint32_t sampler_index;
+    uint32_t destination_index; // Bindless storage image slot of the level being written
+    uint32_t padding;
+    glm::vec2 source_uv_scale;  // Part of the source that holds this frame's depth, only less than 1 for the depth image
+    glm::vec2 destination_size;
+};
+
+// Hierarchical depth buffer for occlusion culling. Every texel of a level holds the farthest depth of the 2x2 texels
+// under it in the level before, so a single sample at the level matching an object's screen size tells whether
+// anything in front of the object could have been drawn. Depth is reversed, so farthest means smallest and
+// a min reduction sampler does the work.
+//
+// Level 0 is the draw extent rounded down to a power of two, which keeps every level exactly half the one before it.
+class DepthPyramid {
+public:
+    void initialize(Renderer* renderer);
+    void cleanup();
+
+    // @brief Reduces this frame's depth into the pyramid. Call after rendering ends, with the depth image in GENERAL layout
+    // @param draw_extent - part of the depth image that was rendered to
+    void build(Command* cmd, AllocatedImage* depth_image, VkExtent2D draw_extent);
+
+    // @brief Rebuilds the reduce pipeline if its shader is among the hot reloaded entry_points
+    void reload_shaders(const std::vector<std::string>& entry_points);
+
+    Renderer* renderer;
+    std::shared_ptr<Pipeline> reduce_pipeline;
+    VkSampler min_sampler;
+    uint32_t min_sampler_index;
+
+    AllocatedImage image;
+    uint32_t image_index; // Bindless slot of the whole mip chain, what the cull pass samples
+    VkExtent2D extent;    // Size of level 0
+    bool supported;       // False when the GPU can't do min filtering on depth, occlusion culling is skipped then
+    bool valid;           // Whether the pyramid holds the depth of the last frame that called build()
+
+private:
+    std::shared_ptr<Pipeline> build_reduce_pipeline();
+    // @brief Returns false if the bindless table couldn't fit every level, nothing is left allocated then
+    bool create(VkExtent2D pyramid_extent);
+    void destroy();
+
+    std::vector<VkImageView> level_views;
+    std::vector<uint32_t> level_image_indices;   // Each level is sampled on its own while reducing into the next one
+    std::vector<uint32_t> level_storage_indices;
+
+    // The depth image is recreated on resize, so each frame in flight registers it again in its own slot
+    std::vector<uint32_t> depth_indices;
+};
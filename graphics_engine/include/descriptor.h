@@ -10,6 +10,7 @@
 #include <vector>
 #include <string>
 #include <deque>
+#include <mutex>
 
 class Renderer;
 class Buffer;
@@ -40,6 +41,14 @@ private:
     VkDescriptorPool new_pool(uint32_t set_count, std::span<PoolSizeRatio> pool_size_ratios);
 };
 
+// What a descriptor set layout was created from. Pipeline layouts are told apart by this instead of the layout
+// handles, since a destroyed layout's handle can come back for a different one
+struct DescriptorSetLayoutDescription {
+    VkDescriptorSetLayoutCreateFlags flags = 0;
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    std::vector<VkDescriptorBindingFlags> binding_flags; // One per binding, or empty if the layout has none
+};
+
 class DescriptorLayoutBuilder {
 public:
     void initialize(Device* device);
@@ -74,6 +83,7 @@ public:
     Renderer* renderer;
     VkDescriptorSet handle;
     VkDescriptorSetLayout layout;
+    DescriptorSetLayoutDescription layout_description;
 };
 
 class DescriptorBuilder {
@@ -92,3 +102,61 @@ public:
     DescriptorLayoutBuilder descriptor_layout_builder;;
 };
 
+
+// Hands out indices into a fixed size descriptor array, reusing freed ones first
+class DescriptorSlotAllocator {
+public:
+    void initialize(uint32_t capacity);
+
+    // @brief Returns UINT32_MAX if the array is full
+    uint32_t allocate();
+    void free(uint32_t slot);
+
+    uint32_t capacity;
+    uint32_t next_unused;
+    std::vector<uint32_t> free_slots;
+};
+
+// One global descriptor set holding every texture, sampler and storage buffer in big arrays.
+// Shaders index the arrays directly with the slot returned by the add_ functions, so draws never need to rebind descriptors.
+// The arrays are partially bound and update-after-bind, so slots can be filled and freed while command buffers use the set.
+// A slot must not be rewritten while a frame in flight can still read it: free slots through Renderer::defer_cleanup.
+class BindlessDescriptorTable {
+public:
+    static constexpr uint32_t IMAGE_BINDING = 0;
+    static constexpr uint32_t SAMPLER_BINDING = 1;
+    static constexpr uint32_t STORAGE_BUFFER_BINDING = 2;
+    static constexpr uint32_t STORAGE_IMAGE_BINDING = 3;
+
+    // Requested sizes are clamped to the device's update-after-bind limits
+    void initialize(Renderer* renderer, uint32_t max_images = 16384, uint32_t max_samplers = 64, uint32_t max_storage_buffers = 16384, uint32_t max_storage_images = 1024);
+    void cleanup();
+
+    // These are safe to call from any thread
+    uint32_t add_image(ImageType* image, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    uint32_t add_image_view(VkImageView view, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL); // For views of single mip levels
+    uint32_t add_sampler(VkSampler sampler);
+    uint32_t add_storage_buffer(Buffer* buffer, size_t offset = 0, size_t size = VK_WHOLE_SIZE);
+    uint32_t add_storage_image(VkImageView view); // The image has to be in VK_IMAGE_LAYOUT_GENERAL whenever it's used
+    void remove_image(uint32_t slot);
+    void remove_sampler(uint32_t slot);
+    void remove_storage_buffer(uint32_t slot);
+    void remove_storage_image(uint32_t slot);
+
+    void bind(Command* cmd, VkPipelineLayout pipeline_layout, uint32_t set_index, VkPipelineBindPoint bind_point = VK_PIPELINE_BIND_POINT_GRAPHICS);
+
+    Renderer* renderer;
+    VkDescriptorPool pool;
+    VkDescriptorSetLayout layout;
+    DescriptorSetLayoutDescription layout_description;
+    VkDescriptorSet handle;
+
+    DescriptorSlotAllocator image_slots;
+    DescriptorSlotAllocator sampler_slots;
+    DescriptorSlotAllocator storage_buffer_slots;
+    DescriptorSlotAllocator storage_image_slots;
+
+private:
+    // vkUpdateDescriptorSets needs the set to be externally synchronized
+    std::mutex mutex;
+};
@@ -5,6 +5,7 @@
 #include "vulkan/vulkan_core.h"
 #include <vector>
 #include <optional>
+#include <mutex>
 
 class QueueFamilyIndices {
 public:
@@ -21,7 +22,8 @@ class Instance;
 
 class Device {
 public:
-    void initialize(
+    // @brief Returns false if the selected GPU lacks a required feature or the logical device couldn't be created
+    bool initialize(
         Instance* instance,
         Window* window,
         const std::vector<const char*>* requested_validation_layers,
@@ -30,17 +32,29 @@ public:
     void cleanup();
 
     static bool check_device_extension_support(VkPhysicalDevice physical_device, const std::vector<const char*>* extensions);
+    static bool extension_supported(VkPhysicalDevice physical_device, const char* extension_name);
     static VkPhysicalDevice select_physical_device(VkInstance instance, VkSurfaceKHR surface, const std::vector<const char*>* device_extensions);
     static bool device_suitable(VkPhysicalDevice physical_device, VkSurfaceKHR surface, const std::vector<const char*>* device_extensions);
 
+    bool extension_enabled(const char* extension_name);
+
+    // @brief Whether optimal-tiling images of this format support all of the given features
+    bool supports_format_features(VkFormat format, VkFormatFeatureFlags features);
+
     Instance* instance;
     Window* window;
     VkPhysicalDevice physical_device;
     VkDevice logical_device;
+    std::vector<const char*> enabled_extensions; // The requested ones plus any optional ones the GPU has
+
+    // Optional features, enabled whenever the GPU has them
+    bool sampler_filter_minmax;
+    bool storage_image_update_after_bind;
 
     QueueFamilyIndices queue_indices;
     VkQueue graphics_queue;
     VkQueue present_queue;
+    std::mutex queue_mutex; // vkQueueSubmit/vkQueuePresent need external sync once loader threads submit uploads
 
     VkSurfaceKHR window_surface;
 
@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <span>
+
+namespace FileUtils {
+    // @brief Writes header followed by payload to a temporary file next to path and renames it over path, so a crash
+    // mid-write leaves the previous file intact. Creates missing parent directories. Returns false and logs on failure
+    bool write_file_atomically(const std::filesystem::path& path, std::span<const uint8_t> header, std::span<const uint8_t> payload);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "glm/glm.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Six planes with their normals pointing into the frustum, distance in w: left, right, bottom, top, near, far
+using FrustumPlanes = std::array<glm::vec4, 6>;
+
+// Bounding spheres stored as structure of arrays, so the culling routines can load several of each component at once
+struct BoundingSphereSoA {
+    void clear();
+    void reserve(size_t count);
+    void push_back(const glm::vec4& sphere); // Center in xyz, radius in w
+    void set(size_t index, const glm::vec4& sphere);
+    inline size_t size() const { return radius.size(); }
+
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+};
+
+namespace FrustumCulling {
+    // @brief Extracts normalized frustum planes from a matrix taking some space (usually world) to clip space
+    FrustumPlanes extract_planes(const glm::mat4& clip_from_space);
+
+    // @brief Writes 1 for every sphere in [first, end) touching the frustum and 0 for the rest, at the sphere's own index.
+    // Tests 8 spheres at a time with AVX, 4 with SSE, and falls back to cull_spheres_scalar when neither is available at
+    // compile time. Builds without NDEBUG check every batch against cull_spheres_scalar
+    void cull_spheres(const FrustumPlanes& planes, const BoundingSphereSoA& spheres, std::vector<uint8_t>& visible, size_t first = 0, size_t end = SIZE_MAX);
+    void cull_spheres_scalar(const FrustumPlanes& planes, const BoundingSphereSoA& spheres, std::vector<uint8_t>& visible, size_t first = 0, size_t end = SIZE_MAX);
+
+    bool is_sphere_visible(const FrustumPlanes& planes, const glm::vec4& sphere);
+    bool is_aabb_visible(const FrustumPlanes& planes, const glm::vec3& min_corner, const glm::vec3& max_corner);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Small non-cryptographic hashing helpers used for content-addressed caches
+namespace Hash {
+    // @brief 64-bit MurmurHash2 (64A variant) over a block of memory
+    inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0) {
+        const uint64_t m = 0xc6a4a7935bd1e995ULL;
+        const int r = 47;
+
+        uint64_t h = seed ^ (size * m);
+
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        const size_t block_count = size / 8;
+        for (size_t i_block = 0; i_block < block_count; i_block++) {
+            uint64_t k;
+            std::memcpy(&k, bytes + i_block * 8, sizeof(uint64_t)); // memcpy to avoid unaligned reads
+
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+
+            h ^= k;
+            h *= m;
+        }
+
+        const unsigned char* tail = bytes + block_count * 8;
+        switch (size & 7) {
+            case 7: h ^= uint64_t(tail[6]) << 48; [[fallthrough]];
+            case 6: h ^= uint64_t(tail[5]) << 40; [[fallthrough]];
+            case 5: h ^= uint64_t(tail[4]) << 32; [[fallthrough]];
+            case 4: h ^= uint64_t(tail[3]) << 24; [[fallthrough]];
+            case 3: h ^= uint64_t(tail[2]) << 16; [[fallthrough]];
+            case 2: h ^= uint64_t(tail[1]) << 8;  [[fallthrough]];
+            case 1: h ^= uint64_t(tail[0]);
+                    h *= m;
+        }
+
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    }
+
+    inline uint64_t hash_string(std::string_view string, uint64_t seed = 0) {
+        return hash_bytes(string.data(), string.size(), seed);
+    }
+
+    // @brief Mixes value into an existing hash, order dependent
+    inline uint64_t combine(uint64_t hash, uint64_t value) {
+        return hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+    }
+}
@@ -7,6 +7,8 @@
 #include "logger.h"
 #include "vulkan/vulkan_core.h"
 #include <cstdint>
+#include <span>
+#include <vector>
 
 class Renderer;
 
@@ -24,11 +26,32 @@ public:
     Renderer* renderer;
 };
 
+// Size of a format's texel blocks. Uncompressed formats are 1x1 blocks of one texel
+struct FormatBlock {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes; // 0 for formats we don't know the layout of
+};
+
 namespace Image {
+    FormatBlock format_block(VkFormat format);
+    // @brief Bytes needed by one tightly packed mip level of this format
+    size_t level_size(VkFormat format, VkExtent3D extent);
+    VkExtent3D mip_extent(VkExtent3D extent, uint32_t level);
+
     void transition_image(Command* cmd, ImageType* image, VkImageLayout new_layout);
 	void copy_image(Command* cmd, ImageType* src, ImageType* dst);
 	void copy_subimage(Command* cmd, ImageType* src, VkExtent3D src_extent, ImageType* dst, VkExtent3D dst_extent);
     void copy_data_to_image(ImageType* image, void* data, size_t pixel_bytes);
+    // @brief Uploads precomputed mip levels (e.g. from a compressed texture file) as is. level_offsets has one entry per mip level of the image
+    void copy_mip_levels_to_image(ImageType* image, const void* data, size_t data_size, std::span<const size_t> level_offsets);
+    // @brief True for the 8-bit UNORM formats build_mip_chain knows how to filter
+    bool can_build_mip_chain(VkFormat format);
+    // @brief Box filters a full mip chain on the CPU, in linear space for sRGB formats. Formats it can't filter only get their base level
+    // @param level_offsets - filled with the byte offset of each level in the returned data
+    std::vector<uint8_t> build_mip_chain(const void* data, VkExtent3D extent, VkFormat format, uint32_t level_count, std::vector<size_t>& level_offsets);
+    // Fills levels 1..n from level 0. Expects the whole image in TRANSFER_DST_OPTIMAL and leaves it in SHADER_READ_ONLY_OPTIMAL
+    void generate_mipmaps(Command* cmd, ImageType* image);
 	VkRenderingAttachmentInfoKHR color_attachment_info(VkImageView image_view, VkClearValue* clear_value, VkImageLayout image_layout);
 	VkRenderingAttachmentInfoKHR depth_attachment_info(VkImageView image_view, VkImageLayout image_layout);
 };
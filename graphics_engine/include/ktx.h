@@ -0,0 +1,22 @@
+#pragma once
+#include "vulkan/vulkan.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+// A texture read out of a KTX2 container, ready to hand to Renderer::create_image_from_mip_levels
+struct KTXTexture {
+    VkFormat format;
+    VkExtent3D extent;
+    std::vector<std::byte> data;       // Every mip level back to back, largest first
+    std::vector<size_t> level_offsets; // Byte offset of each mip level in data
+};
+
+// Minimal KTX2 reader. Only handles what offline BCn compressors produce: 2D, one layer, one face
+// and no supercompression. Basis Universal files would need a transcoder and are rejected.
+namespace KTX {
+    bool is_KTX2(std::span<const std::byte> bytes);
+    std::optional<KTXTexture> load_KTX2(std::span<const std::byte> bytes);
+}
@@ -17,9 +17,38 @@ struct MeshVertex {
     glm::vec4 color;
 };
 
-struct GPUDrawPushConstants {
-    glm::mat4 world_matrix;
-    VkDeviceAddress vertex_buffer_address;
+// One instance of one surface, as read by the cull pass and the mesh shaders. Textures and samplers are
+// indices into the bindless descriptor table. Keep the layout in sync with ObjectData in the shaders
+struct GPUObjectData {
+    glm::mat4 transform;
+    glm::vec4 bounding_sphere; // Object space center in xyz, radius in w
+    glm::vec4 base_color_factor;
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t draw_group;       // Which indirect count the object is appended to
+    uint32_t first_command;    // Where that group's commands start
+    uint32_t base_color_texture_index;
+    uint32_t sampler_index;
+    float alpha_cutoff;        // Only read by the alpha tested pipelines
+    uint32_t padding;
+};
+
+// The camera comes from the per-frame camera set
+struct GPUCullPushConstants {
+    uint32_t object_count;
+    uint32_t object_buffer_index;  // Bindless storage buffer slots
+    uint32_t command_buffer_index;
+    uint32_t count_buffer_index;
+    uint32_t depth_pyramid_index;  // Bindless image slot, UINT32_MAX skips the occlusion test
+    uint32_t depth_pyramid_sampler_index;
+    glm::vec2 depth_pyramid_size;
+};
+
+// Objects bring their own transforms, so the only per-draw data is where to pull the vertices from
+struct GPUMeshPushConstants {
+    VkDeviceAddress vertex_buffer_address; // Only used by the vertex pulling pipeline
+    uint32_t object_buffer_index;
+    uint32_t padding;
 };
 
 class GPUMeshBuffer {
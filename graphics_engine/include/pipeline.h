@@ -3,8 +3,10 @@
 #include "logger.h"
 #include "device.h"
 #include "shader.h"
+#include "descriptor.h"
 #include "vulkan/vulkan_core.h"
 #include <cstdint>
+#include <memory>
 #include <span>
 
 // PIPELINE ----------------------------------------------------------------------------------------------------------------------------
@@ -16,6 +18,7 @@ public:
     Device* device;
     VkPipeline handle;
     VkPipelineLayout layout;
+    std::shared_ptr<VkPipelineLayout> shared_layout; // Set when the layout came from a PipelineRegistry, which owns it then
 };
 
 namespace PipelineLayout {
@@ -37,6 +40,7 @@ enum BlendingType {
 struct PipelineConfig {
 	// Shaders
 	std::vector<VkPipelineShaderStageCreateInfo> shader_modules;
+	std::vector<ShaderCodeId> shader_code_ids; // Of each shader module's code, modules themselves only live until the build
 
 	// Pipeline State
 	VkPipelineInputAssemblyStateCreateInfo input_assembly{ .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
@@ -48,6 +52,7 @@ struct PipelineConfig {
 	VkFormat color_attachment_format{ VK_FORMAT_UNDEFINED };
 
 	std::vector<VkDescriptorSetLayout> descriptor_set_layouts{};
+	std::vector<DescriptorSetLayoutDescription> descriptor_set_layout_descriptions{}; // One per layout, what PipelineRegistry keys layouts by
 	std::vector<VkPushConstantRange> push_constant_ranges{};
     std::vector<VkVertexInputBindingDescription> vertex_binding_descriptions{};
     std::vector<VkVertexInputAttributeDescription> vertex_attribute_descriptions{};
@@ -55,10 +60,14 @@ struct PipelineConfig {
 
 class PipelineBuilder {
 public:
-    void initialize(Device* device);
+    // @param pipeline_cache - handed to every pipeline creation, so pipelines compiled before come back without recompiling
+    void initialize(Device* device, VkPipelineCache pipeline_cache = VK_NULL_HANDLE);
 
     void clear();
-    Pipeline build();
+    // @param layout - use this layout instead of creating one from the config. Pipeline::cleanup() destroys the layout
+    // unless shared_layout holds it, which is how PipelineRegistry hands out shared layouts
+    Pipeline build(VkPipelineLayout layout = VK_NULL_HANDLE);
+    Pipeline build_compute(VkPipelineLayout layout = VK_NULL_HANDLE); // Uses the first shader set and the layout, the rest of the config is ignored
     PipelineBuilder& set_config(PipelineConfig config);
     PipelineBuilder& set_shader(Shader shader);
 	PipelineBuilder& set_input_topology(VkPrimitiveTopology topology);
@@ -68,8 +77,9 @@ public:
 	PipelineBuilder& set_blending(BlendingType blending_type);
 	PipelineBuilder& set_color_attachment_format(VkFormat format);
 	PipelineBuilder& set_depth_attachment_format(VkFormat format);
-	PipelineBuilder& set_depth_test(VkCompareOp compare_op = VK_COMPARE_OP_NEVER);
-	PipelineBuilder& add_descriptor(VkDescriptorSetLayout descriptor);
+	PipelineBuilder& set_color_write_mask(VkColorComponentFlags mask); // Call after set_blending, which resets it
+	PipelineBuilder& set_depth_test(VkCompareOp compare_op = VK_COMPARE_OP_NEVER, bool depth_write = true);
+	PipelineBuilder& add_descriptor(VkDescriptorSetLayout descriptor, const DescriptorSetLayoutDescription& description);
 	PipelineBuilder& add_push_constant(VkPushConstantRange push_constant);
     PipelineBuilder& add_vertex_binding_description(VkVertexInputBindingDescription binding_description);
     PipelineBuilder& add_vertex_attribute_description(VkVertexInputAttributeDescription attribute_description);
@@ -78,5 +88,6 @@ public:
 	static VkVertexInputAttributeDescription vertex_input_attribute_description(uint32_t binding, uint32_t location, VkFormat format, uint32_t offset);
 
     Device* device;
+    VkPipelineCache pipeline_cache;
     PipelineConfig config;
 };
@@ -0,0 +1,41 @@
+#pragma once
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <filesystem>
+
+class Device;
+
+// What gets written in front of the driver's cache data. Vulkan's own header only identifies the device, so a driver
+// update could still be handed data it doesn't expect. Files that don't match the running GPU and driver exactly, or
+// whose data doesn't hash to what was saved (e.g. a write cut short), are thrown away and the cache starts empty
+struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint32_t padding;
+    uint64_t data_size;
+    uint64_t data_hash;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+};
+
+// A VkPipelineCache that outlives the process, so pipelines compiled on earlier runs come straight out of it
+class PipelineCache {
+public:
+    // @param path - file to load from and save to. Empty keeps the cache in memory only
+    void initialize(Device* device, const std::filesystem::path& path);
+    // @brief Saves the cache to its file and destroys it
+    void cleanup();
+
+    // @brief Writes the cache to its file. The old file is only replaced once the new one is complete
+    bool save();
+
+    Device* device;
+    VkPipelineCache handle;
+    std::filesystem::path path;
+
+private:
+    // @brief The header the current GPU and driver would write, with the data fields left at 0
+    PipelineCacheFileHeader expected_header() const;
+};
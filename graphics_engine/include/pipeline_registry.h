@@ -0,0 +1,45 @@
+#pragma once
+#include "pipeline.h"
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Device;
+
+// Hands out one pipeline per distinct PipelineConfig, and one layout per distinct set of descriptor layouts and push
+// constants. Configs are keyed by a flattened copy of everything PipelineBuilder reads from them, with shaders keyed by
+// the size and two hashes of their SPIR-V and descriptor set layouts by their bindings, so asking twice for the same
+// pipeline builds it once. Both are refcounted: the registry only
+// keeps weak references, a pipeline is destroyed with its last shared_ptr and a layout with the last pipeline using it.
+// Drop a pipeline that submitted frames may still use through Renderer::defer_cleanup
+class PipelineRegistry {
+public:
+    void initialize(Device* device);
+    // @brief Forgets every entry. Pipelines still held elsewhere stay valid until they are released
+    void cleanup();
+
+    // @brief The pipeline for builder's current config, only built if no live pipeline has the same config.
+    // Pipelines that failed to build come back with a null handle and aren't kept
+    std::shared_ptr<Pipeline> build(PipelineBuilder& builder);
+    std::shared_ptr<Pipeline> build_compute(PipelineBuilder& builder);
+
+    // The hash only narrows the search, an entry is used only if its key equals the one asked for
+    struct PipelineEntry {
+        std::vector<uint64_t> key;
+        std::weak_ptr<Pipeline> pipeline;
+    };
+    struct LayoutEntry {
+        std::vector<uint64_t> key;
+        std::weak_ptr<VkPipelineLayout> layout;
+    };
+
+    Device* device;
+    std::unordered_multimap<uint64_t, PipelineEntry> pipelines; // Config key hash -> pipeline
+    std::unordered_multimap<uint64_t, LayoutEntry> layouts;     // Layout key hash -> layout
+
+private:
+    std::shared_ptr<Pipeline> find_or_build(PipelineBuilder& builder, bool compute);
+    std::shared_ptr<VkPipelineLayout> find_or_create_layout(const PipelineConfig& config);
+};
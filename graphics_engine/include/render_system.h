@@ -1,6 +1,8 @@
 #pragma once
 
 #include "command.h"
+#include <string>
+#include <vector>
 
 class Renderer;
 
@@ -8,4 +10,14 @@ class RenderSystem {
 public:
 	virtual void render(Command* cmd) = 0;
 
+	// Called before rendering begins, for work that can't happen inside a render pass (compute, copies, barriers)
+	virtual void prepare(Command* cmd) {}
+
+	// Called after rendering ends, for work that reads this frame's attachments (the depth image is still in GENERAL layout)
+	virtual void finalize(Command* cmd) {}
+
+	// Called between frames when hot reload changed the code of entry_points. Rebuild every pipeline that uses any of them
+	// and swap it in with Renderer::replace_pipeline()
+	virtual void reload_shaders(const std::vector<std::string>& entry_points) {}
+
 };
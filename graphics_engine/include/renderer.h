@@ -8,11 +8,22 @@
 #include "buffer.h"
 #include "descriptor.h"
 #include "pipeline.h"
+#include "pipeline_cache.h"
+#include "pipeline_registry.h"
 #include "asset_loading.h"
+#include "texture_streamer.h"
 #include "render_system.h"
+#include "camera.h"
+#include "scene_graph.h"
 #include "logger.h"
 #include "vulkan/vulkan_core.h"
+#include <atomic>
 #include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <vector>
 #include <string>
 
@@ -22,11 +33,14 @@ struct RendererCreateInfo {
     uint32_t window_height;
     const std::vector<const char*>* validation_layers;
     const std::vector<const char*>* device_extensions;
+    std::filesystem::path cache_directory = {}; // Where caches that survive restarts are kept. Empty disables them
+    bool shader_hot_reload = false;             // Recompile shaders as their files change and rebuild the pipelines using them
 };
 
 class Renderer {
 public:
-    void initialize(RendererCreateInfo* renderer_info);
+    // @brief Returns false if there's no GPU the renderer can run on, in which case nothing else may be called
+    bool initialize(RendererCreateInfo* renderer_info);
     void cleanup();
     void wait_for_idle();
 
@@ -34,6 +48,18 @@ public:
     void resize_callback();
     Renderer& add_render_system(RenderSystem* render_system);
 
+    // @brief Sets the camera for the next draw(). It gets uploaded into that frame's own camera buffer
+    void set_camera(const Camera& camera);
+
+    // @brief Runs cleanup_function once every frame that is currently in flight has finished on the GPU.
+    // Use it to free resources that were replaced mid-run but may still be referenced by submitted frames
+    void defer_cleanup(std::function<void()>&& cleanup_function);
+    void run_deferred_cleanups(bool everything = false);
+
+    // @brief Swaps a rebuilt pipeline in, releasing the old one once the frames in flight are done with it.
+    // If rebuilding failed the old pipeline stays
+    void replace_pipeline(std::shared_ptr<Pipeline>& pipeline, std::shared_ptr<Pipeline> rebuilt);
+
     Buffer create_buffer(
         size_t bytes,
         VkBufferUsageFlags usage_flags,
@@ -64,6 +90,25 @@ public:
         bool use_mipmap = false
     );
 
+    // Same as create_image, but with an explicit mip level count instead of the full chain
+    AllocatedImage create_image_with_mip_levels(
+		VkExtent3D extent,
+        VkFormat format,
+        VkImageUsageFlags usage_flags,
+        uint32_t mip_level_count
+    );
+
+    // @brief Creates an image from precomputed mip levels, e.g. block-compressed data from a KTX2 file
+    // @param level_offsets - byte offset of each level in data, largest level first
+    AllocatedImage create_image_from_mip_levels(
+        const void* data,
+        size_t data_size,
+        std::span<const size_t> level_offsets,
+		VkExtent3D extent,
+        VkFormat format,
+        VkImageUsageFlags usage_flags
+    );
+
     static VkRenderingInfoKHR rendering_info(VkExtent2D extent, uint32_t color_attachment_count, VkRenderingAttachmentInfo* color_attachment_infos, VkRenderingAttachmentInfo* depth_attachment_info);
 
     Window window;
@@ -72,7 +117,9 @@ public:
     Device device;
     DeviceMemoryManager device_memory_manager;
     Swapchain swapchain;
+    PipelineCache pipeline_cache;
     PipelineBuilder pipeline_builder;
+    PipelineRegistry pipeline_registry; // Render systems build through this so identical pipelines are only built once
     std::vector<FrameSync> frame_sync;
     AllocatedImage draw_image;
     AllocatedImage depth_image;
@@ -80,13 +127,38 @@ public:
     std::vector<Command> frame_command;
     ImmediateCommand immediate_command;
     DescriptorBuilder descriptor_builder;
+    BindlessDescriptorTable bindless_descriptors;
     ShaderManager shader_manager;
     std::vector<RenderSystem*> render_systems;
     AssetManager asset_manager;
+    TextureStreamer texture_streamer;
+    SceneGraph scene_graph; // Updated at the start of every draw(), before any render system looks at it
+
+    // The camera of the frame being recorded is in camera_data. Every frame in flight gets its own buffer and set,
+    // which render systems bind at set 0 through camera_descriptors[frame_index]
+    GPUCameraData camera_data;
+    std::vector<Buffer> camera_buffers;
+    std::vector<DescriptorSet> camera_descriptors;
+
+    // Bindless slots for materials without a texture (1x1 white) and the sampler every material uses for now
+    AllocatedImage default_texture;
+    VkSampler default_sampler;
+    uint32_t default_texture_index;
+    uint32_t default_sampler_index;
+
+    struct DeferredCleanup {
+        uint32_t frame_number; // Frame during which the resource stopped being used
+        std::function<void()> function;
+    };
+    std::mutex deferred_cleanup_mutex;
+    std::vector<DeferredCleanup> deferred_cleanups;
+
+    std::filesystem::path cache_directory;
 
     float render_scale;
+    VkExtent2D draw_extent; // Part of draw_image and depth_image rendered to in the current frame
 
     uint32_t frames_in_flight;
-    uint32_t frame_number;
+    std::atomic<uint32_t> frame_number; // Read by defer_cleanup() from loader threads releasing textures
     uint32_t frame_index;
 };
@@ -0,0 +1,42 @@
+#pragma once
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include <cstdint>
+#include <vector>
+
+// Transform hierarchy stored as structure of arrays, one entry per node in every array. A node can only be added after
+// its parent, so parents always come before their children and update() handles the whole hierarchy in one front to
+// back pass: by the time a node is reached, its parent's world matrix is final. Only nodes whose local transform
+// changed, and everything below them, get their world matrix recomputed.
+class SceneGraph {
+public:
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    void initialize();
+    void cleanup();
+
+    // @brief Appends a node under parent, or as a root with NO_NODE. Returns its index
+    uint32_t add_node(uint32_t parent = NO_NODE, glm::vec3 translation = glm::vec3{ 0.0f }, glm::quat rotation = glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f }, glm::vec3 scale = glm::vec3{ 1.0f });
+
+    void set_translation(uint32_t node, glm::vec3 translation);
+    void set_rotation(uint32_t node, glm::quat rotation);
+    void set_scale(uint32_t node, glm::vec3 scale);
+
+    // @brief Recomputes the world matrices of changed nodes and their descendants. Called once per frame by the renderer
+    void update();
+
+    inline uint32_t size() const { return static_cast<uint32_t>(parents.size()); }
+
+    std::vector<uint32_t> parents;
+    std::vector<glm::vec3> translations;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<glm::mat4> world_transforms;
+    std::vector<uint8_t> dirty;         // Local transform changed since the last update()
+    std::vector<uint8_t> world_changed; // World transform changed in the last update(), for whoever mirrors it elsewhere
+
+private:
+    void mark_dirty(uint32_t node);
+
+    bool any_dirty;
+};
@@ -7,24 +7,82 @@
 #include <cstdint>
 #include <string>
 #include <array>
+#include <vector>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <filesystem>
 
+// A file a module was compiled from, and what was in it at the time
+struct ShaderDependency {
+    std::string path;
+    uint64_t content_hash;
+};
+
+// Compiles every .slang file in the shader directory and hands out the SPIR-V of each entry point by name.
+// With a cache directory, each module's SPIR-V is kept on disk along with the files it was built from and the compiler
+// that built it. A module is only compiled again once any of that changes, and Slang isn't even started if none did.
+// Modules that do need compiling are spread over worker threads, each with its own Slang session.
+// With hot reload on, a background thread watches the shader directory and recompiles the modules whose files changed.
+// Their code waits in reloaded_spirv until the render thread takes it with take_reloaded_shaders()
 class ShaderManager {
 public:
-    void initialize();
+    // @param cache_directory - where compiled modules are kept between runs. Empty compiles everything every time
+    // @param hot_reload - watch the shader directory for changes (Linux only)
+    void initialize(const std::filesystem::path& cache_directory = {}, bool hot_reload = false);
+    // @brief Stops watching the shader directory
+    void cleanup();
 
     void find_shaders();
     void compile_shaders();
 
-    inline const uint32_t* get_shader_code(const std::string& shader_name) { return static_cast<const uint32_t*>(compiled_spirv[shader_name]->getBufferPointer()); }
-    inline uint32_t get_shader_code_length(const std::string& shader_name) { return compiled_spirv[shader_name]->getBufferSize(); }
+    // @brief Publishes the code hot reload recompiled since the last call into compiled_spirv
+    // @param entry_points - filled with the entry points whose code actually changed
+    // @return Whether any did. Call from the render thread, between frames
+    bool take_reloaded_shaders(std::vector<std::string>& entry_points);
+
+    inline const uint32_t* get_shader_code(const std::string& shader_name) { return compiled_spirv[shader_name].data(); }
+    inline uint32_t get_shader_code_length(const std::string& shader_name) { return compiled_spirv[shader_name].size() * sizeof(uint32_t); }
 
     std::vector<std::string> found_shaders;
-    std::map<std::string, Slang::ComPtr<slang::IBlob>> compiled_spirv;
+    std::map<std::string, std::vector<uint32_t>> compiled_spirv; // Entry point name -> SPIR-V
+    std::filesystem::path cache_directory;
+
+private:
+    Slang::ComPtr<slang::ISession> create_session(Slang::ComPtr<slang::IGlobalSession>& global_session);
+    // @brief Compiles the modules in parallel into output
+    // @return How many compiled without errors
+    uint32_t compile_modules(const std::vector<std::string>& shader_names, std::map<std::string, std::vector<uint32_t>>& output);
+    // @brief Compiles one module and adds its entry points to output. Safe to call from several threads as long
+    // as each passes its own session
+    bool compile_module(slang::ISession* session, const std::string& shader_name, std::map<std::string, std::vector<uint32_t>>& output);
+    bool load_cached_module(const std::string& shader_name);
+    void save_cached_module(const std::string& shader_name, const std::vector<ShaderDependency>& dependencies, const std::map<std::string, std::vector<uint32_t>>& entry_points);
+    // @brief Whether any file the module was last compiled from changed, or it never compiled at all
+    bool module_modified(const std::string& shader_name) const;
+
+    void watch_shaders(); // Body of watch_thread
+    void reload_modified_shaders();
+
+    std::mutex compile_mutex; // Held by compile workers while they publish their results
+    std::map<std::string, std::vector<ShaderDependency>> module_dependencies;
+
+    std::thread watch_thread;
+    std::atomic<bool> watching;
+    std::mutex reload_mutex; // Guards reloaded_spirv, which the watch thread fills and the render thread empties
+    std::map<std::string, std::vector<uint32_t>> reloaded_spirv;
+};
+
+// Tells shaders apart after their module is gone. Two shaders only count as the same if the size and both
+// independently seeded hashes of the SPIR-V match
+struct ShaderCodeId {
+    uint64_t hash;
+    uint64_t check_hash;
+    size_t size; // In bytes
 };
 
 class Shader {
@@ -41,4 +99,5 @@ public:
     ShaderManager* shader_manager;
     VkShaderModule module;
     VkShaderStageFlagBits stage;
+    ShaderCodeId code_id;
 };
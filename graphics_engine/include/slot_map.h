@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Refers to an item in a SlotMap. The generation makes handles to removed items fail lookups instead of
+// silently finding whatever got added into the same slot afterwards
+struct SlotHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    inline bool operator==(const SlotHandle& other) const { return index == other.index && generation == other.generation; }
+};
+
+// Keeps its items packed in one vector so they can be walked like any array, while handing out handles that stay valid
+// as other items come and go. Removing moves the last item into the hole, so item order is not stable, handles are.
+template <typename T>
+class SlotMap {
+public:
+    SlotHandle insert(T&& item) {
+        uint32_t slot_index;
+        if (free_head != UINT32_MAX) {
+            slot_index = free_head;
+            free_head = slots[slot_index].item_index;
+        } else {
+            slot_index = static_cast<uint32_t>(slots.size());
+            slots.push_back(Slot{ .item_index = 0, .generation = 0 });
+        }
+
+        slots[slot_index].item_index = static_cast<uint32_t>(items.size());
+        items.push_back(std::move(item));
+        item_slots.push_back(slot_index);
+        return SlotHandle{ .index = slot_index, .generation = slots[slot_index].generation };
+    }
+
+    // @brief Returns false if the handle was already removed
+    bool remove(SlotHandle handle) {
+        if (!contains(handle)) return false;
+
+        Slot& slot = slots[handle.index];
+        const uint32_t last_item = static_cast<uint32_t>(items.size()) - 1;
+        if (slot.item_index != last_item) {
+            items[slot.item_index] = std::move(items[last_item]);
+            item_slots[slot.item_index] = item_slots[last_item];
+            slots[item_slots[slot.item_index]].item_index = slot.item_index;
+        }
+        items.pop_back();
+        item_slots.pop_back();
+
+        // Bumping the generation is what invalidates the handles still pointing here
+        slot.generation++;
+        slot.item_index = free_head;
+        free_head = handle.index;
+        return true;
+    }
+
+    bool contains(SlotHandle handle) const {
+        // Free slots are always a generation ahead of the last handle they gave out
+        return handle.index < slots.size() && slots[handle.index].generation == handle.generation;
+    }
+
+    // @brief nullptr if the handle was removed. The pointer is only good until the next insert or remove
+    T* get(SlotHandle handle) {
+        return contains(handle) ? &items[slots[handle.index].item_index] : nullptr;
+    }
+
+    void clear() {
+        // Every slot gets a new generation so no old handle can match again
+        while (!items.empty()) {
+            remove(SlotHandle{ .index = item_slots.back(), .generation = slots[item_slots.back()].generation });
+        }
+    }
+
+    // @brief Handle of the item at a position in items, for code that walks items directly
+    SlotHandle handle_at(size_t item_index) const {
+        const uint32_t slot_index = item_slots[item_index];
+        return SlotHandle{ .index = slot_index, .generation = slots[slot_index].generation };
+    }
+
+    inline size_t size() const { return items.size(); }
+
+    std::vector<T> items;             // Packed, in no particular order
+    std::vector<uint32_t> item_slots; // Slot of each item, parallel to items
+
+private:
+    struct Slot {
+        uint32_t item_index; // Points to the next free slot while the slot is unused
+        uint32_t generation;
+    };
+
+    std::vector<Slot> slots;
+    uint32_t free_head = UINT32_MAX;
+};
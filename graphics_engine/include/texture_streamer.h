@@ -0,0 +1,96 @@
+#pragma once
+#include "image.h"
+#include "buffer.h"
+#include "command.h"
+#include "vulkan/vulkan.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+class Renderer;
+class TextureAsset;
+struct ImageData;
+
+// Keeps every texture's full mip chain in CPU memory and only the levels that are actually needed on the GPU.
+// Textures start out with just their small levels resident. Render systems report how big each texture
+// appears on screen, and update() promotes the ones that need more detail. When that would go over the
+// memory budget, the textures that haven't been needed for the longest get dropped back to their small levels.
+//
+// Changing a texture's levels never waits on the GPU. The new image is filled by the frame's own command buffer:
+// levels the old image already has are copied over on the GPU, only the missing ones are uploaded through a per-frame
+// staging buffer. The texture keeps its old image and bindless slot until that frame has finished.
+class TextureStreamer {
+public:
+    // @param budget_bytes - fixed cap on GPU memory used by streamed textures. 0 follows the driver's reported budget instead
+    void initialize(Renderer* renderer, uint64_t budget_bytes = 0);
+    void cleanup();
+
+    // @brief Takes over the image's CPU data and creates a texture with only the low mip levels resident. Safe to call from loader threads
+    std::shared_ptr<TextureAsset> add_texture(ImageData&& image_data);
+
+    // @brief Records that the texture is visible this frame, covering about screen_size pixels along its longest side
+    void request(const TextureAsset* texture, float screen_size);
+
+    // @brief Records uploads for requested mips and evictions of stale ones into cmd, and swaps in the images earlier frames
+    // finished filling. Called once per frame from the main thread, before any render system records
+    void update(Command* cmd);
+
+    uint64_t current_budget();
+
+    Renderer* renderer;
+    uint64_t budget_bytes;
+    uint64_t resident_bytes;
+    uint32_t initial_max_size;        // Largest level made resident when a texture is added
+    uint32_t max_promotions_per_frame; // Caps how much upload work update() can add to a single frame
+    uint32_t request_timeout_frames;   // Textures not requested for longer than this stop asking for more detail
+    size_t staging_bytes_per_frame;    // Upload space for new levels in each frame in flight, grown if a single level needs more
+
+    // Called whenever a texture's image (and with it its bindless slot) gets replaced
+    std::function<void(TextureAsset* texture)> on_texture_changed;
+
+private:
+    // A texture's next image, filled by the commands of frame_number and swapped in once that frame is done
+    struct PendingImage {
+        AllocatedImage image;
+        uint32_t base_level;
+        uint32_t frame_number;
+    };
+
+    struct StreamedTexture {
+        std::weak_ptr<TextureAsset> texture;
+        VkFormat format;
+        VkExtent3D extent;
+        std::vector<uint8_t> data;         // Every mip level back to back, largest first
+        std::vector<size_t> level_offsets;
+        uint32_t initial_level;            // Level the texture falls back to when evicted
+        uint32_t resident_level;           // Largest level currently on the GPU
+        uint32_t wanted_level;             // Largest level requested by the render systems
+        uint64_t last_requested_frame;
+        std::optional<PendingImage> pending; // resident_bytes already counts its levels instead of the current image's
+    };
+
+    struct StagingBuffer {
+        Buffer buffer;
+        size_t capacity;
+        size_t used; // Starts over every frame, the frame's fence has been waited on by then
+    };
+
+    size_t resident_size(const StreamedTexture& streamed, uint32_t base_level);
+    // @brief Where the staged levels [first_level, end_level) would end if written to a staging buffer starting at offset
+    size_t staged_end(const StreamedTexture& streamed, uint32_t first_level, uint32_t end_level, size_t offset);
+    AllocatedImage create_level_image(const StreamedTexture& streamed, uint32_t base_level);
+    void ensure_staging_capacity(StagingBuffer& staging, size_t bytes);
+    // @brief Records filling a new image with levels [base_level, end) into cmd and leaves it pending on streamed
+    void record_level_change(Command* cmd, StreamedTexture& streamed, TextureAsset* texture, uint32_t base_level);
+    // @brief Hands the texture its finished pending image. If the bindless table has no slot left the old one stays
+    void swap_in_pending(StreamedTexture& streamed, TextureAsset* texture);
+    bool evict_one(Command* cmd, const StreamedTexture* keep);
+
+    std::mutex textures_mutex;
+    std::unordered_map<const TextureAsset*, StreamedTexture> textures;
+    std::vector<StagingBuffer> staging_buffers; // One per frame in flight
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A fixed set of worker threads pulling jobs off a shared queue. Used for any CPU work
+// that should not stall the main loop (file I/O, decoding, staging uploads).
+class ThreadPool {
+public:
+    // @brief Spawns the worker threads
+    // @param thread_count - number of workers. 0 uses all hardware threads except the main thread's
+    void initialize(uint32_t thread_count = 0);
+    void cleanup();
+
+    // @brief Queue a job and get a future to its result
+    template<typename Function>
+    std::future<std::invoke_result_t<Function>> submit(Function&& function) {
+        using ResultType = std::invoke_result_t<Function>;
+
+        // packaged_task is move-only, but std::function needs something copyable
+        auto task = std::make_shared<std::packaged_task<ResultType()>>(std::forward<Function>(function));
+        std::future<ResultType> result = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return result;
+    }
+
+    void enqueue(std::function<void()>&& job);
+
+    // @brief Calls function(i) for every i in [0, count) spread across the workers, returning once all calls are done.
+    // The calling thread works through indices as well, so this is safe to call from inside a pool job
+    void parallel_for(size_t count, const std::function<void(size_t index)>& function);
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_available;
+    bool stopping;
+
+private:
+    void worker_loop();
+};
@@ -15,11 +15,42 @@ void DeviceMemoryManager::initialize(Device* device, Instance* instance) {
 		.instance = instance->handle,
 	};
 
+	// With the budget extension VMA reports what the driver actually has left instead of estimating from the heap sizes
+	if (device->extension_enabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+		allocator_create_info.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+	}
+
 	if (vmaCreateAllocator(&allocator_create_info, &allocator) != VK_SUCCESS) {
         Logger::logError("Failed to create the VMA allocator!");
 	}
 }
 
+uint64_t DeviceMemoryManager::available_device_local_bytes() {
+	VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+	vmaGetHeapBudgets(allocator, budgets);
+
+	const VkPhysicalDeviceMemoryProperties* memory_properties;
+	vmaGetMemoryProperties(allocator, &memory_properties);
+
+	uint64_t available = 0;
+	for (uint32_t i_heap = 0; i_heap < memory_properties->memoryHeapCount; i_heap++) {
+		if (!(memory_properties->memoryHeaps[i_heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)) continue;
+		if (budgets[i_heap].budget > budgets[i_heap].usage) available += budgets[i_heap].budget - budgets[i_heap].usage;
+	}
+	return available;
+}
+
+uint64_t DeviceMemoryManager::device_local_heap_bytes() {
+	const VkPhysicalDeviceMemoryProperties* memory_properties;
+	vmaGetMemoryProperties(allocator, &memory_properties);
+
+	uint64_t heap_bytes = 0;
+	for (uint32_t i_heap = 0; i_heap < memory_properties->memoryHeapCount; i_heap++) {
+		if (memory_properties->memoryHeaps[i_heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) heap_bytes += memory_properties->memoryHeaps[i_heap].size;
+	}
+	return heap_bytes;
+}
+
 void DeviceMemoryManager::cleanup() {
 	vmaDestroyAllocator(allocator);
 }
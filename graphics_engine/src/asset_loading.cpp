@@ -1,27 +1,588 @@
 #include "asset_loading.h"
 #include "fastgltf/core.hpp"
 #include "fastgltf/types.hpp"
+#include "fastgltf/tools.hpp"
 #include "mesh.h"
 #include "logger.h"
+#include "hash.h"
+#include "ktx.h"
+#include "renderer.h"
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <memory>
 #include <optional>
+#include <span>
+#include <variant>
+#include <string_view>
 #include <vector>
 
-void MeshAsset::cleanup() {
-    GPU_mesh_buffers.cleanup();
-}
-
 void AssetManager::initialize(Renderer* renderer) {
     this->renderer = renderer;
+    thread_pool.initialize();
+    build_collision_meshes = true;
+}
+
+void AssetManager::cleanup() {
+    // Let any in-flight loads finish so nothing is still uploading when the device goes away
+    thread_pool.cleanup();
+    pending_loads.clear();
+}
+
+static std::string canonical_path_key(const std::filesystem::path& filepath) {
+    std::error_code error;
+    std::filesystem::path canonical_path = std::filesystem::weakly_canonical(filepath, error);
+    return error ? filepath.string() : canonical_path.string();
+}
+
+bool AssetManager::source_file_matches(const SceneSource& source, std::span<const std::byte> file_bytes) {
+    if (source.file_size != file_bytes.size()) return false;
+
+    std::error_code error;
+    if (std::filesystem::file_size(source.path, error) != source.file_size || error) return false;
+    if (std::filesystem::last_write_time(source.path, error) != source.last_write_time || error) return false;
+
+    std::ifstream file(source.path, std::ios::binary);
+    std::vector<std::byte> source_bytes(source.file_size);
+    if (!file.read(reinterpret_cast<char*>(source_bytes.data()), static_cast<std::streamsize>(source_bytes.size()))) return false;
+    return std::memcmp(source_bytes.data(), file_bytes.data(), file_bytes.size()) == 0;
+}
+
+MeshLoadResult AssetManager::load_mesh_GLTF(std::filesystem::path filepath) {
+    std::optional<SceneAsset> scene = load_scene_GLTF(filepath);
+    if (!scene.has_value()) {
+        return {};
+    }
+    return std::move(scene->meshes);
+}
+
+std::optional<SceneAsset> AssetManager::load_scene_GLTF(std::filesystem::path filepath) {
+    const std::string path_key = canonical_path_key(filepath);
+
+    std::error_code error;
+    uintmax_t file_size = std::filesystem::file_size(path_key, error);
+    if (error) {
+        Logger::logError("The file couldn't be loaded: " + path_key);
+        return {};
+    }
+    std::filesystem::file_time_type last_write_time = std::filesystem::last_write_time(path_key, error);
+
+    const SceneSource source{
+        .path = path_key,
+        .file_size = file_size,
+        .last_write_time = last_write_time,
+    };
+
+    // If the file hasn't been touched since its scene was parsed, we can skip reading it entirely
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto record = file_records.find(path_key);
+        if (record != file_records.end() && record->second.file_size == file_size && record->second.last_write_time == last_write_time) {
+            auto cached_scene = find_cached_scene(record->second.content_hash, source);
+            if (cached_scene.has_value()) {
+                Logger::log("Using cached GLTF: " + path_key);
+                return cached_scene;
+            }
+        }
+    }
+
+    // Read the whole file once, hash it, and then hand the same bytes to the parser
+    std::vector<std::byte> file_bytes(file_size);
+    std::ifstream file(path_key, std::ios::binary);
+    if (!file.read(reinterpret_cast<char*>(file_bytes.data()), static_cast<std::streamsize>(file_size))) {
+        Logger::logError("The file couldn't be read: " + path_key);
+        return {};
+    }
+    file.close();
+    uint64_t content_hash = Hash::hash_bytes(file_bytes.data(), file_bytes.size());
+
+    std::optional<SceneSource> cached_source;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        file_records[path_key] = FileRecord{
+            .content_hash = content_hash,
+            .file_size = file_size,
+            .last_write_time = last_write_time,
+        };
+        auto cached = scene_cache.find(content_hash);
+        if (cached != scene_cache.end()) cached_source = cached->second.source;
+    }
+
+    // The same content may already be resident, possibly under a different path. The hash alone could collide,
+    // so the bytes are compared against the file the cached scene came from, done outside the lock since it reads from disk
+    if (cached_source.has_value() && (*cached_source == source || source_file_matches(*cached_source, file_bytes))) {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto cached_scene = find_cached_scene(content_hash, *cached_source);
+        if (cached_scene.has_value()) {
+            Logger::log("Using cached GLTF: " + path_key);
+            return cached_scene;
+        }
+    }
+
+    auto scene_data = parse_scene_GLTF(path_key, file_bytes);
+    if (!scene_data.has_value()) {
+        return {};
+    }
+
+    std::vector<std::shared_ptr<MaterialAsset>> materials = upload_materials(scene_data->images, scene_data->materials);
+
+    SceneAsset scene;
+    scene.nodes = std::move(scene_data->nodes);
+    scene.meshes = upload_meshes(scene_data->meshes, materials);
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        CachedScene& cached_scene = scene_cache[content_hash];
+        cached_scene.nodes = scene.nodes;
+        cached_scene.meshes.assign(scene.meshes.begin(), scene.meshes.end());
+        cached_scene.source = source;
+    }
+    return scene;
+}
+
+std::optional<SceneAsset> AssetManager::find_cached_scene(uint64_t content_hash, const SceneSource& expected_source) {
+    // Expects cache_mutex to already be held. The entry only counts if it still came from the source the caller checked
+    auto entry = scene_cache.find(content_hash);
+    if (entry == scene_cache.end() || !(entry->second.source == expected_source)) {
+        return {};
+    }
+
+    SceneAsset scene;
+    scene.nodes = entry->second.nodes;
+    scene.meshes.reserve(entry->second.meshes.size());
+    for (auto& weak_mesh : entry->second.meshes) {
+        std::shared_ptr<MeshAsset> mesh = weak_mesh.lock();
+        if (!mesh) {
+            // Someone let go of part of this file, so it has to be loaded again
+            scene_cache.erase(entry);
+            return {};
+        }
+        scene.meshes.push_back(std::move(mesh));
+    }
+    return scene;
 }
 
-std::optional<std::vector<std::shared_ptr<MeshAsset>>> AssetManager::load_mesh_GLTF(std::filesystem::path filepath) {
+std::shared_future<MeshLoadResult> AssetManager::load_mesh_GLTF_async(std::filesystem::path filepath, MeshLoadCallback on_loaded) {
+    std::string path_key = canonical_path_key(filepath);
+
+    // Piggyback on a load of the same file that's still in flight instead of parsing it twice
+    std::shared_future<MeshLoadResult> result;
+    for (auto& pending_load : pending_loads) {
+        if (pending_load.canonical_path == path_key) {
+            result = pending_load.result;
+            break;
+        }
+    }
+
+    if (!result.valid()) {
+        result = thread_pool.submit([this, filepath]() {
+            return load_mesh_GLTF(filepath);
+        }).share();
+    }
+
+    pending_loads.push_back(PendingLoad{
+        .canonical_path = std::move(path_key),
+        .result = result,
+        .on_loaded = std::move(on_loaded),
+    });
+    return result;
+}
+
+void AssetManager::publish_completed_loads() {
+    bool any_completed = false;
+    for (auto it = pending_loads.begin(); it != pending_loads.end();) {
+        if (it->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            it++;
+            continue;
+        }
+        if (it->on_loaded) it->on_loaded(it->result.get());
+        it = pending_loads.erase(it);
+        any_completed = true;
+    }
+
+    // Lookups only clean up under their own key, so geometry nobody asks for again is swept out here, once per batch of loads
+    if (any_completed) prune_geometry_cache();
+}
+
+std::shared_ptr<TextureAsset> AssetManager::upload_texture(ImageData& data) {
+    if (data.pixels.empty()) return nullptr;
+
+    // Compressed formats are optional, so check before creating anything
+    if (!renderer->device.supports_format_features(data.format, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT)) {
+        Logger::logError("Texture format " + std::to_string(data.format) + " isn't supported by this GPU: " + data.name);
+        return nullptr;
+    }
+
+    // Only the small mip levels go up now, the streamer brings in the rest once something shows it up close.
+    // Like the geometry, the texture is freed when the last material referencing it goes away
+    return renderer->texture_streamer.add_texture(std::move(data));
+}
+
+std::shared_ptr<TextureAsset> AssetManager::load_texture_KTX2(std::filesystem::path filepath) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file) {
+        Logger::logError("The file couldn't be loaded: " + filepath.string());
+        return nullptr;
+    }
+    std::vector<std::byte> file_bytes(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(file_bytes.data()), static_cast<std::streamsize>(file_bytes.size()));
+
+    std::optional<KTXTexture> ktx_texture = KTX::load_KTX2(file_bytes);
+    if (!ktx_texture.has_value()) {
+        Logger::logError("Failed to load KTX2 texture: " + filepath.string());
+        return nullptr;
+    }
+
+    const std::byte* ktx_data = ktx_texture->data.data();
+    ImageData image_data{
+        .name = filepath.filename().string(),
+        .width = ktx_texture->extent.width,
+        .height = ktx_texture->extent.height,
+        .format = ktx_texture->format,
+        .pixels = std::vector<uint8_t>(reinterpret_cast<const uint8_t*>(ktx_data), reinterpret_cast<const uint8_t*>(ktx_data) + ktx_texture->data.size()),
+        .level_offsets = std::move(ktx_texture->level_offsets),
+    };
+    return upload_texture(image_data);
+}
+
+std::vector<std::shared_ptr<MaterialAsset>> AssetManager::upload_materials(std::vector<ImageData>& image_data, const std::vector<MaterialData>& material_data) {
+    // The uploads all go through the immediate command, so there's nothing to gain from spreading them across threads
+    std::vector<std::shared_ptr<TextureAsset>> textures(image_data.size());
+    for (size_t i_image = 0; i_image < image_data.size(); i_image++) {
+        textures[i_image] = upload_texture(image_data[i_image]);
+    }
+
+    std::vector<std::shared_ptr<MaterialAsset>> materials;
+    materials.reserve(material_data.size());
+    for (const MaterialData& data : material_data) {
+        auto material = std::make_shared<MaterialAsset>();
+        material->name = data.name;
+        material->base_color_factor = data.base_color_factor;
+        material->base_color_texture = data.base_color_image >= 0 ? textures[data.base_color_image] : nullptr;
+        if (!material->base_color_texture && data.base_color_fallback_image >= 0) {
+            material->base_color_texture = textures[data.base_color_fallback_image];
+        }
+        material->alpha_mode = data.alpha_mode;
+        material->alpha_cutoff = data.alpha_cutoff;
+        material->double_sided = data.double_sided;
+        materials.push_back(std::move(material));
+    }
+    return materials;
+}
+
+// Not the tightest sphere, but cheap: centered on the bounding box and wide enough to reach the furthest vertex
+// Returns the bounding sphere and fills in the axis aligned box around the vertices
+static glm::vec4 compute_bounds(std::span<const MeshVertex> vertices, glm::vec3& min_corner, glm::vec3& max_corner) {
+    if (vertices.empty()) {
+        min_corner = max_corner = glm::vec3{ 0.0f };
+        return glm::vec4{ 0.0f };
+    }
+
+    min_corner = vertices[0].position;
+    max_corner = vertices[0].position;
+    for (const MeshVertex& vertex : vertices) {
+        min_corner = glm::min(min_corner, vertex.position);
+        max_corner = glm::max(max_corner, vertex.position);
+    }
+
+    glm::vec3 center = (min_corner + max_corner) * 0.5f;
+    float radius_squared = 0.0f;
+    for (const MeshVertex& vertex : vertices) {
+        glm::vec3 offset = vertex.position - center;
+        radius_squared = std::max(radius_squared, glm::dot(offset, offset));
+    }
+    return glm::vec4{ center, std::sqrt(radius_squared) };
+}
+
+std::vector<std::shared_ptr<MeshAsset>> AssetManager::upload_meshes(std::vector<MeshData>& mesh_data, const std::vector<std::shared_ptr<MaterialAsset>>& materials) {
+    std::vector<std::shared_ptr<MeshAsset>> meshes;
+    meshes.reserve(mesh_data.size());
+
+    // BVH builds are the slow part of loading large meshes, and unlike the uploads they don't need to take turns
+    std::vector<std::shared_ptr<CollisionMesh>> collision_meshes(mesh_data.size());
+    if (build_collision_meshes) {
+        thread_pool.parallel_for(mesh_data.size(), [&](size_t i_mesh) {
+            collision_meshes[i_mesh] = find_or_build_collision_mesh(mesh_data[i_mesh]);
+        });
+    }
+
+    for (size_t i_mesh = 0; i_mesh < mesh_data.size(); i_mesh++) {
+        MeshData& data = mesh_data[i_mesh];
+        MeshAsset new_mesh_asset;
+        new_mesh_asset.name = data.name;
+        glm::vec3 mesh_min, mesh_max;
+        new_mesh_asset.bounding_sphere = compute_bounds(data.vertices, mesh_min, mesh_max);
+        new_mesh_asset.GPU_mesh_buffers = find_or_upload_geometry(data);
+        new_mesh_asset.collision_mesh = std::move(collision_meshes[i_mesh]);
+        new_mesh_asset.surfaces = std::move(data.surfaces);
+        for (size_t i_surface = 0; i_surface < new_mesh_asset.surfaces.size(); i_surface++) {
+            int32_t material_index = data.surface_materials[i_surface];
+            if (material_index >= 0) new_mesh_asset.surfaces[i_surface].material = materials[material_index];
+        }
+        new_mesh_asset.instance_transforms = std::move(data.instance_transforms);
+
+        // Everything on the GPU side is shared and frees itself, so holders only need to drop their reference
+        meshes.emplace_back(std::make_shared<MeshAsset>(std::move(new_mesh_asset)));
+    }
+    return meshes;
+}
+
+AssetManager::GeometryHash AssetManager::hash_geometry(const MeshData& mesh_data) {
+    // The check hash goes over the data in the other order and with its own seed, so it doesn't collide along with the key
+    const size_t vertex_bytes = mesh_data.vertices.size() * sizeof(MeshVertex);
+    const size_t index_bytes = mesh_data.indices.size() * sizeof(uint32_t);
+    const uint64_t key = Hash::hash_bytes(mesh_data.indices.data(), index_bytes, Hash::hash_bytes(mesh_data.vertices.data(), vertex_bytes));
+    const uint64_t check_seed = 0x2545f4914f6cdd1dULL;
+    const uint64_t check = Hash::hash_bytes(mesh_data.vertices.data(), vertex_bytes, Hash::hash_bytes(mesh_data.indices.data(), index_bytes, check_seed));
+    return GeometryHash{ .key = key, .check = check };
+}
+
+static bool geometry_unused(const auto& entry) {
+    return entry.second.buffers.expired() && entry.second.collision_mesh.expired();
+}
+
+AssetManager::CachedGeometry* AssetManager::find_cached_geometry(const GeometryHash& geometry_hash, const MeshData& mesh_data) {
+    // Expects cache_mutex to already be held
+    auto [entry, last] = geometry_cache.equal_range(geometry_hash.key);
+    CachedGeometry* match = nullptr;
+    while (entry != last) {
+        if (geometry_unused(*entry)) {
+            entry = geometry_cache.erase(entry);
+            continue;
+        }
+        CachedGeometry& cached = entry->second;
+        if (!match && cached.check_hash == geometry_hash.check && cached.vertex_count == mesh_data.vertices.size() && cached.index_count == mesh_data.indices.size()) {
+            match = &cached;
+        }
+        entry++;
+    }
+    return match;
+}
+
+AssetManager::CachedGeometry& AssetManager::find_or_add_cached_geometry(const GeometryHash& geometry_hash, const MeshData& mesh_data) {
+    // Expects cache_mutex to already be held
+    if (CachedGeometry* cached = find_cached_geometry(geometry_hash, mesh_data)) {
+        return *cached;
+    }
+
+    auto entry = geometry_cache.emplace(geometry_hash.key, CachedGeometry{
+        .check_hash = geometry_hash.check,
+        .vertex_count = mesh_data.vertices.size(),
+        .index_count = mesh_data.indices.size(),
+    });
+    return entry->second;
+}
+
+void AssetManager::prune_geometry_cache() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::erase_if(geometry_cache, [](const auto& entry) { return geometry_unused(entry); });
+}
+
+std::shared_ptr<GPUMeshBuffer> AssetManager::find_or_upload_geometry(MeshData& mesh_data) {
+    const GeometryHash geometry_hash = hash_geometry(mesh_data);
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (CachedGeometry* cached = find_cached_geometry(geometry_hash, mesh_data)) {
+            if (std::shared_ptr<GPUMeshBuffer> buffers = cached->buffers.lock()) {
+                return buffers;
+            }
+        }
+    }
+
+    // The deleter frees the GPU memory, so meshes sharing these buffers only need to drop their reference
+    std::shared_ptr<GPUMeshBuffer> buffers(new GPUMeshBuffer(), [](GPUMeshBuffer* buffers) {
+        buffers->cleanup();
+        delete buffers;
+    });
+    buffers->upload_to_GPU(renderer, mesh_data.vertices, mesh_data.indices);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    CachedGeometry& cached = find_or_add_cached_geometry(geometry_hash, mesh_data);
+    if (std::shared_ptr<GPUMeshBuffer> existing = cached.buffers.lock()) {
+        return existing; // Another thread uploaded the same geometry in the meantime, so use theirs and let ours go
+    }
+    cached.buffers = buffers;
+    return buffers;
+}
+
+std::shared_ptr<CollisionMesh> AssetManager::find_or_build_collision_mesh(const MeshData& mesh_data) {
+    const GeometryHash geometry_hash = hash_geometry(mesh_data);
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (CachedGeometry* cached = find_cached_geometry(geometry_hash, mesh_data)) {
+            if (std::shared_ptr<CollisionMesh> collision_mesh = cached->collision_mesh.lock()) {
+                return collision_mesh;
+            }
+        }
+    }
+
+    std::shared_ptr<CollisionMesh> collision_mesh = std::make_shared<CollisionMesh>();
+    collision_mesh->build(mesh_data.vertices, mesh_data.indices);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    CachedGeometry& cached = find_or_add_cached_geometry(geometry_hash, mesh_data);
+    if (std::shared_ptr<CollisionMesh> existing = cached.collision_mesh.lock()) {
+        return existing;
+    }
+    cached.collision_mesh = collision_mesh;
+    return collision_mesh;
+}
+
+static glm::mat4 to_glm_matrix(const fastgltf::math::fmat4x4& matrix) {
+    // Both are column-major float[4][4]
+    glm::mat4 result;
+    std::memcpy(glm::value_ptr(result), matrix.data(), sizeof(glm::mat4));
+    return result;
+}
+
+// Expands a node's EXT_mesh_gpu_instancing attributes into one local transform per instance
+static std::vector<glm::mat4> load_node_instances(const fastgltf::Asset& asset, const fastgltf::Node& node) {
+    std::vector<glm::mat4> instances;
+    if (node.instancingAttributes.empty()) return instances;
+
+    auto find_accessor = [&](std::string_view name) -> const fastgltf::Accessor* {
+        for (const auto& attribute : node.instancingAttributes) {
+            if (std::string_view(attribute.name) == name) return &asset.accessors[attribute.accessorIndex];
+        }
+        return nullptr;
+    };
+    const fastgltf::Accessor* translation_accessor = find_accessor("TRANSLATION");
+    const fastgltf::Accessor* rotation_accessor = find_accessor("ROTATION");
+    const fastgltf::Accessor* scale_accessor = find_accessor("SCALE");
+
+    // All present attributes must have the same count, but any of them may be missing
+    size_t instance_count = 0;
+    for (const fastgltf::Accessor* accessor : { translation_accessor, rotation_accessor, scale_accessor }) {
+        if (accessor) instance_count = std::max(instance_count, accessor->count);
+    }
+
+    std::vector<glm::vec3> translations(instance_count, glm::vec3{ 0.0f });
+    std::vector<glm::quat> rotations(instance_count, glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f });
+    std::vector<glm::vec3> scales(instance_count, glm::vec3{ 1.0f });
+
+    if (translation_accessor) {
+        fastgltf::iterateAccessorWithIndex<glm::vec3>(asset, *translation_accessor,
+            [&](glm::vec3 translation, size_t index) { translations[index] = translation; });
+    }
+    if (rotation_accessor) {
+        // glTF stores quaternions as xyzw, glm's constructor takes wxyz
+        fastgltf::iterateAccessorWithIndex<glm::vec4>(asset, *rotation_accessor,
+            [&](glm::vec4 rotation, size_t index) { rotations[index] = glm::quat{ rotation.w, rotation.x, rotation.y, rotation.z }; });
+    }
+    if (scale_accessor) {
+        fastgltf::iterateAccessorWithIndex<glm::vec3>(asset, *scale_accessor,
+            [&](glm::vec3 scale, size_t index) { scales[index] = scale; });
+    }
+
+    instances.reserve(instance_count);
+    for (size_t i_instance = 0; i_instance < instance_count; i_instance++) {
+        instances.push_back(
+            glm::translate(glm::mat4{ 1.0f }, translations[i_instance]) *
+            glm::mat4_cast(rotations[i_instance]) *
+            glm::scale(glm::mat4{ 1.0f }, scales[i_instance])
+        );
+    }
+    return instances;
+}
+
+// Decodes PNG/JPEG to RGBA8 and unpacks KTX2 containers as they are
+static ImageData decode_image_bytes(std::string name, std::span<const std::byte> bytes) {
+    ImageData decoded{
+        .name = std::move(name),
+        .width = 0,
+        .height = 0,
+        .format = VK_FORMAT_R8G8B8A8_UNORM,
+    };
+
+    if (KTX::is_KTX2(bytes)) {
+        std::optional<KTXTexture> ktx_texture = KTX::load_KTX2(bytes);
+        if (!ktx_texture.has_value()) {
+            Logger::logError("Failed to load KTX2 GLTF image: " + decoded.name);
+            return decoded;
+        }
+        const uint8_t* ktx_data = reinterpret_cast<const uint8_t*>(ktx_texture->data.data());
+        decoded.width = ktx_texture->extent.width;
+        decoded.height = ktx_texture->extent.height;
+        decoded.format = ktx_texture->format;
+        decoded.pixels.assign(ktx_data, ktx_data + ktx_texture->data.size());
+        decoded.level_offsets = std::move(ktx_texture->level_offsets);
+        return decoded;
+    }
+
+    int width = 0;
+    int height = 0;
+    int channel_count;
+    stbi_uc* pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(bytes.data()), static_cast<int>(bytes.size()), &width, &height, &channel_count, 4);
+    if (!pixels) {
+        Logger::logError("Failed to decode GLTF image: " + decoded.name);
+        return decoded;
+    }
+
+    decoded.width = static_cast<uint32_t>(width);
+    decoded.height = static_cast<uint32_t>(height);
+    decoded.pixels.assign(pixels, pixels + static_cast<size_t>(width) * height * 4);
+    stbi_image_free(pixels);
+    return decoded;
+}
+
+// Gets the encoded bytes of any glTF image source and decodes them. External files are read relative to the glTF file
+static ImageData decode_image(const fastgltf::Asset& asset, const fastgltf::Image& image, const std::filesystem::path& directory) {
+    std::string name(image.name);
+    std::vector<std::byte> file_bytes; // Only used for external files
+    std::span<const std::byte> encoded_bytes;
+
+    std::visit(fastgltf::visitor{
+        [](const auto&) {},
+        [&](const fastgltf::sources::URI& file_source) {
+            if (!file_source.uri.isLocalPath()) return; // We don't fetch anything over the network
+            std::ifstream file(directory / file_source.uri.fspath(), std::ios::binary | std::ios::ate);
+            if (!file) return;
+            file_bytes.resize(static_cast<size_t>(file.tellg()));
+            file.seekg(0);
+            file.read(reinterpret_cast<char*>(file_bytes.data()), static_cast<std::streamsize>(file_bytes.size()));
+            encoded_bytes = file_bytes;
+        },
+        [&](const fastgltf::sources::Array& array) {
+            encoded_bytes = std::span<const std::byte>(array.bytes.data(), array.bytes.size());
+        },
+        [&](const fastgltf::sources::BufferView& view) {
+            // GLB files pack their images into the binary chunk
+            const fastgltf::BufferView& buffer_view = asset.bufferViews[view.bufferViewIndex];
+            const fastgltf::Buffer& buffer = asset.buffers[buffer_view.bufferIndex];
+            std::visit(fastgltf::visitor{
+                [](const auto&) {},
+                [&](const fastgltf::sources::Array& array) {
+                    encoded_bytes = std::span<const std::byte>(array.bytes.data() + buffer_view.byteOffset, buffer_view.byteLength);
+                },
+            }, buffer.data);
+        },
+    }, image.data);
+
+    if (encoded_bytes.empty()) {
+        Logger::logError("Couldn't read GLTF image data: " + name);
+        return ImageData{ .name = std::move(name), .width = 0, .height = 0, .format = VK_FORMAT_UNDEFINED };
+    }
+    return decode_image_bytes(std::move(name), encoded_bytes);
+}
+
+std::optional<SceneData> AssetManager::parse_scene_GLTF(const std::filesystem::path& filepath, std::span<const std::byte> file_bytes) {
     Logger::log("Loading GLTF: " + filepath.string());
 
-    fastgltf::Parser parser{};
+    // KHR_texture_basisu lets textures point at a KTX2 image alongside a PNG/JPEG fallback
+    fastgltf::Parser parser{ fastgltf::Extensions::EXT_mesh_gpu_instancing | fastgltf::Extensions::KHR_texture_basisu };
 
     // Structure that holds information for reading data
-    auto GLTF_data = fastgltf::GltfDataBuffer::FromPath(filepath);
+    auto GLTF_data = fastgltf::GltfDataBuffer::FromBytes(file_bytes.data(), file_bytes.size());
     if (GLTF_data.error() != fastgltf::Error::None) {
         Logger::logError("The file couldn't be loaded: " + filepath.string() + " or the buffer could not be created");
         return {};
@@ -35,18 +596,16 @@ std::optional<std::vector<std::shared_ptr<MeshAsset>>> AssetManager::load_mesh_G
         return {};
     }
 
-    std::vector<std::shared_ptr<MeshAsset>> meshes;
+    std::vector<MeshData> meshes;
+    meshes.reserve(asset->meshes.size());
 
-    std::vector<uint32_t> indices;
-    std::vector<MeshVertex> vertices;
     for (fastgltf::Mesh& mesh : asset->meshes) {
-        MeshAsset new_mesh_asset;
-
-        new_mesh_asset.name = mesh.name;
+        MeshData new_mesh;
+        new_mesh.name = mesh.name;
 
-        // clear the mesh arrays each mesh, we dont want to merge them by error
-        indices.clear();
-        vertices.clear();
+        // Each mesh gets its own arrays, we dont want to merge them by error
+        std::vector<uint32_t>& indices = new_mesh.indices;
+        std::vector<MeshVertex>& vertices = new_mesh.vertices;
 
         for (auto&& primitive : mesh.primitives) {
             GeometricSurface new_surface;
@@ -113,7 +672,12 @@ std::optional<std::vector<std::shared_ptr<MeshAsset>>> AssetManager::load_mesh_G
                         vertices[initial_vertex + index].color = color;
                     });
             }
-            new_mesh_asset.surfaces.push_back(new_surface);
+            // Each primitive brings its own vertices, so they bound exactly this surface
+            std::span<const MeshVertex> surface_vertices(vertices.data() + initial_vertex, vertices.size() - initial_vertex);
+            new_surface.bounding_sphere = compute_bounds(surface_vertices, new_surface.aabb_min, new_surface.aabb_max);
+
+            new_mesh.surfaces.push_back(new_surface);
+            new_mesh.surface_materials.push_back(primitive.materialIndex.has_value() ? static_cast<int32_t>(primitive.materialIndex.value()) : -1);
         }
 
         // Display the vertex normals instead of the actual colors
@@ -124,10 +688,111 @@ std::optional<std::vector<std::shared_ptr<MeshAsset>>> AssetManager::load_mesh_G
             }
         }
 
-        new_mesh_asset.GPU_mesh_buffers.upload_to_GPU(renderer, vertices, indices);
+        meshes.push_back(std::move(new_mesh));
+    }
 
-        meshes.emplace_back(std::make_shared<MeshAsset>(std::move(new_mesh_asset)));
+    // Import the node hierarchy. Nodes are visited depth first from the scene roots so that parents always end up before their children
+    std::vector<size_t> root_nodes;
+    size_t scene_index = asset->defaultScene.has_value() ? asset->defaultScene.value() : 0;
+    if (scene_index < asset->scenes.size()) {
+        root_nodes.assign(asset->scenes[scene_index].nodeIndices.begin(), asset->scenes[scene_index].nodeIndices.end());
+    } else {
+        // No scenes in the file, so every node without a parent is a root
+        std::vector<bool> has_parent(asset->nodes.size(), false);
+        for (const fastgltf::Node& node : asset->nodes) {
+            for (size_t child : node.children) has_parent[child] = true;
+        }
+        for (size_t i_node = 0; i_node < asset->nodes.size(); i_node++) {
+            if (!has_parent[i_node]) root_nodes.push_back(i_node);
+        }
     }
 
-    return meshes;
+    struct NodeToVisit {
+        size_t GLTF_index;
+        int32_t parent_index;
+    };
+    std::vector<NodeToVisit> node_stack;
+    for (auto root = root_nodes.rbegin(); root != root_nodes.rend(); root++) {
+        node_stack.push_back({ *root, -1 });
+    }
+
+    std::vector<SceneNodeAsset> nodes;
+    nodes.reserve(asset->nodes.size());
+    while (!node_stack.empty()) {
+        NodeToVisit to_visit = node_stack.back();
+        node_stack.pop_back();
+        fastgltf::Node& GLTF_node = asset->nodes[to_visit.GLTF_index];
+
+        SceneNodeAsset node{
+            .name = std::string(GLTF_node.name),
+            .parent_index = to_visit.parent_index,
+            .mesh_index = GLTF_node.meshIndex.has_value() ? static_cast<int32_t>(GLTF_node.meshIndex.value()) : -1,
+            .local_transform = to_glm_matrix(fastgltf::getTransformMatrix(GLTF_node)),
+        };
+        node.world_transform = node.parent_index < 0 ? node.local_transform : nodes[node.parent_index].world_transform * node.local_transform;
+
+        // Every node that places a mesh (and every EXT_mesh_gpu_instancing instance of it) becomes one instance of that mesh
+        if (node.mesh_index >= 0) {
+            std::vector<glm::mat4>& instance_transforms = meshes[node.mesh_index].instance_transforms;
+            std::vector<glm::mat4> GPU_instances = load_node_instances(asset.get(), GLTF_node);
+            if (GPU_instances.empty()) {
+                instance_transforms.push_back(node.world_transform);
+            }
+            for (const glm::mat4& instance : GPU_instances) {
+                instance_transforms.push_back(node.world_transform * instance);
+            }
+        }
+
+        int32_t node_index = static_cast<int32_t>(nodes.size());
+        nodes.push_back(std::move(node));
+        for (auto child = GLTF_node.children.rbegin(); child != GLTF_node.children.rend(); child++) {
+            node_stack.push_back({ *child, node_index });
+        }
+    }
+
+    // Meshes that no node places are still drawn once, untransformed
+    for (MeshData& mesh : meshes) {
+        if (mesh.instance_transforms.empty()) mesh.instance_transforms.push_back(glm::mat4{ 1.0f });
+    }
+
+    // Decoding is by far the slowest part of loading textured files, and every image is independent
+    std::vector<ImageData> images(asset->images.size());
+    const std::filesystem::path directory = filepath.parent_path();
+    thread_pool.parallel_for(asset->images.size(), [&](size_t i_image) {
+        images[i_image] = decode_image(asset.get(), asset->images[i_image], directory);
+    });
+
+    std::vector<MaterialData> materials;
+    materials.reserve(asset->materials.size());
+    for (const fastgltf::Material& material : asset->materials) {
+        const auto& factor = material.pbrData.baseColorFactor;
+        MaterialData new_material{
+            .name = std::string(material.name),
+            .base_color_factor = glm::vec4{ factor[0], factor[1], factor[2], factor[3] },
+            .base_color_image = -1,
+            .base_color_fallback_image = -1,
+            .alpha_mode = material.alphaMode == fastgltf::AlphaMode::Blend ? MATERIAL_ALPHA_MODE_BLEND :
+                          material.alphaMode == fastgltf::AlphaMode::Mask ? MATERIAL_ALPHA_MODE_MASK : MATERIAL_ALPHA_MODE_OPAQUE,
+            .alpha_cutoff = material.alphaCutoff,
+            .double_sided = material.doubleSided,
+        };
+        if (material.pbrData.baseColorTexture.has_value()) {
+            const fastgltf::Texture& texture = asset->textures[material.pbrData.baseColorTexture->textureIndex];
+            if (texture.basisuImageIndex.has_value()) {
+                // Prefer the KTX2 image, and keep the regular one around in case this GPU can't use it
+                new_material.base_color_image = static_cast<int32_t>(texture.basisuImageIndex.value());
+                if (texture.imageIndex.has_value()) new_material.base_color_fallback_image = static_cast<int32_t>(texture.imageIndex.value());
+            } else if (texture.imageIndex.has_value()) {
+                new_material.base_color_image = static_cast<int32_t>(texture.imageIndex.value());
+            }
+        }
+        materials.push_back(std::move(new_material));
+    }
+
+    return SceneData{
+        .nodes = std::move(nodes),
+        .meshes = std::move(meshes),
+        .images = std::move(images),
+        .materials = std::move(materials),
+    };
 }
@@ -0,0 +1,399 @@
+#include "bvh.h"
+#include <algorithm>
+#include <cfloat>
+#include <numeric>
+#include <utility>
+
+static constexpr uint32_t bin_count = 16;
+
+static float half_surface_area(const glm::vec3& extent) {
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+static void grow(AABB& box, const AABB& other) {
+    box.min = glm::min(box.min, other.min);
+    box.max = glm::max(box.max, other.max);
+}
+
+static AABB empty_box() {
+    return AABB{ .min = glm::vec3{ FLT_MAX }, .max = glm::vec3{ -FLT_MAX } };
+}
+
+void BVH::clear() {
+    nodes.clear();
+    node_parents.clear();
+    primitive_indices.clear();
+    primitive_leaves.clear();
+    primitive_positions.clear();
+    primitive_bounds.clear();
+    ordered_spheres.clear();
+}
+
+void BVH::update_node_bounds(uint32_t node_index) {
+    BVHNode& node = nodes[node_index];
+    AABB box = empty_box();
+    if (node.is_leaf()) {
+        for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+            grow(box, primitive_bounds[primitive_indices[i_primitive]]);
+        }
+    } else {
+        grow(box, AABB{ nodes[node.first].aabb_min, nodes[node.first].aabb_max });
+        grow(box, AABB{ nodes[node.first + 1].aabb_min, nodes[node.first + 1].aabb_max });
+    }
+    node.aabb_min = box.min;
+    node.aabb_max = box.max;
+}
+
+void BVH::set_build_bounds(uint32_t node_index) {
+    // Same as update_node_bounds for a leaf, but reads the copies that are laid out in node order
+    BVHNode& node = nodes[node_index];
+    AABB box = empty_box();
+    for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+        grow(box, build_primitives[i_primitive].bounds);
+    }
+    node.aabb_min = box.min;
+    node.aabb_max = box.max;
+}
+
+float BVH::find_split(const BVHNode& node, int& axis, float& position) const {
+    AABB centroid_bounds = empty_box();
+    for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+        const glm::vec3& centroid = build_primitives[i_primitive].centroid;
+        grow(centroid_bounds, AABB{ centroid, centroid });
+    }
+
+    struct Bin {
+        AABB bounds;
+        uint32_t count;
+    };
+    Bin bins[3][bin_count];
+    for (auto& axis_bins : bins) {
+        for (Bin& bin : axis_bins) bin = Bin{ empty_box(), 0 };
+    }
+
+    // All three axes get binned in the same pass, the primitives are the expensive part to touch
+    const glm::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+    glm::vec3 scale;
+    for (int i_axis = 0; i_axis < 3; i_axis++) scale[i_axis] = extent[i_axis] > 0.0f ? bin_count / extent[i_axis] : 0.0f;
+    for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+        const BuildPrimitive& primitive = build_primitives[i_primitive];
+        const glm::vec3 bin_position = (primitive.centroid - centroid_bounds.min) * scale;
+        for (int i_axis = 0; i_axis < 3; i_axis++) {
+            Bin& bin = bins[i_axis][std::min(bin_count - 1, static_cast<uint32_t>(bin_position[i_axis]))];
+            bin.count++;
+            grow(bin.bounds, primitive.bounds);
+        }
+    }
+
+    float best_cost = FLT_MAX;
+    for (int i_axis = 0; i_axis < 3; i_axis++) {
+        if (extent[i_axis] <= 0.0f) continue;
+        const Bin* axis_bins = bins[i_axis];
+
+        // Sweep from both ends so every split between two bins gets its cost in one pass each
+        float left_areas[bin_count - 1];
+        uint32_t left_counts[bin_count - 1];
+        AABB left_box = empty_box();
+        uint32_t left_count = 0;
+        for (uint32_t i_bin = 0; i_bin < bin_count - 1; i_bin++) {
+            left_count += axis_bins[i_bin].count;
+            if (axis_bins[i_bin].count > 0) grow(left_box, axis_bins[i_bin].bounds);
+            left_counts[i_bin] = left_count;
+            left_areas[i_bin] = left_count > 0 ? half_surface_area(left_box.max - left_box.min) : 0.0f;
+        }
+
+        AABB right_box = empty_box();
+        uint32_t right_count = 0;
+        for (uint32_t i_bin = bin_count - 1; i_bin > 0; i_bin--) {
+            right_count += axis_bins[i_bin].count;
+            if (axis_bins[i_bin].count > 0) grow(right_box, axis_bins[i_bin].bounds);
+            const float right_area = right_count > 0 ? half_surface_area(right_box.max - right_box.min) : 0.0f;
+
+            const float cost = left_counts[i_bin - 1] * left_areas[i_bin - 1] + right_count * right_area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                axis = i_axis;
+                position = centroid_bounds.min[i_axis] + i_bin / scale[i_axis];
+            }
+        }
+    }
+    return best_cost;
+}
+
+void BVH::subdivide(uint32_t node_index) {
+    const BVHNode node = nodes[node_index];
+    if (node.count <= max_leaf_size) return;
+
+    int axis = 0;
+    float position = 0.0f;
+    const float split_cost = find_split(node, axis, position);
+    const float leaf_cost = node.count * half_surface_area(node.aabb_max - node.aabb_min);
+    if (split_cost >= leaf_cost) return;
+
+    // Everything with its centroid before the split goes left. The build copies move along with the indices
+    uint32_t left_end = node.first;
+    for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+        if (build_primitives[i_primitive].centroid[axis] < position) {
+            std::swap(primitive_indices[i_primitive], primitive_indices[left_end]);
+            std::swap(build_primitives[i_primitive], build_primitives[left_end]);
+            left_end++;
+        }
+    }
+    const uint32_t left_count = left_end - node.first;
+    if (left_count == 0 || left_count == node.count) return;
+
+    const uint32_t left_child = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(BVHNode{ .first = node.first, .count = left_count });
+    nodes.push_back(BVHNode{ .first = left_end, .count = node.count - left_count });
+    node_parents.push_back(node_index);
+    node_parents.push_back(node_index);
+    nodes[node_index].first = left_child;
+    nodes[node_index].count = 0;
+    set_build_bounds(left_child);
+    set_build_bounds(left_child + 1);
+}
+
+void BVH::build(std::vector<AABB>&& bounds) {
+    primitive_bounds = std::move(bounds);
+    const uint32_t primitive_count = static_cast<uint32_t>(primitive_bounds.size());
+
+    nodes.clear();
+    node_parents.clear();
+    primitive_indices.resize(primitive_count);
+    std::iota(primitive_indices.begin(), primitive_indices.end(), 0u);
+    primitive_leaves.assign(primitive_count, 0);
+    primitive_positions.resize(primitive_count);
+    ordered_spheres.clear();
+    if (primitive_count == 0) return;
+
+    // Splitting keeps reading every primitive of a node, so it works on copies that get partitioned alongside primitive_indices.
+    // Going through the indices would scatter those reads across primitive_bounds on every level of the tree
+    build_primitives.resize(primitive_count);
+    for (uint32_t i_primitive = 0; i_primitive < primitive_count; i_primitive++) {
+        const AABB& bounds = primitive_bounds[i_primitive];
+        build_primitives[i_primitive] = BuildPrimitive{ .bounds = bounds, .centroid = (bounds.min + bounds.max) * 0.5f };
+    }
+
+    // A binary tree with single primitive leaves has 2n - 1 nodes at most
+    nodes.reserve(2 * primitive_count - 1);
+    node_parents.reserve(2 * primitive_count - 1);
+    nodes.push_back(BVHNode{ .first = 0, .count = primitive_count });
+    node_parents.push_back(UINT32_MAX);
+    set_build_bounds(0);
+
+    // Nodes are appended as they get split, so walking the array front to back visits every node after its parent
+    for (uint32_t i_node = 0; i_node < nodes.size(); i_node++) {
+        subdivide(i_node);
+    }
+
+    for (uint32_t i_node = 0; i_node < nodes.size(); i_node++) {
+        const BVHNode& node = nodes[i_node];
+        if (!node.is_leaf()) continue;
+        for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+            primitive_leaves[primitive_indices[i_primitive]] = i_node;
+            primitive_positions[primitive_indices[i_primitive]] = i_primitive;
+        }
+    }
+    build_primitives.clear();
+    build_primitives.shrink_to_fit();
+}
+
+void BVH::build(const BoundingSphereSoA& spheres) {
+    std::vector<AABB> bounds(spheres.size());
+    for (size_t i_sphere = 0; i_sphere < spheres.size(); i_sphere++) {
+        const glm::vec3 center{ spheres.x[i_sphere], spheres.y[i_sphere], spheres.z[i_sphere] };
+        bounds[i_sphere] = AABB{ .min = center - spheres.radius[i_sphere], .max = center + spheres.radius[i_sphere] };
+    }
+    build(std::move(bounds));
+
+    ordered_spheres.reserve(spheres.size());
+    for (uint32_t primitive : primitive_indices) {
+        ordered_spheres.push_back(glm::vec4{ spheres.x[primitive], spheres.y[primitive], spheres.z[primitive], spheres.radius[primitive] });
+    }
+}
+
+void BVH::set_sphere(uint32_t primitive, const glm::vec4& sphere) {
+    primitive_bounds[primitive] = AABB{ .min = glm::vec3(sphere) - sphere.w, .max = glm::vec3(sphere) + sphere.w };
+    ordered_spheres.set(primitive_positions[primitive], sphere);
+}
+
+void BVH::refit(std::span<const uint32_t> moved_primitives) {
+    for (uint32_t primitive : moved_primitives) {
+        // Once a node's box comes out the same, nothing above it can change either
+        uint32_t node_index = primitive_leaves[primitive];
+        while (node_index != UINT32_MAX) {
+            const glm::vec3 old_min = nodes[node_index].aabb_min;
+            const glm::vec3 old_max = nodes[node_index].aabb_max;
+            update_node_bounds(node_index);
+            if (nodes[node_index].aabb_min == old_min && nodes[node_index].aabb_max == old_max) break;
+            node_index = node_parents[node_index];
+        }
+    }
+}
+
+enum class Containment {
+    OUTSIDE,
+    INTERSECTING,
+    INSIDE,
+};
+
+static Containment classify_aabb(const FrustumPlanes& planes, const glm::vec3& min_corner, const glm::vec3& max_corner) {
+    Containment containment = Containment::INSIDE;
+    for (const glm::vec4& plane : planes) {
+        // The corner furthest along the normal decides outside, the closest one decides inside
+        const glm::vec3 normal{ plane };
+        const glm::vec3 furthest_corner = glm::mix(min_corner, max_corner, glm::greaterThanEqual(normal, glm::vec3{ 0.0f }));
+        const glm::vec3 closest_corner = glm::mix(max_corner, min_corner, glm::greaterThanEqual(normal, glm::vec3{ 0.0f }));
+        if (glm::dot(normal, furthest_corner) + plane.w < 0.0f) return Containment::OUTSIDE;
+        if (glm::dot(normal, closest_corner) + plane.w < 0.0f) containment = Containment::INTERSECTING;
+    }
+    return containment;
+}
+
+void BVH::query_frustum(const FrustumPlanes& planes, std::vector<uint32_t>& result) const {
+    if (nodes.empty()) return;
+    const bool has_spheres = !ordered_spheres.x.empty();
+
+    // Leaves come out left to right, so partially visible ones that sit next to each other in primitive_indices get
+    // gathered into one run and go through the SIMD sphere test together
+    size_t run_first = 0;
+    size_t run_end = 0;
+    auto flush_run = [&]() {
+        if (run_first == run_end) return;
+        FrustumCulling::cull_spheres(planes, ordered_spheres, sphere_visibility, run_first, run_end);
+        for (size_t i_primitive = run_first; i_primitive < run_end; i_primitive++) {
+            if (sphere_visibility[i_primitive]) result.push_back(primitive_indices[i_primitive]);
+        }
+        run_first = run_end = 0;
+    };
+
+    struct StackEntry {
+        uint32_t node_index;
+        bool inside; // An ancestor was entirely in the frustum, so this whole subtree is too
+    };
+    std::vector<StackEntry> stack;
+    stack.push_back({ 0, false });
+
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        const BVHNode& node = nodes[entry.node_index];
+
+        bool inside = entry.inside;
+        if (!inside) {
+            Containment containment = classify_aabb(planes, node.aabb_min, node.aabb_max);
+            if (containment == Containment::OUTSIDE) continue;
+            inside = containment == Containment::INSIDE;
+        }
+
+        if (!node.is_leaf()) {
+            stack.push_back({ node.first + 1, inside });
+            stack.push_back({ node.first, inside });
+            continue;
+        }
+        if (inside) {
+            result.insert(result.end(), primitive_indices.begin() + node.first, primitive_indices.begin() + node.first + node.count);
+        } else if (has_spheres) {
+            if (run_end != node.first) flush_run();
+            if (run_first == run_end) run_first = node.first;
+            run_end = node.first + node.count;
+        } else {
+            for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+                const uint32_t primitive = primitive_indices[i_primitive];
+                if (FrustumCulling::is_aabb_visible(planes, primitive_bounds[primitive].min, primitive_bounds[primitive].max)) {
+                    result.push_back(primitive);
+                }
+            }
+        }
+    }
+    flush_run();
+}
+
+static bool overlaps(const AABB& box, const glm::vec3& min_corner, const glm::vec3& max_corner) {
+    return glm::all(glm::lessThanEqual(box.min, max_corner)) && glm::all(glm::greaterThanEqual(box.max, min_corner));
+}
+
+void BVH::query_aabb(const AABB& box, std::vector<uint32_t>& result) const {
+    if (nodes.empty()) return;
+
+    std::vector<uint32_t> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const BVHNode& node = nodes[stack.back()];
+        stack.pop_back();
+        if (!overlaps(box, node.aabb_min, node.aabb_max)) continue;
+
+        if (!node.is_leaf()) {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+            continue;
+        }
+        for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+            const uint32_t primitive = primitive_indices[i_primitive];
+            if (overlaps(box, primitive_bounds[primitive].min, primitive_bounds[primitive].max)) result.push_back(primitive);
+        }
+    }
+}
+
+// Slab test. Returns the distance where the ray enters the box, or FLT_MAX if it misses it within max_distance
+static float intersect_ray_aabb(const glm::vec3& origin, const glm::vec3& inverse_direction, float max_distance, const glm::vec3& min_corner, const glm::vec3& max_corner) {
+    const glm::vec3 t0 = (min_corner - origin) * inverse_direction;
+    const glm::vec3 t1 = (max_corner - origin) * inverse_direction;
+    const glm::vec3 t_near = glm::min(t0, t1);
+    const glm::vec3 t_far = glm::max(t0, t1);
+    const float enter = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, 0.0f));
+    const float exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, max_distance));
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+uint32_t BVH::raycast(glm::vec3 origin, glm::vec3 direction, float max_distance,
+                      const std::function<float(uint32_t primitive)>& intersect, float& hit_distance) const {
+    if (nodes.empty()) return UINT32_MAX;
+
+    const glm::vec3 inverse_direction = 1.0f / direction;
+    float closest = max_distance;
+    uint32_t closest_primitive = UINT32_MAX;
+
+    struct StackEntry {
+        uint32_t node_index;
+        float distance; // Where the ray enters the node's box
+    };
+    std::vector<StackEntry> stack;
+    const float root_distance = intersect_ray_aabb(origin, inverse_direction, closest, nodes[0].aabb_min, nodes[0].aabb_max);
+    if (root_distance != FLT_MAX) stack.push_back({ 0, root_distance });
+
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        if (entry.distance > closest) continue;
+        const BVHNode& node = nodes[entry.node_index];
+
+        if (node.is_leaf()) {
+            for (uint32_t i_primitive = node.first; i_primitive < node.first + node.count; i_primitive++) {
+                const uint32_t primitive = primitive_indices[i_primitive];
+                if (intersect_ray_aabb(origin, inverse_direction, closest, primitive_bounds[primitive].min, primitive_bounds[primitive].max) == FLT_MAX) continue;
+
+                const float distance = intersect(primitive);
+                if (distance >= 0.0f && distance < closest) {
+                    closest = distance;
+                    closest_primitive = primitive;
+                }
+            }
+            continue;
+        }
+
+        // Push the farther child first so the nearer one gets visited first and tightens closest sooner
+        StackEntry children[2];
+        for (uint32_t i_child = 0; i_child < 2; i_child++) {
+            const BVHNode& child = nodes[node.first + i_child];
+            children[i_child] = { node.first + i_child, intersect_ray_aabb(origin, inverse_direction, closest, child.aabb_min, child.aabb_max) };
+        }
+        if (children[0].distance < children[1].distance) std::swap(children[0], children[1]);
+        for (const StackEntry& child : children) {
+            if (child.distance != FLT_MAX) stack.push_back(child);
+        }
+    }
+
+    if (closest_primitive != UINT32_MAX) hit_distance = closest;
+    return closest_primitive;
+}
@@ -66,4 +66,20 @@ void Camera::set_view_euler_yxz(glm::vec3 position, glm::vec3 rotation) {
     // TODO: Understand and implement
 }
 
+FrustumPlanes Camera::frustum_planes() const {
+    return FrustumCulling::extract_planes(projection * view);
+}
+
+void Camera::screen_ray(glm::vec2 pixel, glm::vec2 viewport_size, glm::vec3& origin, glm::vec3& direction) const {
+    // The projection already flips Y, so the top of the viewport is -1 just like in the framebuffer.
+    // Depth is reversed, near ends up at 1 and far at 0. Unprojecting both works for perspective and orthographic alike
+    const glm::vec2 ndc = pixel / viewport_size * 2.0f - 1.0f;
+    const glm::mat4 world_from_clip = glm::inverse(projection * view);
+    glm::vec4 near_point = world_from_clip * glm::vec4(ndc, 1.0f, 1.0f);
+    glm::vec4 far_point = world_from_clip * glm::vec4(ndc, 0.0f, 1.0f);
+    near_point /= near_point.w;
+    far_point /= far_point.w;
 
+    origin = glm::vec3(near_point);
+    direction = glm::normalize(glm::vec3(far_point - near_point));
+}
@@ -0,0 +1,53 @@
+#include "collision_mesh.h"
+#include "mesh.h"
+#include <algorithm>
+#include <cmath>
+
+void CollisionMesh::build(std::span<const MeshVertex> vertices, std::span<const uint32_t> indices) {
+    const size_t triangle_count = indices.size() / 3;
+    triangle_vertices.resize(triangle_count * 3);
+    std::vector<AABB> bounds(triangle_count);
+
+    for (size_t i_triangle = 0; i_triangle < triangle_count; i_triangle++) {
+        const glm::vec3 v0 = vertices[indices[i_triangle * 3 + 0]].position;
+        const glm::vec3 v1 = vertices[indices[i_triangle * 3 + 1]].position;
+        const glm::vec3 v2 = vertices[indices[i_triangle * 3 + 2]].position;
+        triangle_vertices[i_triangle * 3 + 0] = v0;
+        triangle_vertices[i_triangle * 3 + 1] = v1;
+        triangle_vertices[i_triangle * 3 + 2] = v2;
+        bounds[i_triangle] = AABB{ .min = glm::min(v0, glm::min(v1, v2)), .max = glm::max(v0, glm::max(v1, v2)) };
+    }
+
+    // Small leaves trade a slower build for fewer triangle tests per ray, which is the side picking cares about
+    bvh.max_leaf_size = 2;
+    bvh.build(std::move(bounds));
+}
+
+uint32_t CollisionMesh::raycast(glm::vec3 origin, glm::vec3 direction, float max_distance, float& hit_distance,
+                                uint32_t first_triangle, uint32_t triangle_count) const {
+    const uint32_t last_triangle = triangle_count == UINT32_MAX ? UINT32_MAX : first_triangle + triangle_count;
+    return bvh.raycast(origin, direction, max_distance, [&](uint32_t triangle) {
+        if (triangle < first_triangle || triangle >= last_triangle) return -1.0f;
+        const glm::vec3* v = &triangle_vertices[triangle * 3];
+        return intersect_ray_triangle(origin, direction, v[0], v[1], v[2]);
+    }, hit_distance);
+}
+
+float intersect_ray_triangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
+    const glm::vec3 edge1 = v1 - v0;
+    const glm::vec3 edge2 = v2 - v0;
+    const glm::vec3 p = glm::cross(direction, edge2);
+    const float determinant = glm::dot(edge1, p);
+    if (std::abs(determinant) < 1e-12f) return -1.0f; // Ray parallel to the triangle
+
+    const float inverse_determinant = 1.0f / determinant;
+    const glm::vec3 to_origin = origin - v0;
+    const float u = glm::dot(to_origin, p) * inverse_determinant;
+    if (u < 0.0f || u > 1.0f) return -1.0f;
+
+    const glm::vec3 q = glm::cross(to_origin, edge1);
+    const float v = glm::dot(direction, q) * inverse_determinant;
+    if (v < 0.0f || u + v > 1.0f) return -1.0f;
+
+    return glm::dot(edge2, q) * inverse_determinant;
+}
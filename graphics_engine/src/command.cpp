@@ -125,11 +125,29 @@ void Command::submit_to_queue(VkQueue queue, FrameSync* frame_sync, Semaphore* r
 		.pSignalSemaphoreInfos = &signal_semaphore_info
 	};
 
+	std::lock_guard<std::mutex> queue_lock(device->queue_mutex);
 	if (vkQueueSubmit2(queue, 1, &submit_info, frame_sync->render_fence.handle) != VK_SUCCESS) {
         Logger::logError("Failed to submit commands to queue!");
 	}
 }
 
+void Command::memory_barrier(VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access) {
+	VkMemoryBarrier2 barrier{
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+		.srcStageMask = src_stage,
+		.srcAccessMask = src_access,
+		.dstStageMask = dst_stage,
+		.dstAccessMask = dst_access,
+	};
+
+	VkDependencyInfo dependency_info{
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.memoryBarrierCount = 1,
+		.pMemoryBarriers = &barrier,
+	};
+	vkCmdPipelineBarrier2(buffer, &dependency_info);
+}
+
 // ImmediateCommand --------------------------------------------------------------------------------------------------
 
 void ImmediateCommand::initialize(Device* device) {
@@ -141,6 +159,9 @@ void ImmediateCommand::initialize(Device* device) {
 }
 
 void ImmediateCommand::run_command(std::function<void(Command* immediate_command)>&& function) {
+    // Only one thread can be recording into the immediate command buffer at a time
+    std::lock_guard<std::mutex> lock(mutex);
+
 	vkResetFences(device->logical_device, 1, &submit_fence.handle);
 	command.reset(); // Reset the command buffer
 
@@ -167,8 +188,11 @@ void ImmediateCommand::run_command(std::function<void(Command* immediate_command
 		.pSignalSemaphoreInfos = nullptr
 	};
 
-	if (vkQueueSubmit2(device->graphics_queue, 1, &submit_info, submit_fence.handle) != VK_SUCCESS) {
-        Logger::logError("Failed to submit commands to queue!");
+	{
+		std::lock_guard<std::mutex> queue_lock(device->queue_mutex);
+		if (vkQueueSubmit2(device->graphics_queue, 1, &submit_info, submit_fence.handle) != VK_SUCCESS) {
+			Logger::logError("Failed to submit commands to queue!");
+		}
 	}
 	vkWaitForFences(device->logical_device, 1, &submit_fence.handle, true, 9999999999);
 }
@@ -0,0 +1,228 @@
+#include "depth_pyramid.h"
+#include "renderer.h"
+#include "logger.h"
+#include <algorithm>
+#include <cmath>
+
+static uint32_t previous_power_of_two(uint32_t value) {
+    uint32_t result = 1;
+    while (result * 2 <= value) result *= 2;
+    return result;
+}
+
+void DepthPyramid::initialize(Renderer* renderer) {
+    this->renderer = renderer;
+    image_index = UINT32_MAX;
+    extent = { 0, 0 };
+    valid = false;
+    depth_indices.assign(renderer->frames_in_flight, UINT32_MAX);
+
+    // Min filtering on the depth format is what builds the levels, and on the pyramid format what the cull pass samples with.
+    // The levels are written through bindless storage images, which have to be updatable while the table is bound
+    supported = renderer->device.sampler_filter_minmax
+             && renderer->device.storage_image_update_after_bind
+             && renderer->device.supports_format_features(VK_FORMAT_D32_SFLOAT, VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_MINMAX_BIT)
+             && renderer->device.supports_format_features(VK_FORMAT_R32_SFLOAT, VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_MINMAX_BIT | VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
+    if (!supported) {
+        Logger::logError("GPU can't min filter depth into bindless storage images, occlusion culling is disabled");
+        return;
+    }
+
+    VkSamplerReductionModeCreateInfo reduction_info{
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_REDUCTION_MODE_CREATE_INFO,
+        .reductionMode = VK_SAMPLER_REDUCTION_MODE_MIN,
+    };
+    VkSamplerCreateInfo sampler_info{
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .pNext = &reduction_info,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .maxLod = VK_LOD_CLAMP_NONE,
+    };
+    vkCreateSampler(renderer->device.logical_device, &sampler_info, nullptr, &min_sampler);
+    min_sampler_index = renderer->bindless_descriptors.add_sampler(min_sampler);
+    if (min_sampler_index == UINT32_MAX) {
+        Logger::logError("Bindless sampler table is full, occlusion culling is disabled");
+        vkDestroySampler(renderer->device.logical_device, min_sampler, nullptr);
+        supported = false;
+        return;
+    }
+
+    reduce_pipeline = build_reduce_pipeline();
+}
+
+std::shared_ptr<Pipeline> DepthPyramid::build_reduce_pipeline() {
+    Shader reduce_shader;
+    reduce_shader.initialize(&renderer->device, &renderer->shader_manager, VK_SHADER_STAGE_COMPUTE_BIT, "depth_reduce_main");
+
+    VkPushConstantRange push_constant_range{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(GPUDepthReducePushConstants),
+    };
+
+    renderer->pipeline_builder.clear();
+    renderer->pipeline_builder
+        .add_push_constant(push_constant_range)
+        .set_shader(reduce_shader)
+        .add_descriptor(renderer->bindless_descriptors.layout, renderer->bindless_descriptors.layout_description); // Set 0: the bindless table, nothing else is needed
+    std::shared_ptr<Pipeline> pipeline = renderer->pipeline_registry.build_compute(renderer->pipeline_builder);
+
+    reduce_shader.cleanup();
+    return pipeline;
+}
+
+void DepthPyramid::reload_shaders(const std::vector<std::string>& entry_points) {
+    if (!supported) return;
+    if (std::find(entry_points.begin(), entry_points.end(), "depth_reduce_main") != entry_points.end()) {
+        renderer->replace_pipeline(reduce_pipeline, build_reduce_pipeline());
+    }
+}
+
+void DepthPyramid::cleanup() {
+    if (!supported) return;
+
+    destroy();
+    for (uint32_t depth_index : depth_indices) {
+        if (depth_index != UINT32_MAX) renderer->bindless_descriptors.remove_image(depth_index);
+    }
+    reduce_pipeline.reset();
+    renderer->bindless_descriptors.remove_sampler(min_sampler_index);
+    vkDestroySampler(renderer->device.logical_device, min_sampler, nullptr);
+}
+
+bool DepthPyramid::create(VkExtent2D pyramid_extent) {
+    extent = pyramid_extent;
+    const uint32_t level_count = static_cast<uint32_t>(std::floor(std::log2(std::max(extent.width, extent.height)))) + 1;
+    image = renderer->create_image_with_mip_levels(
+        VkExtent3D{ extent.width, extent.height, 1 },
+        VK_FORMAT_R32_SFLOAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        level_count
+    );
+    image_index = renderer->bindless_descriptors.add_image(&image, VK_IMAGE_LAYOUT_GENERAL);
+
+    level_views.resize(level_count);
+    level_image_indices.resize(level_count);
+    level_storage_indices.resize(level_count);
+    for (uint32_t i_level = 0; i_level < level_count; i_level++) {
+        VkImageViewCreateInfo view_info{
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = image.handle,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = image.format,
+            .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .baseMipLevel = i_level, .levelCount = 1, .baseArrayLayer = 0, .layerCount = 1 },
+        };
+        if (vkCreateImageView(renderer->device.logical_device, &view_info, nullptr, &level_views[i_level]) != VK_SUCCESS) {
+            Logger::logError("Failed to create depth pyramid level view!");
+        }
+        level_image_indices[i_level] = renderer->bindless_descriptors.add_image_view(level_views[i_level], VK_IMAGE_LAYOUT_GENERAL);
+        level_storage_indices[i_level] = renderer->bindless_descriptors.add_storage_image(level_views[i_level]);
+    }
+    valid = false;
+
+    // Nothing has used the pyramid yet, so if any slot is missing it can all go right away. Removing UINT32_MAX is a no-op
+    const bool slots_missing = image_index == UINT32_MAX
+        || std::find(level_image_indices.begin(), level_image_indices.end(), UINT32_MAX) != level_image_indices.end()
+        || std::find(level_storage_indices.begin(), level_storage_indices.end(), UINT32_MAX) != level_storage_indices.end();
+    if (!slots_missing) return true;
+
+    Logger::logError("Bindless table is full, skipping occlusion culling until the depth pyramid fits");
+    for (uint32_t i_level = 0; i_level < level_count; i_level++) {
+        renderer->bindless_descriptors.remove_image(level_image_indices[i_level]);
+        renderer->bindless_descriptors.remove_storage_image(level_storage_indices[i_level]);
+        vkDestroyImageView(renderer->device.logical_device, level_views[i_level], nullptr);
+    }
+    renderer->bindless_descriptors.remove_image(image_index);
+    image.cleanup();
+    image_index = UINT32_MAX;
+    level_views.clear();
+    level_image_indices.clear();
+    level_storage_indices.clear();
+    return false;
+}
+
+void DepthPyramid::destroy() {
+    if (image_index == UINT32_MAX) return;
+
+    // The cull pass of frames still in flight samples the old pyramid
+    renderer->defer_cleanup([renderer = renderer, image = image, image_index = image_index, level_views = level_views,
+                             level_image_indices = level_image_indices, level_storage_indices = level_storage_indices]() mutable {
+        for (size_t i_level = 0; i_level < level_views.size(); i_level++) {
+            renderer->bindless_descriptors.remove_image(level_image_indices[i_level]);
+            renderer->bindless_descriptors.remove_storage_image(level_storage_indices[i_level]);
+            vkDestroyImageView(renderer->device.logical_device, level_views[i_level], nullptr);
+        }
+        renderer->bindless_descriptors.remove_image(image_index);
+        image.cleanup();
+    });
+    image_index = UINT32_MAX;
+    level_views.clear();
+    level_image_indices.clear();
+    level_storage_indices.clear();
+    valid = false;
+}
+
+void DepthPyramid::build(Command* cmd, AllocatedImage* depth_image, VkExtent2D draw_extent) {
+    if (!supported) return;
+
+    VkExtent2D pyramid_extent{ previous_power_of_two(draw_extent.width), previous_power_of_two(draw_extent.height) };
+    if (image_index == UINT32_MAX || pyramid_extent.width != extent.width || pyramid_extent.height != extent.height) {
+        destroy();
+        if (!create(pyramid_extent)) return;
+    }
+    if (image.layout != VK_IMAGE_LAYOUT_GENERAL) {
+        Image::transition_image(cmd, &image, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
+    // The fence of this frame index was waited on, so the last use of its depth slot is done
+    uint32_t& depth_index = depth_indices[renderer->frame_index];
+    if (depth_index != UINT32_MAX) renderer->bindless_descriptors.remove_image(depth_index);
+    depth_index = renderer->bindless_descriptors.add_image(depth_image, VK_IMAGE_LAYOUT_GENERAL);
+    if (depth_index == UINT32_MAX) {
+        Logger::logError("Bindless image table is full, skipping the depth pyramid this frame");
+        valid = false;
+        return;
+    }
+
+    // Also waits for the cull pass earlier this frame, which sampled the pyramid levels this is about to overwrite
+    cmd->memory_barrier(
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+    );
+
+    vkCmdBindPipeline(cmd->buffer, VK_PIPELINE_BIND_POINT_COMPUTE, reduce_pipeline->handle);
+    renderer->bindless_descriptors.bind(cmd, reduce_pipeline->layout, 0, VK_PIPELINE_BIND_POINT_COMPUTE);
+
+    for (uint32_t i_level = 0; i_level < level_views.size(); i_level++) {
+        VkExtent3D level_extent = Image::mip_extent(image.extent, i_level);
+        GPUDepthReducePushConstants constants{
+            .source_index = i_level == 0 ? depth_index : level_image_indices[i_level - 1],
+            .sampler_index = min_sampler_index,
+            .destination_index = level_storage_indices[i_level],
+            .padding = 0,
+            .source_uv_scale = i_level == 0
+                ? glm::vec2(draw_extent.width, draw_extent.height) / glm::vec2(depth_image->extent.width, depth_image->extent.height)
+                : glm::vec2(1.0f),
+            .destination_size = glm::vec2(level_extent.width, level_extent.height),
+        };
+        vkCmdPushConstants(cmd->buffer, reduce_pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUDepthReducePushConstants), &constants);
+        vkCmdDispatch(cmd->buffer, (level_extent.width + 7) / 8, (level_extent.height + 7) / 8, 1);
+
+        cmd->memory_barrier(
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT
+        );
+    }
+
+    // The last barrier also covers the next frame's cull pass. Its depth clear has to wait for the reads above to finish
+    cmd->memory_barrier(
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_NONE
+    );
+    valid = true;
+}
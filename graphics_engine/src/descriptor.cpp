@@ -4,6 +4,7 @@
 #include "buffer.h"
 #include "logger.h"
 #include "vulkan/vulkan_core.h"
+#include <algorithm>
 
 // ---------------------------------------------- DESCRIPTOR POOL -----------------------------------------------------------------
 
@@ -262,8 +263,241 @@ DescriptorSet DescriptorBuilder::build() {
     DescriptorSet set;
     set.renderer = this->renderer;
     set.layout = descriptor_layout_builder.build();
+    set.layout_description = DescriptorSetLayoutDescription{ .bindings = descriptor_layout_builder.bindings };
     set.handle = descriptor_allocator.allocate_descriptor_set(set.layout);
     descriptor_writer.write(set.handle);
 
     return set;
 }
+
+// ---------------------------------------------- BINDLESS DESCRIPTOR TABLE -----------------------------------------------------------------
+
+void DescriptorSlotAllocator::initialize(uint32_t capacity) {
+    this->capacity = capacity;
+    next_unused = 0;
+    free_slots.clear();
+}
+
+uint32_t DescriptorSlotAllocator::allocate() {
+    if (!free_slots.empty()) {
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+    if (next_unused == capacity) {
+        Logger::logError("Bindless descriptor array is full!");
+        return UINT32_MAX;
+    }
+    return next_unused++;
+}
+
+void DescriptorSlotAllocator::free(uint32_t slot) {
+    if (slot < next_unused) free_slots.push_back(slot);
+}
+
+void BindlessDescriptorTable::initialize(Renderer* renderer, uint32_t max_images, uint32_t max_samplers, uint32_t max_storage_buffers, uint32_t max_storage_images) {
+    this->renderer = renderer;
+
+    VkPhysicalDeviceVulkan12Properties properties_12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES };
+    VkPhysicalDeviceProperties2 properties{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &properties_12,
+    };
+    vkGetPhysicalDeviceProperties2(renderer->device.physical_device, &properties);
+
+    max_images = std::min(max_images, properties_12.maxDescriptorSetUpdateAfterBindSampledImages);
+    max_samplers = std::min(max_samplers, properties_12.maxDescriptorSetUpdateAfterBindSamplers);
+    max_storage_buffers = std::min(max_storage_buffers, properties_12.maxDescriptorSetUpdateAfterBindStorageBuffers);
+    max_storage_images = std::min(max_storage_images, properties_12.maxDescriptorSetUpdateAfterBindStorageImages);
+
+    // Storage images are only used by the depth pyramid, which is off when they can't be updated after bind. One slot keeps the binding valid
+    if (!renderer->device.storage_image_update_after_bind) max_storage_images = 1;
+    image_slots.initialize(max_images);
+    sampler_slots.initialize(max_samplers);
+    storage_buffer_slots.initialize(max_storage_buffers);
+    storage_image_slots.initialize(max_storage_images);
+
+    VkDescriptorSetLayoutBinding bindings[4]{
+        { .binding = IMAGE_BINDING,          .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,  .descriptorCount = max_images,          .stageFlags = VK_SHADER_STAGE_ALL },
+        { .binding = SAMPLER_BINDING,        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,        .descriptorCount = max_samplers,        .stageFlags = VK_SHADER_STAGE_ALL },
+        { .binding = STORAGE_BUFFER_BINDING, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = max_storage_buffers, .stageFlags = VK_SHADER_STAGE_ALL },
+        { .binding = STORAGE_IMAGE_BINDING,  .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,  .descriptorCount = max_storage_images,  .stageFlags = VK_SHADER_STAGE_ALL },
+    };
+
+    // Not every slot is filled, and slots get written while the set is bound in recorded command buffers
+    const VkDescriptorBindingFlags binding_flag =
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+    const VkDescriptorBindingFlags storage_image_flag = renderer->device.storage_image_update_after_bind ? binding_flag : VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    VkDescriptorBindingFlags binding_flags[4]{ binding_flag, binding_flag, binding_flag, storage_image_flag };
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .bindingCount = 4,
+        .pBindingFlags = binding_flags,
+    };
+
+    VkDescriptorSetLayoutCreateInfo layout_info{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext = &binding_flags_info,
+        .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+        .bindingCount = 4,
+        .pBindings = bindings,
+    };
+    if (vkCreateDescriptorSetLayout(renderer->device.logical_device, &layout_info, nullptr, &layout) != VK_SUCCESS) {
+        Logger::logError("Failed to build the bindless descriptor set layout!");
+    }
+    layout_description = DescriptorSetLayoutDescription{
+        .flags = layout_info.flags,
+        .bindings = { std::begin(bindings), std::end(bindings) },
+        .binding_flags = { std::begin(binding_flags), std::end(binding_flags) },
+    };
+
+    VkDescriptorPoolSize pool_sizes[4]{
+        { .type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,  .descriptorCount = max_images },
+        { .type = VK_DESCRIPTOR_TYPE_SAMPLER,        .descriptorCount = max_samplers },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = max_storage_buffers },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,  .descriptorCount = max_storage_images },
+    };
+    VkDescriptorPoolCreateInfo pool_info{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+        .maxSets = 1,
+        .poolSizeCount = 4,
+        .pPoolSizes = pool_sizes,
+    };
+    if (vkCreateDescriptorPool(renderer->device.logical_device, &pool_info, nullptr, &pool) != VK_SUCCESS) {
+        Logger::logError("Failed to create the bindless descriptor pool!");
+    }
+
+    VkDescriptorSetAllocateInfo alloc_info{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &layout,
+    };
+    if (vkAllocateDescriptorSets(renderer->device.logical_device, &alloc_info, &handle) != VK_SUCCESS) {
+        Logger::logError("Failed to allocate the bindless descriptor set!");
+    }
+}
+
+void BindlessDescriptorTable::cleanup() {
+    vkDestroyDescriptorPool(renderer->device.logical_device, pool, nullptr);
+    vkDestroyDescriptorSetLayout(renderer->device.logical_device, layout, nullptr);
+}
+
+uint32_t BindlessDescriptorTable::add_image(ImageType* image, VkImageLayout layout) {
+    return add_image_view(image->view, layout);
+}
+
+uint32_t BindlessDescriptorTable::add_image_view(VkImageView view, VkImageLayout layout) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t slot = image_slots.allocate();
+    if (slot == UINT32_MAX) return slot;
+
+    VkDescriptorImageInfo image_info{
+        .imageView = view,
+        .imageLayout = layout,
+    };
+    VkWriteDescriptorSet set_write{
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = handle,
+        .dstBinding = IMAGE_BINDING,
+        .dstArrayElement = slot,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+        .pImageInfo = &image_info,
+    };
+    vkUpdateDescriptorSets(renderer->device.logical_device, 1, &set_write, 0, nullptr);
+    return slot;
+}
+
+uint32_t BindlessDescriptorTable::add_sampler(VkSampler sampler) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t slot = sampler_slots.allocate();
+    if (slot == UINT32_MAX) return slot;
+
+    VkDescriptorImageInfo sampler_info{ .sampler = sampler };
+    VkWriteDescriptorSet set_write{
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = handle,
+        .dstBinding = SAMPLER_BINDING,
+        .dstArrayElement = slot,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
+        .pImageInfo = &sampler_info,
+    };
+    vkUpdateDescriptorSets(renderer->device.logical_device, 1, &set_write, 0, nullptr);
+    return slot;
+}
+
+uint32_t BindlessDescriptorTable::add_storage_buffer(Buffer* buffer, size_t offset, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t slot = storage_buffer_slots.allocate();
+    if (slot == UINT32_MAX) return slot;
+
+    VkDescriptorBufferInfo buffer_info{
+        .buffer = buffer->handle,
+        .offset = offset,
+        .range = size,
+    };
+    VkWriteDescriptorSet set_write{
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = handle,
+        .dstBinding = STORAGE_BUFFER_BINDING,
+        .dstArrayElement = slot,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &buffer_info,
+    };
+    vkUpdateDescriptorSets(renderer->device.logical_device, 1, &set_write, 0, nullptr);
+    return slot;
+}
+
+uint32_t BindlessDescriptorTable::add_storage_image(VkImageView view) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t slot = storage_image_slots.allocate();
+    if (slot == UINT32_MAX) return slot;
+
+    VkDescriptorImageInfo image_info{
+        .imageView = view,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+    VkWriteDescriptorSet set_write{
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = handle,
+        .dstBinding = STORAGE_IMAGE_BINDING,
+        .dstArrayElement = slot,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .pImageInfo = &image_info,
+    };
+    vkUpdateDescriptorSets(renderer->device.logical_device, 1, &set_write, 0, nullptr);
+    return slot;
+}
+
+// Freed slots keep their stale descriptor until reused, which partially bound arrays allow as long as shaders don't read them
+void BindlessDescriptorTable::remove_image(uint32_t slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    image_slots.free(slot);
+}
+
+void BindlessDescriptorTable::remove_sampler(uint32_t slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sampler_slots.free(slot);
+}
+
+void BindlessDescriptorTable::remove_storage_buffer(uint32_t slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    storage_buffer_slots.free(slot);
+}
+
+void BindlessDescriptorTable::remove_storage_image(uint32_t slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    storage_image_slots.free(slot);
+}
+
+void BindlessDescriptorTable::bind(Command* cmd, VkPipelineLayout pipeline_layout, uint32_t set_index, VkPipelineBindPoint bind_point) {
+    vkCmdBindDescriptorSets(cmd->buffer, bind_point, pipeline_layout, set_index, 1, &handle, 0, nullptr);
+}
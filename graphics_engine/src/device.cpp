@@ -4,17 +4,91 @@
 #include "logger.h"
 #include "vulkan/vulkan_core.h"
 #include <set>
+#include <string>
+#include <vector>
 
 static VkPhysicalDeviceFeatures device_features{};
 static VkPhysicalDeviceVulkan13Features features_13{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES,
 													 .synchronization2 = true,
 													 .dynamicRendering = true };
+// drawIndirectCount lets the GPU decide how many draws to issue. The descriptor indexing features are what the bindless descriptor table relies on.
+// samplerFilterMinmax and storage image update-after-bind are only needed by the depth pyramid, so they're turned on below if the GPU has them
 static VkPhysicalDeviceVulkan12Features features_12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+													 .drawIndirectCount = true,
 													 .descriptorIndexing = true,
+													 .shaderSampledImageArrayNonUniformIndexing = true,
+													 .shaderStorageBufferArrayNonUniformIndexing = true,
+													 .descriptorBindingSampledImageUpdateAfterBind = true,
+													 .descriptorBindingStorageBufferUpdateAfterBind = true,
+													 .descriptorBindingUpdateUnusedWhilePending = true,
+													 .descriptorBindingPartiallyBound = true,
+													 .runtimeDescriptorArray = true,
 													 .bufferDeviceAddress = true };
 static VkPhysicalDeviceVulkan11Features features_11{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
 													 .shaderDrawParameters = true };
 
+// Every feature the structs above turn on, by name, so a GPU missing any of them can say which.
+// Indirect draws carry the object index in firstInstance, there's no way to render meshes without it
+template <typename Features>
+struct RequiredFeature {
+	VkBool32 Features::* member;
+	const char* name;
+};
+static const RequiredFeature<VkPhysicalDeviceFeatures> required_features_10[] = {
+	{ &VkPhysicalDeviceFeatures::drawIndirectFirstInstance, "drawIndirectFirstInstance" },
+};
+static const RequiredFeature<VkPhysicalDeviceVulkan11Features> required_features_11[] = {
+	{ &VkPhysicalDeviceVulkan11Features::shaderDrawParameters, "shaderDrawParameters" },
+};
+static const RequiredFeature<VkPhysicalDeviceVulkan12Features> required_features_12[] = {
+	{ &VkPhysicalDeviceVulkan12Features::drawIndirectCount,                             "drawIndirectCount" },
+	{ &VkPhysicalDeviceVulkan12Features::descriptorIndexing,                            "descriptorIndexing" },
+	{ &VkPhysicalDeviceVulkan12Features::shaderSampledImageArrayNonUniformIndexing,     "shaderSampledImageArrayNonUniformIndexing" },
+	{ &VkPhysicalDeviceVulkan12Features::shaderStorageBufferArrayNonUniformIndexing,    "shaderStorageBufferArrayNonUniformIndexing" },
+	{ &VkPhysicalDeviceVulkan12Features::descriptorBindingSampledImageUpdateAfterBind,  "descriptorBindingSampledImageUpdateAfterBind" },
+	{ &VkPhysicalDeviceVulkan12Features::descriptorBindingStorageBufferUpdateAfterBind, "descriptorBindingStorageBufferUpdateAfterBind" },
+	{ &VkPhysicalDeviceVulkan12Features::descriptorBindingUpdateUnusedWhilePending,     "descriptorBindingUpdateUnusedWhilePending" },
+	{ &VkPhysicalDeviceVulkan12Features::descriptorBindingPartiallyBound,               "descriptorBindingPartiallyBound" },
+	{ &VkPhysicalDeviceVulkan12Features::runtimeDescriptorArray,                        "runtimeDescriptorArray" },
+	{ &VkPhysicalDeviceVulkan12Features::bufferDeviceAddress,                           "bufferDeviceAddress" },
+};
+static const RequiredFeature<VkPhysicalDeviceVulkan13Features> required_features_13[] = {
+	{ &VkPhysicalDeviceVulkan13Features::synchronization2, "synchronization2" },
+	{ &VkPhysicalDeviceVulkan13Features::dynamicRendering, "dynamicRendering" },
+};
+
+template <typename Features, size_t N>
+static void find_missing_features(const RequiredFeature<Features> (&required)[N], const Features& supported, std::vector<std::string>& missing) {
+	for (const auto& feature : required) {
+		if (!(supported.*feature.member)) missing.push_back(feature.name);
+	}
+}
+
+// @brief Names of the required features the GPU doesn't have, empty if it has them all
+static std::vector<std::string> missing_required_features(VkPhysicalDevice physical_device) {
+	VkPhysicalDeviceVulkan13Features supported_13{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES };
+	VkPhysicalDeviceVulkan12Features supported_12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES, .pNext = &supported_13 };
+	VkPhysicalDeviceVulkan11Features supported_11{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES, .pNext = &supported_12 };
+	VkPhysicalDeviceFeatures2 supported{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &supported_11 };
+	vkGetPhysicalDeviceFeatures2(physical_device, &supported);
+
+	std::vector<std::string> missing;
+	find_missing_features(required_features_10, supported.features, missing);
+	find_missing_features(required_features_11, supported_11, missing);
+	find_missing_features(required_features_12, supported_12, missing);
+	find_missing_features(required_features_13, supported_13, missing);
+	return missing;
+}
+
+static std::string join_names(const std::vector<std::string>& names) {
+	std::string joined;
+	for (const auto& name : names) {
+		if (!joined.empty()) joined += ", ";
+		joined += name;
+	}
+	return joined;
+}
+
 QueueFamilyIndices QueueFamilyIndices::find_queue_families(VkPhysicalDevice physical_device, VkSurfaceKHR surface) {
 	QueueFamilyIndices indices;
 
@@ -46,10 +120,11 @@ QueueFamilyIndices QueueFamilyIndices::find_queue_families(VkPhysicalDevice phys
 	return indices;
 }
 
-void Device::initialize(Instance* instance, Window* window, const std::vector<const char*>* requested_validation_layers, const std::vector<const char*>* requested_extensions) {
+bool Device::initialize(Instance* instance, Window* window, const std::vector<const char*>* requested_validation_layers, const std::vector<const char*>* requested_extensions) {
 
     this->instance = instance;
     this->window = window;
+    this->enabled_extensions = *requested_extensions;
 
     // Create the surface for the passed-in window. I don't necessarily like it being here, but we are keeping window creation separate from the engine
     // and the surface needs an instance to be created
@@ -60,6 +135,30 @@ void Device::initialize(Instance* instance, Window* window, const std::vector<co
 	// Select the physical device to be used for rendering
 	physical_device = select_physical_device(instance->handle, window_surface, requested_extensions);
 
+	// The fallback GPU in select_physical_device() isn't checked, so it's done here before asking for a device with features it lacks
+	std::vector<std::string> missing_features = missing_required_features(physical_device);
+	if (!missing_features.empty()) {
+		Logger::logError("GPU is missing required features: " + join_names(missing_features));
+		vkDestroySurfaceKHR(instance->handle, window_surface, nullptr);
+		return false;
+	}
+
+	// Lets the texture streamer follow the real VRAM budget. Without it, it settles for a share of the heap size
+	if (!extension_enabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) && extension_supported(physical_device, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+		enabled_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	}
+
+	// Optional features are only turned on when the GPU has them, callers check format support before relying on them
+	VkPhysicalDeviceVulkan12Features supported_features_12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	VkPhysicalDeviceFeatures2 supported_features{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &supported_features_12 };
+	vkGetPhysicalDeviceFeatures2(physical_device, &supported_features);
+	device_features.textureCompressionBC = supported_features.features.textureCompressionBC;
+	features_12.samplerFilterMinmax = supported_features_12.samplerFilterMinmax;
+	features_12.descriptorBindingStorageImageUpdateAfterBind = supported_features_12.descriptorBindingStorageImageUpdateAfterBind;
+	sampler_filter_minmax = supported_features_12.samplerFilterMinmax;
+	storage_image_update_after_bind = supported_features_12.descriptorBindingStorageImageUpdateAfterBind;
+	device_features.drawIndirectFirstInstance = VK_TRUE;
+
 	// Query the physical device properties
     VkPhysicalDeviceProperties physical_device_properties;
 	vkGetPhysicalDeviceProperties(physical_device, &physical_device_properties);
@@ -98,18 +197,21 @@ void Device::initialize(Instance* instance, Window* window, const std::vector<co
 	.pQueueCreateInfos = queue_create_infos.data(),
 	.enabledLayerCount = static_cast<uint32_t>(requested_validation_layers->size()),
 	.ppEnabledLayerNames = requested_validation_layers->data(),
-	.enabledExtensionCount = static_cast<uint32_t>(requested_extensions->size()),
-	.ppEnabledExtensionNames = requested_extensions->data()
+	.enabledExtensionCount = static_cast<uint32_t>(enabled_extensions.size()),
+	.ppEnabledExtensionNames = enabled_extensions.data()
 	};
 
 	if (vkCreateDevice(physical_device, &device_create_info, nullptr, &logical_device) != VK_SUCCESS) {
         Logger::logError("Failed to create logical device!");
+		vkDestroySurfaceKHR(instance->handle, window_surface, nullptr);
+		return false;
 	}
     Logger::log("Vulkan device successfully created.");
 
 	// Get handles for the graphics and present queues
 	vkGetDeviceQueue(logical_device, queue_indices.graphics_family.value(), 0, &graphics_queue);
 	vkGetDeviceQueue(logical_device, queue_indices.present_family.value(), 0, &present_queue);
+	return true;
 }
 
 void Device::cleanup() {
@@ -144,6 +246,18 @@ bool Device::check_device_extension_support(VkPhysicalDevice physical_device, co
 	return false;
 }
 
+bool Device::extension_supported(VkPhysicalDevice physical_device, const char* extension_name) {
+	uint32_t extension_count;
+	vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_count, nullptr);
+	std::vector<VkExtensionProperties> available_extensions(extension_count);
+	vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_count, available_extensions.data());
+
+	for (const auto& extension : available_extensions) {
+		if (std::string(extension.extensionName) == extension_name) return true;
+	}
+	return false;
+}
+
 bool Device::device_suitable(VkPhysicalDevice physical_device, VkSurfaceKHR surface, const std::vector<const char*>* device_extensions) {
 
 	QueueFamilyIndices indices = QueueFamilyIndices::find_queue_families(physical_device, surface);
@@ -154,7 +268,12 @@ bool Device::device_suitable(VkPhysicalDevice physical_device, VkSurfaceKHR surf
 	vkGetPhysicalDeviceProperties(physical_device, &device_properties);
 	bool discrete_GPU = device_properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
 
-	return indices.complete() && extensions_supported && discrete_GPU;
+	std::vector<std::string> missing_features = missing_required_features(physical_device);
+	if (!missing_features.empty()) {
+		Logger::log(std::string(device_properties.deviceName) + " is missing required features: " + join_names(missing_features));
+	}
+
+	return indices.complete() && extensions_supported && discrete_GPU && missing_features.empty();
 }
 
 static std::string get_physical_device_name(VkPhysicalDevice physical_device) {
@@ -195,3 +314,16 @@ VkPhysicalDevice Device::select_physical_device(VkInstance instance, VkSurfaceKH
 
 	return selected_device;
 }
+
+bool Device::supports_format_features(VkFormat format, VkFormatFeatureFlags features) {
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(physical_device, format, &format_properties);
+    return (format_properties.optimalTilingFeatures & features) == features;
+}
+
+bool Device::extension_enabled(const char* extension_name) {
+    for (const char* extension : enabled_extensions) {
+        if (std::string(extension) == extension_name) return true;
+    }
+    return false;
+}
@@ -0,0 +1,28 @@
+#include "file_utils.h"
+#include "logger.h"
+#include <fstream>
+#include <string>
+#include <system_error>
+
+bool FileUtils::write_file_atomically(const std::filesystem::path& path, std::span<const uint8_t> header, std::span<const uint8_t> payload) {
+    std::error_code error;
+    if (path.has_parent_path()) std::filesystem::create_directories(path.parent_path(), error);
+    std::filesystem::path temporary_path = path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+        file.write(reinterpret_cast<const char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+        if (!file) {
+            Logger::logError("Failed to write " + temporary_path.string());
+            return false;
+        }
+    }
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+        Logger::logError("Failed to replace " + path.string() + ": " + error.message());
+        std::filesystem::remove(temporary_path, error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,183 @@
+#include "frustum_culling.h"
+#include "logger.h"
+#include "glm/gtc/matrix_access.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <string>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRUSTUM_CULLING_SSE
+#include <emmintrin.h>
+#endif
+
+// BOUNDING SPHERE SOA -----------------------------------------------------------------------------------------------------------------
+
+void BoundingSphereSoA::clear() {
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+}
+
+void BoundingSphereSoA::reserve(size_t count) {
+    x.reserve(count);
+    y.reserve(count);
+    z.reserve(count);
+    radius.reserve(count);
+}
+
+void BoundingSphereSoA::push_back(const glm::vec4& sphere) {
+    x.push_back(sphere.x);
+    y.push_back(sphere.y);
+    z.push_back(sphere.z);
+    radius.push_back(sphere.w);
+}
+
+void BoundingSphereSoA::set(size_t index, const glm::vec4& sphere) {
+    x[index] = sphere.x;
+    y[index] = sphere.y;
+    z[index] = sphere.z;
+    radius[index] = sphere.w;
+}
+
+// FRUSTUM CULLING ---------------------------------------------------------------------------------------------------------------------
+
+FrustumPlanes FrustumCulling::extract_planes(const glm::mat4& clip_from_space) {
+    // Gribb & Hartmann. Vulkan's clip space has 0 <= z <= w, so the near/far planes are z and w - z.
+    // That also holds for reversed depth, where near and far just swap places
+    const glm::vec4 row_0 = glm::row(clip_from_space, 0);
+    const glm::vec4 row_1 = glm::row(clip_from_space, 1);
+    const glm::vec4 row_2 = glm::row(clip_from_space, 2);
+    const glm::vec4 row_3 = glm::row(clip_from_space, 3);
+
+    FrustumPlanes planes{
+        row_3 + row_0,
+        row_3 - row_0,
+        row_3 + row_1,
+        row_3 - row_1,
+        row_2,
+        row_3 - row_2,
+    };
+    for (glm::vec4& plane : planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return planes;
+}
+
+bool FrustumCulling::is_sphere_visible(const FrustumPlanes& planes, const glm::vec4& sphere) {
+    for (const glm::vec4& plane : planes) {
+        if (glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w < -sphere.w) return false;
+    }
+    return true;
+}
+
+bool FrustumCulling::is_aabb_visible(const FrustumPlanes& planes, const glm::vec3& min_corner, const glm::vec3& max_corner) {
+    for (const glm::vec4& plane : planes) {
+        // Only the corner furthest along the plane's normal needs testing
+        glm::vec3 furthest_corner{
+            plane.x >= 0.0f ? max_corner.x : min_corner.x,
+            plane.y >= 0.0f ? max_corner.y : min_corner.y,
+            plane.z >= 0.0f ? max_corner.z : min_corner.z,
+        };
+        if (glm::dot(glm::vec3(plane), furthest_corner) + plane.w < 0.0f) return false;
+    }
+    return true;
+}
+
+void FrustumCulling::cull_spheres_scalar(const FrustumPlanes& planes, const BoundingSphereSoA& spheres, std::vector<uint8_t>& visible, size_t first, size_t end) {
+    end = std::min(end, spheres.size());
+    if (visible.size() < spheres.size()) visible.resize(spheres.size());
+    for (size_t i_sphere = first; i_sphere < end; i_sphere++) {
+        glm::vec4 sphere{ spheres.x[i_sphere], spheres.y[i_sphere], spheres.z[i_sphere], spheres.radius[i_sphere] };
+        visible[i_sphere] = is_sphere_visible(planes, sphere) ? 1 : 0;
+    }
+}
+
+void FrustumCulling::cull_spheres(const FrustumPlanes& planes, const BoundingSphereSoA& spheres, std::vector<uint8_t>& visible, size_t first, size_t end) {
+    const size_t count = std::min(end, spheres.size());
+    if (visible.size() < spheres.size()) visible.resize(spheres.size());
+    size_t i_sphere = first;
+
+#if defined(__AVX__)
+    // Every lane tests a different sphere against the same plane, so the planes get broadcast once up front
+    __m256 plane_x[6], plane_y[6], plane_z[6], plane_w[6];
+    for (size_t i_plane = 0; i_plane < 6; i_plane++) {
+        plane_x[i_plane] = _mm256_set1_ps(planes[i_plane].x);
+        plane_y[i_plane] = _mm256_set1_ps(planes[i_plane].y);
+        plane_z[i_plane] = _mm256_set1_ps(planes[i_plane].z);
+        plane_w[i_plane] = _mm256_set1_ps(planes[i_plane].w);
+    }
+
+    for (; i_sphere + 8 <= count; i_sphere += 8) {
+        const __m256 x = _mm256_loadu_ps(spheres.x.data() + i_sphere);
+        const __m256 y = _mm256_loadu_ps(spheres.y.data() + i_sphere);
+        const __m256 z = _mm256_loadu_ps(spheres.z.data() + i_sphere);
+        const __m256 negative_radius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(spheres.radius.data() + i_sphere));
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (size_t i_plane = 0; i_plane < 6; i_plane++) {
+            __m256 distance = _mm256_add_ps(_mm256_mul_ps(plane_x[i_plane], x), plane_w[i_plane]);
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(plane_y[i_plane], y));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(plane_z[i_plane], z));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negative_radius, _CMP_GE_OQ));
+        }
+
+        const int mask = _mm256_movemask_ps(inside);
+        for (size_t i_lane = 0; i_lane < 8; i_lane++) {
+            visible[i_sphere + i_lane] = (mask >> i_lane) & 1;
+        }
+    }
+#elif defined(FRUSTUM_CULLING_SSE)
+    __m128 plane_x[6], plane_y[6], plane_z[6], plane_w[6];
+    for (size_t i_plane = 0; i_plane < 6; i_plane++) {
+        plane_x[i_plane] = _mm_set1_ps(planes[i_plane].x);
+        plane_y[i_plane] = _mm_set1_ps(planes[i_plane].y);
+        plane_z[i_plane] = _mm_set1_ps(planes[i_plane].z);
+        plane_w[i_plane] = _mm_set1_ps(planes[i_plane].w);
+    }
+
+    for (; i_sphere + 4 <= count; i_sphere += 4) {
+        const __m128 x = _mm_loadu_ps(spheres.x.data() + i_sphere);
+        const __m128 y = _mm_loadu_ps(spheres.y.data() + i_sphere);
+        const __m128 z = _mm_loadu_ps(spheres.z.data() + i_sphere);
+        const __m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(spheres.radius.data() + i_sphere));
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (size_t i_plane = 0; i_plane < 6; i_plane++) {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(plane_x[i_plane], x), plane_w[i_plane]);
+            distance = _mm_add_ps(distance, _mm_mul_ps(plane_y[i_plane], y));
+            distance = _mm_add_ps(distance, _mm_mul_ps(plane_z[i_plane], z));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negative_radius));
+        }
+
+        const int mask = _mm_movemask_ps(inside);
+        for (size_t i_lane = 0; i_lane < 4; i_lane++) {
+            visible[i_sphere + i_lane] = (mask >> i_lane) & 1;
+        }
+    }
+#endif
+
+    // Whatever didn't fill a whole batch
+    cull_spheres_scalar(planes, spheres, visible, i_sphere, count);
+
+#ifndef NDEBUG
+    // The SIMD paths have to agree with the scalar test. Only spheres touching a plane to within rounding may differ,
+    // since the compiler is free to order or fuse the multiply-adds differently in each
+    for (size_t i_check = first; i_check < count; i_check++) {
+        const glm::vec4 sphere{ spheres.x[i_check], spheres.y[i_check], spheres.z[i_check], spheres.radius[i_check] };
+        if (visible[i_check] == (is_sphere_visible(planes, sphere) ? 1 : 0)) continue;
+
+        float closest_plane = FLT_MAX;
+        for (const glm::vec4& plane : planes) {
+            closest_plane = std::min(closest_plane, std::abs(glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w + sphere.w));
+        }
+        if (closest_plane > 1e-4f * (1.0f + glm::length(glm::vec3(sphere)) + sphere.w)) {
+            Logger::logError("SIMD frustum culling disagrees with the scalar version for sphere " + std::to_string(i_check));
+            break;
+        }
+    }
+#endif
+}
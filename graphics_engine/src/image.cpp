@@ -3,6 +3,11 @@
 #include "logger.h"
 #include "vulkan/vulkan_core.h"
 #include "renderer.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 // Image --------------------------------------------------------------------------------------------------
 
@@ -11,7 +16,7 @@ void Image::transition_image(Command* cmd, ImageType* image, VkImageLayout new_l
 	VkImageSubresourceRange subresource_range{
 		.aspectMask = aspect_mask,
 		.baseMipLevel = 0,
-		.levelCount = 1,
+		.levelCount = VK_REMAINING_MIP_LEVELS, // The whole chain always shares one layout outside of generate_mipmaps
 		.baseArrayLayer = 0,
 		.layerCount = 1
 	};
@@ -85,8 +90,261 @@ void Image::copy_image(Command* cmd, ImageType* src, ImageType* dst) {
     copy_subimage(cmd, src, src->extent, dst, dst->extent);
 }
 
+// Barrier for a range of mip levels, used while the levels of one image are in different layouts
+static void transition_mip_levels(
+    Command* cmd, ImageType* image, uint32_t base_level, uint32_t level_count,
+    VkImageLayout old_layout, VkImageLayout new_layout,
+    VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access,
+    VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access
+) {
+	VkImageMemoryBarrier2 image_barrier{
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+		.pNext = nullptr,
+		.srcStageMask = src_stage,
+		.srcAccessMask = src_access,
+		.dstStageMask = dst_stage,
+		.dstAccessMask = dst_access,
+		.oldLayout = old_layout,
+		.newLayout = new_layout,
+		.image = image->handle,
+		.subresourceRange = {
+		    .aspectMask = image->aspect_flags,
+		    .baseMipLevel = base_level,
+		    .levelCount = level_count,
+		    .baseArrayLayer = 0,
+		    .layerCount = 1
+		}
+	};
+
+	VkDependencyInfo dependency_info{
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.pNext = nullptr,
+		.imageMemoryBarrierCount = 1,
+		.pImageMemoryBarriers = &image_barrier
+	};
+
+	vkCmdPipelineBarrier2(cmd->buffer, &dependency_info);
+}
+
+FormatBlock Image::format_block(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC4_SNORM_BLOCK:
+            return { 4, 4, 8 };
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+        case VK_FORMAT_BC5_SNORM_BLOCK:
+        case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+            return { 4, 4, 16 };
+        case VK_FORMAT_R8_UNORM:
+            return { 1, 1, 1 };
+        case VK_FORMAT_R8G8_UNORM:
+            return { 1, 1, 2 };
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_R32_SFLOAT:
+        case VK_FORMAT_D32_SFLOAT:
+            return { 1, 1, 4 };
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+            return { 1, 1, 8 };
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            return { 1, 1, 16 };
+        default:
+            return { 1, 1, 0 };
+    }
+}
+
+size_t Image::level_size(VkFormat format, VkExtent3D extent) {
+    // Partial blocks at the edges still take up a whole block
+    FormatBlock block = format_block(format);
+    size_t blocks_x = (extent.width + block.width - 1) / block.width;
+    size_t blocks_y = (extent.height + block.height - 1) / block.height;
+    return blocks_x * blocks_y * extent.depth * block.bytes;
+}
+
+VkExtent3D Image::mip_extent(VkExtent3D extent, uint32_t level) {
+    return VkExtent3D{
+        std::max(extent.width >> level, 1u),
+        std::max(extent.height >> level, 1u),
+        std::max(extent.depth >> level, 1u),
+    };
+}
+
+void Image::generate_mipmaps(Command* cmd, ImageType* image) {
+    // Each level is blitted from the one above it, so level i-1 has to be finished and readable before level i is written
+    for (uint32_t i_level = 1; i_level < image->mip_level_count; i_level++) {
+        transition_mip_levels(cmd, image, i_level - 1, 1,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+
+        VkExtent3D src_extent = mip_extent(image->extent, i_level - 1);
+        VkExtent3D dst_extent = mip_extent(image->extent, i_level);
+
+        VkImageBlit2 blit_region{
+            .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
+            .pNext = nullptr
+        };
+        blit_region.srcOffsets[1] = { static_cast<int32_t>(src_extent.width), static_cast<int32_t>(src_extent.height), static_cast<int32_t>(src_extent.depth) };
+        blit_region.dstOffsets[1] = { static_cast<int32_t>(dst_extent.width), static_cast<int32_t>(dst_extent.height), static_cast<int32_t>(dst_extent.depth) };
+
+        blit_region.srcSubresource.aspectMask = image->aspect_flags;
+        blit_region.srcSubresource.baseArrayLayer = 0;
+        blit_region.srcSubresource.layerCount = 1;
+        blit_region.srcSubresource.mipLevel = i_level - 1;
+
+        blit_region.dstSubresource.aspectMask = image->aspect_flags;
+        blit_region.dstSubresource.baseArrayLayer = 0;
+        blit_region.dstSubresource.layerCount = 1;
+        blit_region.dstSubresource.mipLevel = i_level;
+
+        VkBlitImageInfo2 blit_info{
+            .sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
+            .pNext = nullptr,
+            .srcImage = image->handle,
+            .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .dstImage = image->handle,
+            .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .regionCount = 1,
+            .pRegions = &blit_region,
+            .filter = VK_FILTER_LINEAR
+        };
+        vkCmdBlitImage2(cmd->buffer, &blit_info);
+    }
+
+    // Every level except the last one ended up as a blit source
+    const uint32_t last_level = image->mip_level_count - 1;
+    if (last_level > 0) {
+        transition_mip_levels(cmd, image, 0, last_level,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+    }
+    transition_mip_levels(cmd, image, last_level, 1,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+
+    image->layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+}
+
+bool Image::can_build_mip_chain(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R8_UNORM:
+        case VK_FORMAT_R8G8_UNORM:
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_sRGB(VkFormat format) {
+    return format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_B8G8R8A8_SRGB;
+}
+
+static float sRGB_to_linear(float value) {
+    return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linear_to_sRGB(float value) {
+    return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+}
+
+// 2x2 box filter from one mip level to the next, for 8-bit UNORM formats only.
+// sRGB colors are averaged in linear space, otherwise the smaller levels come out darker than they should
+static void downsample_level(const uint8_t* src, VkExtent3D src_extent, uint8_t* dst, VkExtent3D dst_extent, VkFormat format) {
+    const size_t pixel_bytes = Image::format_block(format).bytes;
+    const bool srgb = is_sRGB(format);
+
+    std::array<float, 256> to_linear;
+    for (size_t i_value = 0; i_value < to_linear.size(); i_value++) {
+        float value = static_cast<float>(i_value) / 255.0f;
+        to_linear[i_value] = srgb ? sRGB_to_linear(value) : value;
+    }
+
+    for (uint32_t y = 0; y < dst_extent.height; y++) {
+        // Odd sizes just reuse the last row/column
+        uint32_t y0 = std::min(y * 2, src_extent.height - 1);
+        uint32_t y1 = std::min(y * 2 + 1, src_extent.height - 1);
+        for (uint32_t x = 0; x < dst_extent.width; x++) {
+            uint32_t x0 = std::min(x * 2, src_extent.width - 1);
+            uint32_t x1 = std::min(x * 2 + 1, src_extent.width - 1);
+            for (size_t channel = 0; channel < pixel_bytes; channel++) {
+                uint8_t texels[4] = {
+                    src[(y0 * src_extent.width + x0) * pixel_bytes + channel],
+                    src[(y0 * src_extent.width + x1) * pixel_bytes + channel],
+                    src[(y1 * src_extent.width + x0) * pixel_bytes + channel],
+                    src[(y1 * src_extent.width + x1) * pixel_bytes + channel],
+                };
+                uint8_t& result = dst[(y * dst_extent.width + x) * pixel_bytes + channel];
+
+                // Alpha is always stored linearly
+                if (!srgb || channel == 3) {
+                    result = static_cast<uint8_t>((texels[0] + texels[1] + texels[2] + texels[3] + 2) / 4);
+                    continue;
+                }
+                float average = (to_linear[texels[0]] + to_linear[texels[1]] + to_linear[texels[2]] + to_linear[texels[3]]) * 0.25f;
+                result = static_cast<uint8_t>(std::clamp(linear_to_sRGB(average), 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+    }
+}
+
+std::vector<uint8_t> Image::build_mip_chain(const void* data, VkExtent3D extent, VkFormat format, uint32_t level_count, std::vector<size_t>& level_offsets) {
+    if (level_count > 1 && !can_build_mip_chain(format)) {
+        Logger::log("Can't filter this image format on the CPU, keeping only its base level");
+        level_count = 1;
+    }
+
+    level_offsets.resize(level_count);
+    size_t data_size = 0;
+    for (uint32_t i_level = 0; i_level < level_count; i_level++) {
+        level_offsets[i_level] = data_size;
+        data_size += level_size(format, mip_extent(extent, i_level));
+    }
+
+    std::vector<uint8_t> mip_chain(data_size);
+    std::memcpy(mip_chain.data(), data, level_count > 1 ? level_offsets[1] : data_size);
+    for (uint32_t i_level = 1; i_level < level_count; i_level++) {
+        downsample_level(
+            mip_chain.data() + level_offsets[i_level - 1], mip_extent(extent, i_level - 1),
+            mip_chain.data() + level_offsets[i_level], mip_extent(extent, i_level),
+            format
+        );
+    }
+    return mip_chain;
+}
+
 void Image::copy_data_to_image(ImageType *image, void *data, size_t pixel_bytes) {
 
+    // Blitting between levels needs the format to support blits and linear filtering. If it doesn't, the chain is built on the CPU instead
+    const bool has_mipmaps = image->mip_level_count > 1;
+    const bool can_blit = image->renderer->device.supports_format_features(image->format,
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+    if (has_mipmaps && !can_blit) {
+        Logger::log("Image format can't be blitted, building its mip chain on the CPU");
+        std::vector<size_t> level_offsets;
+        std::vector<uint8_t> mip_chain = build_mip_chain(data, image->extent, image->format, image->mip_level_count, level_offsets);
+        copy_mip_levels_to_image(image, mip_chain.data(), mip_chain.size(), level_offsets);
+        return;
+    }
+
     size_t data_size = image->extent.depth * image->extent.width * image->extent.height * pixel_bytes;
 	Buffer upload_buffer = image->renderer->create_buffer(data_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
     upload_buffer.write_data(data);
@@ -101,16 +359,52 @@ void Image::copy_data_to_image(ImageType *image, void *data, size_t pixel_bytes)
 		    .imageExtent = image->extent,
         };
 
-        // Just doing the base mipmap level for now.
+        // Only the base level comes from the CPU, the rest are blitted from it
         copy_info.imageSubresource.aspectMask = image->aspect_flags;
 		copy_info.imageSubresource.mipLevel = 0;
 		copy_info.imageSubresource.baseArrayLayer = 0;
-		copy_info.imageSubresource.layerCount = image->mip_level_count;
+		copy_info.imageSubresource.layerCount = 1;
 
 		// copy the buffer into the image
 		vkCmdCopyBufferToImage(immediate_command->buffer, upload_buffer.handle, image->handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy_info);
 
-		Image::transition_image(immediate_command, image,	VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        if (has_mipmaps) {
+            Image::generate_mipmaps(immediate_command, image);
+        } else {
+		    Image::transition_image(immediate_command, image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        }
+    });
+
+    upload_buffer.cleanup();
+}
+
+void Image::copy_mip_levels_to_image(ImageType* image, const void* data, size_t data_size, std::span<const size_t> level_offsets) {
+    const uint32_t level_count = std::min(static_cast<uint32_t>(level_offsets.size()), image->mip_level_count);
+
+    // Compressed levels are copied whole. Their extents don't have to be block aligned as long as they cover the entire level
+    std::vector<VkBufferImageCopy> copy_infos(level_count);
+    for (uint32_t i_level = 0; i_level < level_count; i_level++) {
+        copy_infos[i_level] = VkBufferImageCopy{
+            .bufferOffset = level_offsets[i_level],
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource = {
+                .aspectMask = image->aspect_flags,
+                .mipLevel = i_level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+            .imageExtent = mip_extent(image->extent, i_level),
+        };
+    }
+
+	Buffer upload_buffer = image->renderer->create_buffer(data_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+    upload_buffer.write_data(const_cast<void*>(data));
+
+    image->renderer->immediate_command.run_command([&](Command* immediate_command) {
+        Image::transition_image(immediate_command, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+		vkCmdCopyBufferToImage(immediate_command->buffer, upload_buffer.handle, image->handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, level_count, copy_infos.data());
+		Image::transition_image(immediate_command, image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
     });
 
     upload_buffer.cleanup();
@@ -0,0 +1,100 @@
+#include "ktx.h"
+#include "image.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+static constexpr uint8_t KTX2_identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+// Layout of the fixed part of the file, see the "File Structure" section of the KTX2 spec
+struct KTX2Header {
+    uint8_t identifier[12];
+    uint32_t vk_format;
+    uint32_t type_size;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_depth;
+    uint32_t layer_count;
+    uint32_t face_count;
+    uint32_t level_count;
+    uint32_t supercompression_scheme;
+
+    uint32_t dfd_byte_offset;
+    uint32_t dfd_byte_length;
+    uint32_t kvd_byte_offset;
+    uint32_t kvd_byte_length;
+    uint64_t sgd_byte_offset;
+    uint64_t sgd_byte_length;
+};
+static_assert(sizeof(KTX2Header) == 80, "KTX2 header must match the file layout");
+
+struct KTX2LevelIndex {
+    uint64_t byte_offset;
+    uint64_t byte_length;
+    uint64_t uncompressed_byte_length;
+};
+
+bool KTX::is_KTX2(std::span<const std::byte> bytes) {
+    return bytes.size() >= sizeof(KTX2_identifier) && std::memcmp(bytes.data(), KTX2_identifier, sizeof(KTX2_identifier)) == 0;
+}
+
+std::optional<KTXTexture> KTX::load_KTX2(std::span<const std::byte> bytes) {
+    if (!is_KTX2(bytes) || bytes.size() < sizeof(KTX2Header)) {
+        Logger::logError("Not a KTX2 file");
+        return {};
+    }
+
+    KTX2Header header;
+    std::memcpy(&header, bytes.data(), sizeof(KTX2Header));
+
+    if (header.supercompression_scheme != 0) {
+        Logger::logError("Supercompressed KTX2 files aren't supported (scheme " + std::to_string(header.supercompression_scheme) + ")");
+        return {};
+    }
+    if (header.layer_count > 1 || header.face_count != 1 || header.pixel_depth > 1 || header.pixel_height == 0) {
+        Logger::logError("Only 2D, single layer KTX2 textures are supported");
+        return {};
+    }
+
+    KTXTexture texture;
+    texture.format = static_cast<VkFormat>(header.vk_format);
+    texture.extent = VkExtent3D{ header.pixel_width, header.pixel_height, 1 };
+
+    if (Image::format_block(texture.format).bytes == 0) {
+        Logger::logError("Unsupported KTX2 format: " + std::to_string(header.vk_format));
+        return {};
+    }
+
+    // A level count of 0 asks the loader to generate mips, we just use the base level
+    const uint32_t level_count = std::max(header.level_count, 1u);
+    const size_t level_index_end = sizeof(KTX2Header) + level_count * sizeof(KTX2LevelIndex);
+    if (bytes.size() < level_index_end) {
+        Logger::logError("KTX2 file is truncated");
+        return {};
+    }
+
+    std::vector<KTX2LevelIndex> levels(level_count);
+    std::memcpy(levels.data(), bytes.data() + sizeof(KTX2Header), level_count * sizeof(KTX2LevelIndex));
+
+    // The file stores the smallest level first, but the level index is always ordered largest first.
+    // Repack them that way and keep every level 16 byte aligned, which satisfies the copy alignment of every block size
+    size_t total_size = 0;
+    texture.level_offsets.resize(level_count);
+    for (uint32_t i_level = 0; i_level < level_count; i_level++) {
+        const KTX2LevelIndex& level = levels[i_level];
+        const size_t expected_size = Image::level_size(texture.format, Image::mip_extent(texture.extent, i_level));
+        if (level.byte_length != expected_size || level.byte_offset + level.byte_length > bytes.size()) {
+            Logger::logError("KTX2 mip level " + std::to_string(i_level) + " has an invalid size or offset");
+            return {};
+        }
+        texture.level_offsets[i_level] = total_size;
+        total_size += (level.byte_length + 15) & ~size_t(15);
+    }
+
+    texture.data.resize(total_size);
+    for (uint32_t i_level = 0; i_level < level_count; i_level++) {
+        std::memcpy(texture.data.data() + texture.level_offsets[i_level], bytes.data() + levels[i_level].byte_offset, levels[i_level].byte_length);
+    }
+    return texture;
+}
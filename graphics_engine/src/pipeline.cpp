@@ -5,18 +5,21 @@
 // PIPELINE  ------------------------------------------------------------------------------------------------------------------------------------
 
 void Pipeline::cleanup() {
-    vkDestroyPipelineLayout(device->logical_device, layout, nullptr);
+    // A shared layout goes away with the last pipeline using it
+    if (shared_layout) shared_layout.reset();
+    else vkDestroyPipelineLayout(device->logical_device, layout, nullptr);
     vkDestroyPipeline(device->logical_device, handle, nullptr);
 }
 
 // PIPELINE BUILDER -----------------------------------------------------------------------------------------------------------------------------
 
-void PipelineBuilder::initialize(Device* device) {
+void PipelineBuilder::initialize(Device* device, VkPipelineCache pipeline_cache) {
     this->device = device;
+    this->pipeline_cache = pipeline_cache;
 	clear();
 }
 
-Pipeline PipelineBuilder::build() {
+Pipeline PipelineBuilder::build(VkPipelineLayout layout) {
 
     VkPipelineVertexInputStateCreateInfo vertex_input_state{
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
@@ -51,10 +54,12 @@ Pipeline PipelineBuilder::build() {
         .pDynamicStates = &state[0]
     };
 
-    VkPipelineLayout layout = PipelineLayout::create_pipeline_layout(
-        device,
-        PipelineLayout::pipeline_layout_create_info(config.descriptor_set_layouts, config.push_constant_ranges)
-    );
+    if (layout == VK_NULL_HANDLE) {
+        layout = PipelineLayout::create_pipeline_layout(
+            device,
+            PipelineLayout::pipeline_layout_create_info(config.descriptor_set_layouts, config.push_constant_ranges)
+        );
+    }
 
     // Build the pipeline
     VkGraphicsPipelineCreateInfo pipeline_info{
@@ -74,8 +79,8 @@ Pipeline PipelineBuilder::build() {
         .renderPass = nullptr // Using dynamic rendering
     };
 
-    VkPipeline pipeline;
-    if (vkCreateGraphicsPipelines(device->logical_device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline) != VK_SUCCESS) {
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    if (vkCreateGraphicsPipelines(device->logical_device, pipeline_cache, 1, &pipeline_info, nullptr, &pipeline) != VK_SUCCESS) {
         Logger::logError("Failed to create pipeline");
     }
 
@@ -87,8 +92,37 @@ Pipeline PipelineBuilder::build() {
     return new_pipeline;
 }
 
+Pipeline PipelineBuilder::build_compute(VkPipelineLayout layout) {
+    if (layout == VK_NULL_HANDLE) {
+        layout = PipelineLayout::create_pipeline_layout(
+            device,
+            PipelineLayout::pipeline_layout_create_info(config.descriptor_set_layouts, config.push_constant_ranges)
+        );
+    }
+
+    VkComputePipelineCreateInfo pipeline_info{
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .pNext = nullptr,
+        .stage = config.shader_modules[0],
+        .layout = layout,
+    };
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    if (vkCreateComputePipelines(device->logical_device, pipeline_cache, 1, &pipeline_info, nullptr, &pipeline) != VK_SUCCESS) {
+        Logger::logError("Failed to create compute pipeline");
+    }
+
+    Pipeline new_pipeline;
+    new_pipeline.device = device;
+    new_pipeline.handle = pipeline;
+    new_pipeline.layout = layout;
+
+    return new_pipeline;
+}
+
 void PipelineBuilder::clear() {
     config.shader_modules.clear();
+    config.shader_code_ids.clear();
     config.input_assembly = { .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
     config.rasterizer = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
     config.color_blend_attachment = {};
@@ -97,6 +131,7 @@ void PipelineBuilder::clear() {
     config.rendering_info = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
     config.color_attachment_format = VK_FORMAT_UNDEFINED;
     config.descriptor_set_layouts.clear();
+    config.descriptor_set_layout_descriptions.clear();
     config.push_constant_ranges.clear();
     config.vertex_binding_descriptions.clear();
     config.vertex_attribute_descriptions.clear();
@@ -112,6 +147,7 @@ PipelineBuilder& PipelineBuilder::set_config(PipelineConfig config) {
 
 PipelineBuilder& PipelineBuilder::set_shader(Shader shader) {
     config.shader_modules.push_back(Shader::pipeline_shader_stage_create_info(shader.stage, shader.module));
+    config.shader_code_ids.push_back(shader.code_id);
     return *this;
 }
 
@@ -192,9 +228,14 @@ PipelineBuilder& PipelineBuilder::set_depth_attachment_format(VkFormat format) {
     return *this;
 }
 
-PipelineBuilder& PipelineBuilder::set_depth_test(VkCompareOp compare_op) {
+PipelineBuilder& PipelineBuilder::set_color_write_mask(VkColorComponentFlags mask) {
+    config.color_blend_attachment.colorWriteMask = mask;
+    return *this;
+}
+
+PipelineBuilder& PipelineBuilder::set_depth_test(VkCompareOp compare_op, bool depth_write) {
     config.depth_stencil.depthTestEnable = compare_op == VK_COMPARE_OP_NEVER ? VK_FALSE : VK_TRUE;
-    config.depth_stencil.depthWriteEnable = compare_op == VK_COMPARE_OP_NEVER ? VK_FALSE : VK_TRUE;
+    config.depth_stencil.depthWriteEnable = compare_op == VK_COMPARE_OP_NEVER || !depth_write ? VK_FALSE : VK_TRUE;
     config.depth_stencil.depthCompareOp = compare_op;
     config.depth_stencil.depthBoundsTestEnable = VK_FALSE;
     config.depth_stencil.minDepthBounds = 0.0f;
@@ -208,8 +249,9 @@ PipelineBuilder& PipelineBuilder::set_depth_test(VkCompareOp compare_op) {
 // Pipeline Layout
 
 // TODO: @Cleanup make sure passing a span by value is acceptable
-PipelineBuilder& PipelineBuilder::add_descriptor(VkDescriptorSetLayout descriptor) {
+PipelineBuilder& PipelineBuilder::add_descriptor(VkDescriptorSetLayout descriptor, const DescriptorSetLayoutDescription& description) {
     config.descriptor_set_layouts.push_back(descriptor);
+    config.descriptor_set_layout_descriptions.push_back(description);
     return *this;
 }
 
@@ -0,0 +1,123 @@
+#include "pipeline_cache.h"
+#include "device.h"
+#include "hash.h"
+#include "file_utils.h"
+#include "logger.h"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+static constexpr uint32_t pipeline_cache_magic = 0x48434C50; // "PLCH"
+static constexpr uint32_t pipeline_cache_version = 1;
+
+PipelineCacheFileHeader PipelineCache::expected_header() const {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device->physical_device, &properties);
+
+    PipelineCacheFileHeader header{
+        .magic = pipeline_cache_magic,
+        .version = pipeline_cache_version,
+        .vendor_id = properties.vendorID,
+        .device_id = properties.deviceID,
+        .driver_version = properties.driverVersion,
+        .padding = 0,
+        .data_size = 0,
+        .data_hash = 0,
+    };
+    std::memcpy(header.pipeline_cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    return header;
+}
+
+// Returns the driver data of the file, or nothing if the file is missing or was written by another device or driver
+static std::vector<uint8_t> load_cache_data(const std::filesystem::path& path, const PipelineCacheFileHeader& expected) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return {};
+
+    const size_t file_size = static_cast<size_t>(file.tellg());
+    PipelineCacheFileHeader header;
+    if (file_size < sizeof(header)) {
+        Logger::log("Pipeline cache file is truncated, starting empty: " + path.string());
+        return {};
+    }
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    if (header.magic != expected.magic || header.version != expected.version) {
+        Logger::log("Pipeline cache file has an unknown format, starting empty: " + path.string());
+        return {};
+    }
+    if (header.vendor_id != expected.vendor_id || header.device_id != expected.device_id || header.driver_version != expected.driver_version ||
+        std::memcmp(header.pipeline_cache_uuid, expected.pipeline_cache_uuid, VK_UUID_SIZE) != 0) {
+        Logger::log("Pipeline cache was written by another GPU or driver, starting empty");
+        return {};
+    }
+    if (header.data_size != file_size - sizeof(header)) {
+        Logger::log("Pipeline cache file is truncated, starting empty: " + path.string());
+        return {};
+    }
+
+    std::vector<uint8_t> data(header.data_size);
+    file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    if (!file || Hash::hash_bytes(data.data(), data.size()) != header.data_hash) {
+        Logger::log("Pipeline cache file is corrupted, starting empty: " + path.string());
+        return {};
+    }
+    return data;
+}
+
+void PipelineCache::initialize(Device* device, const std::filesystem::path& path) {
+    this->device = device;
+    this->path = path;
+
+    std::vector<uint8_t> data;
+    if (!path.empty()) data = load_cache_data(path, expected_header());
+
+    VkPipelineCacheCreateInfo cache_info{
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = data.size(),
+        .pInitialData = data.empty() ? nullptr : data.data(),
+    };
+    if (vkCreatePipelineCache(device->logical_device, &cache_info, nullptr, &handle) != VK_SUCCESS) {
+        // The driver can still refuse data that passed our checks, an empty cache is always fine
+        Logger::logError("Failed to create the pipeline cache from " + path.string() + ", starting empty");
+        cache_info.initialDataSize = 0;
+        cache_info.pInitialData = nullptr;
+        if (vkCreatePipelineCache(device->logical_device, &cache_info, nullptr, &handle) != VK_SUCCESS) {
+            Logger::logError("Failed to create the pipeline cache");
+            handle = VK_NULL_HANDLE;
+        }
+    } else if (!data.empty()) {
+        Logger::log("Loaded pipeline cache (" + std::to_string(data.size()) + " bytes): " + path.string());
+    }
+}
+
+void PipelineCache::cleanup() {
+    if (handle == VK_NULL_HANDLE) return;
+    save();
+    vkDestroyPipelineCache(device->logical_device, handle, nullptr);
+    handle = VK_NULL_HANDLE;
+}
+
+bool PipelineCache::save() {
+    if (handle == VK_NULL_HANDLE || path.empty()) return false;
+
+    size_t data_size = 0;
+    if (vkGetPipelineCacheData(device->logical_device, handle, &data_size, nullptr) != VK_SUCCESS) {
+        Logger::logError("Failed to get the pipeline cache size");
+        return false;
+    }
+    std::vector<uint8_t> data(data_size);
+    if (vkGetPipelineCacheData(device->logical_device, handle, &data_size, data.data()) != VK_SUCCESS) {
+        Logger::logError("Failed to get the pipeline cache data");
+        return false;
+    }
+    data.resize(data_size);
+
+    PipelineCacheFileHeader header = expected_header();
+    header.data_size = data.size();
+    header.data_hash = Hash::hash_bytes(data.data(), data.size());
+
+    return FileUtils::write_file_atomically(path, std::span(reinterpret_cast<const uint8_t*>(&header), sizeof(header)), data);
+}
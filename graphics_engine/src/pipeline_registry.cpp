@@ -0,0 +1,184 @@
+#include "pipeline_registry.h"
+#include "device.h"
+#include "hash.h"
+#include "logger.h"
+#include <bit>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Appends raw bytes to a key, zero padded to whole words
+static void append_bytes(std::vector<uint64_t>& key, const void* data, size_t size) {
+    const size_t first_word = key.size();
+    key.resize(first_word + (size + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+    if (size > 0) std::memcpy(key.data() + first_word, data, size);
+}
+
+// Set layouts go in by what they were created from, a handle can be reused for a different layout once it's destroyed
+static std::vector<uint64_t> layout_key(const PipelineConfig& config) {
+    std::vector<uint64_t> key = { config.descriptor_set_layout_descriptions.size(), config.push_constant_ranges.size() };
+    for (const DescriptorSetLayoutDescription& description : config.descriptor_set_layout_descriptions) {
+        key.push_back(description.flags);
+        key.push_back(description.bindings.size());
+        for (const VkDescriptorSetLayoutBinding& binding : description.bindings) {
+            key.push_back(binding.binding);
+            key.push_back(binding.descriptorType);
+            key.push_back(binding.descriptorCount);
+            key.push_back(binding.stageFlags);
+            key.push_back(binding.pImmutableSamplers != nullptr); // None of the layouts use them, but they'd make two layouts differ
+        }
+        key.push_back(description.binding_flags.size());
+        key.insert(key.end(), description.binding_flags.begin(), description.binding_flags.end());
+    }
+    append_bytes(key, config.push_constant_ranges.data(), config.push_constant_ranges.size() * sizeof(VkPushConstantRange));
+    return key;
+}
+
+// Everything build() and build_compute() read from the config has to be in here, or two different pipelines would
+// end up sharing an entry. The create info structs are copied field by field, their sTypes and pointers say nothing.
+// Entries are found by the key's hash but only handed out if the whole key matches
+static std::vector<uint64_t> config_key(const PipelineConfig& config, bool compute) {
+    std::vector<uint64_t> key = layout_key(config);
+    auto add = [&](uint64_t value) { key.push_back(value); };
+    auto add_float = [&](float value) { add(std::bit_cast<uint32_t>(value)); };
+    add(compute ? 1 : 0);
+
+    // Shader modules are created per build, so shaders are told apart by their code instead
+    for (size_t i_shader = 0; i_shader < config.shader_modules.size(); i_shader++) {
+        const std::string_view entry_point = config.shader_modules[i_shader].pName;
+        const ShaderCodeId& code_id = config.shader_code_ids[i_shader];
+        add(config.shader_modules[i_shader].stage);
+        add(code_id.hash);
+        add(code_id.check_hash);
+        add(code_id.size);
+        add(entry_point.size());
+        append_bytes(key, entry_point.data(), entry_point.size());
+        if (compute) break; // Only the first shader is used
+    }
+    if (compute) return key;
+
+    add(config.input_assembly.topology);
+    add(config.input_assembly.primitiveRestartEnable);
+
+    add(config.rasterizer.depthClampEnable);
+    add(config.rasterizer.rasterizerDiscardEnable);
+    add(config.rasterizer.polygonMode);
+    add(config.rasterizer.cullMode);
+    add(config.rasterizer.frontFace);
+    add(config.rasterizer.depthBiasEnable);
+    add_float(config.rasterizer.depthBiasConstantFactor);
+    add_float(config.rasterizer.depthBiasClamp);
+    add_float(config.rasterizer.depthBiasSlopeFactor);
+    add_float(config.rasterizer.lineWidth);
+
+    append_bytes(key, &config.color_blend_attachment, sizeof(VkPipelineColorBlendAttachmentState));
+
+    add(config.multisampling.rasterizationSamples);
+    add(config.multisampling.sampleShadingEnable);
+    add_float(config.multisampling.minSampleShading);
+    add(config.multisampling.alphaToCoverageEnable);
+    add(config.multisampling.alphaToOneEnable);
+
+    add(config.depth_stencil.depthTestEnable);
+    add(config.depth_stencil.depthWriteEnable);
+    add(config.depth_stencil.depthCompareOp);
+    add(config.depth_stencil.depthBoundsTestEnable);
+    add(config.depth_stencil.stencilTestEnable);
+    append_bytes(key, &config.depth_stencil.front, sizeof(VkStencilOpState));
+    append_bytes(key, &config.depth_stencil.back, sizeof(VkStencilOpState));
+    add_float(config.depth_stencil.minDepthBounds);
+    add_float(config.depth_stencil.maxDepthBounds);
+
+    add(config.rendering_info.viewMask);
+    add(config.rendering_info.colorAttachmentCount);
+    if (config.rendering_info.colorAttachmentCount > 0) add(config.color_attachment_format);
+    add(config.rendering_info.depthAttachmentFormat);
+    add(config.rendering_info.stencilAttachmentFormat);
+
+    add(config.vertex_binding_descriptions.size());
+    append_bytes(key, config.vertex_binding_descriptions.data(), config.vertex_binding_descriptions.size() * sizeof(VkVertexInputBindingDescription));
+    add(config.vertex_attribute_descriptions.size());
+    append_bytes(key, config.vertex_attribute_descriptions.data(), config.vertex_attribute_descriptions.size() * sizeof(VkVertexInputAttributeDescription));
+    return key;
+}
+
+static uint64_t hash_key(const std::vector<uint64_t>& key) {
+    return Hash::hash_bytes(key.data(), key.size() * sizeof(uint64_t));
+}
+
+void PipelineRegistry::initialize(Device* device) {
+    this->device = device;
+}
+
+void PipelineRegistry::cleanup() {
+    size_t live_pipelines = 0;
+    for (const auto& [hash, entry] : pipelines) {
+        if (!entry.pipeline.expired()) live_pipelines++;
+    }
+    if (live_pipelines > 0) {
+        Logger::logError(std::to_string(live_pipelines) + " pipelines are still held at registry cleanup, release them before the device goes away");
+    }
+    pipelines.clear();
+    layouts.clear();
+}
+
+std::shared_ptr<Pipeline> PipelineRegistry::build(PipelineBuilder& builder) {
+    return find_or_build(builder, false);
+}
+
+std::shared_ptr<Pipeline> PipelineRegistry::build_compute(PipelineBuilder& builder) {
+    return find_or_build(builder, true);
+}
+
+std::shared_ptr<VkPipelineLayout> PipelineRegistry::find_or_create_layout(const PipelineConfig& config) {
+    std::vector<uint64_t> key = layout_key(config);
+    const uint64_t layout_hash = hash_key(key);
+    auto [first, last] = layouts.equal_range(layout_hash);
+    for (auto cached = first; cached != last; cached++) {
+        if (cached->second.key != key) continue;
+        if (std::shared_ptr<VkPipelineLayout> layout = cached->second.layout.lock()) {
+            return layout;
+        }
+    }
+
+    // The deleter destroys the layout, so pipelines sharing it only need to drop their reference
+    Device* device = this->device;
+    std::shared_ptr<VkPipelineLayout> layout(
+        new VkPipelineLayout(PipelineLayout::create_pipeline_layout(device, PipelineLayout::pipeline_layout_create_info(config.descriptor_set_layouts, config.push_constant_ranges))),
+        [device](VkPipelineLayout* layout) {
+            vkDestroyPipelineLayout(device->logical_device, *layout, nullptr);
+            delete layout;
+        }
+    );
+
+    // Released layouts would otherwise pile up as dead entries, this also drops the one a matching key may have left
+    std::erase_if(layouts, [](const auto& entry) { return entry.second.layout.expired(); });
+    layouts.emplace(layout_hash, LayoutEntry{ .key = std::move(key), .layout = layout });
+    return layout;
+}
+
+std::shared_ptr<Pipeline> PipelineRegistry::find_or_build(PipelineBuilder& builder, bool compute) {
+    std::vector<uint64_t> key = config_key(builder.config, compute);
+    const uint64_t config_hash = hash_key(key);
+    auto [first, last] = pipelines.equal_range(config_hash);
+    for (auto cached = first; cached != last; cached++) {
+        if (cached->second.key != key) continue;
+        if (std::shared_ptr<Pipeline> pipeline = cached->second.pipeline.lock()) {
+            return pipeline;
+        }
+    }
+
+    std::shared_ptr<VkPipelineLayout> layout = find_or_create_layout(builder.config);
+    std::shared_ptr<Pipeline> pipeline(new Pipeline(compute ? builder.build_compute(*layout) : builder.build(*layout)), [](Pipeline* pipeline) {
+        pipeline->cleanup();
+        delete pipeline;
+    });
+    pipeline->shared_layout = std::move(layout);
+
+    // Keeping a failed pipeline would hand it out again after the cause is fixed, e.g. by a shader reload
+    if (pipeline->handle != VK_NULL_HANDLE) {
+        std::erase_if(pipelines, [](const auto& entry) { return entry.second.pipeline.expired(); });
+        pipelines.emplace(config_hash, PipelineEntry{ .key = std::move(key), .pipeline = pipeline });
+    }
+    return pipeline;
+}
@@ -8,6 +8,8 @@
 #include "vulkan/vulkan_core.h"
 #include <algorithm>
 #include <cstdint>
+#include <iterator>
+#include <string>
 #include <vector>
 
 VkRenderingInfoKHR Renderer::rendering_info(VkExtent2D extent, uint32_t color_attachment_count, VkRenderingAttachmentInfo* color_attachment_infos, VkRenderingAttachmentInfo* depth_attachment_info) {
@@ -31,16 +33,25 @@ static PoolSizeRatio pool_sizes[] {
     {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100},
 };
 
-void Renderer::initialize(RendererCreateInfo* renderer_info) {
+bool Renderer::initialize(RendererCreateInfo* renderer_info) {
 
     window.initialize(renderer_info->window_width, renderer_info->window_height, renderer_info->application_name);
     instance.initialize(renderer_info->application_name, "GraphicsEngine", renderer_info->validation_layers, renderer_info->device_extensions);
     debug_messenger.initialize(&instance);
-    device.initialize(&instance, &window, renderer_info->validation_layers, renderer_info->device_extensions);
+    if (!device.initialize(&instance, &window, renderer_info->validation_layers, renderer_info->device_extensions)) {
+        Logger::logError("Failed to initialize the renderer, no usable GPU!");
+        debug_messenger.cleanup();
+        instance.cleanup();
+        window.cleanup();
+        return false;
+    }
     device_memory_manager.initialize(&device, &instance);
     swapchain.initialize(this, &window);
     frames_in_flight = swapchain.n_swapchain_images;
-    pipeline_builder.initialize(&device);
+    cache_directory = renderer_info->cache_directory;
+    pipeline_cache.initialize(&device, cache_directory.empty() ? std::filesystem::path{} : cache_directory / "pipeline_cache.bin");
+    pipeline_builder.initialize(&device, pipeline_cache.handle);
+    pipeline_registry.initialize(&device);
 
     frame_sync.reserve(frames_in_flight);
     for (int i_frame = 0; i_frame < frames_in_flight; i_frame++) {
@@ -58,7 +69,7 @@ void Renderer::initialize(RendererCreateInfo* renderer_info) {
     depth_image = create_image(
         VkExtent3D{ window.framebuffer_extent.width, window.framebuffer_extent.height, 1 },
         VK_FORMAT_D32_SFLOAT,
-		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT // Sampled to build the depth pyramid
     );
 
     command_pool.initialize(&device, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
@@ -70,17 +81,72 @@ void Renderer::initialize(RendererCreateInfo* renderer_info) {
 
     // TODO: we can only have 10 descriptor sets with this pool. I realize now how hard descriptor abstraction is
     descriptor_builder.initialize(this, 10, pool_sizes);
-    shader_manager.initialize();
+    bindless_descriptors.initialize(this);
+
+    camera_data = GPUCameraData{
+        .view = glm::mat4{ 1.0f }, .projection = glm::mat4{ 1.0f }, .view_projection = glm::mat4{ 1.0f }, .position = glm::vec4{ 0.0f },
+        .previous_view = glm::mat4{ 1.0f }, .previous_projection = glm::mat4{ 1.0f },
+    };
+    camera_buffers.reserve(frames_in_flight); // The descriptor writes keep pointers to these
+    camera_descriptors.reserve(frames_in_flight);
+    for (int i_frame = 0; i_frame < frames_in_flight; i_frame++) {
+        camera_buffers.push_back(create_buffer(sizeof(GPUCameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU));
+        camera_descriptors.push_back(descriptor_builder
+            .add_buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, &camera_buffers.back())
+            .build());
+        descriptor_builder.clear();
+    }
+
+    uint32_t white = 0xFFFFFFFF;
+    default_texture = create_image_from_data(&white, sizeof(uint32_t), VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT);
+    default_texture_index = bindless_descriptors.add_image(&default_texture);
+
+    VkSamplerCreateInfo sampler_info{
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .maxLod = VK_LOD_CLAMP_NONE,
+    };
+    vkCreateSampler(device.logical_device, &sampler_info, nullptr, &default_sampler);
+    default_sampler_index = bindless_descriptors.add_sampler(default_sampler);
+
+    // Everything falls back on these two, so there's nothing sensible to do without them
+    if (default_texture_index == UINT32_MAX || default_sampler_index == UINT32_MAX) {
+        Logger::logError("Bindless descriptor table has no room for the default texture and sampler!");
+    }
+
+    shader_manager.initialize(cache_directory.empty() ? std::filesystem::path{} : cache_directory / "shaders", renderer_info->shader_hot_reload);
+    texture_streamer.initialize(this);
     asset_manager.initialize(this);
+    scene_graph.initialize();
     frame_number = 0;
     frame_index = 0;
     render_scale = 1.0f;
+    draw_extent = VkExtent2D{ window.framebuffer_extent.width, window.framebuffer_extent.height };
     Logger::log("Renderer Initialized!");
+    return true;
 }
 
 void Renderer::cleanup() {
     wait_for_idle();
 
+    shader_manager.cleanup();
+    scene_graph.cleanup();
+    asset_manager.cleanup();
+    texture_streamer.cleanup();
+    run_deferred_cleanups(true);
+    pipeline_registry.cleanup();
+    default_texture.cleanup();
+    vkDestroySampler(device.logical_device, default_sampler, nullptr);
+    bindless_descriptors.cleanup();
+    for (int i_frame = 0; i_frame < frames_in_flight; i_frame++) {
+        camera_descriptors[i_frame].cleanup();
+        camera_buffers[i_frame].cleanup();
+    }
     descriptor_builder.cleanup();
     command_pool.cleanup();
     immediate_command.cleanup();
@@ -90,6 +156,7 @@ void Renderer::cleanup() {
         frame_sync[i_frame].cleanup();
     }
     swapchain.cleanup();
+    pipeline_cache.cleanup();
     device_memory_manager.cleanup();
     device.cleanup();
     debug_messenger.cleanup();
@@ -98,6 +165,8 @@ void Renderer::cleanup() {
 }
 
 void Renderer::wait_for_idle() {
+    // vkDeviceWaitIdle needs every queue externally synced, loader threads may be submitting uploads meanwhile
+    std::lock_guard<std::mutex> queue_lock(device.queue_mutex);
     vkDeviceWaitIdle(device.logical_device);
 }
 
@@ -106,6 +175,50 @@ Renderer& Renderer::add_render_system(RenderSystem* render_system) {
 	return *this;
 }
 
+void Renderer::set_camera(const Camera& camera) {
+    camera_data.view = camera.view;
+    camera_data.projection = camera.projection;
+    camera_data.view_projection = camera.projection * camera.view;
+    camera_data.position = glm::vec4{ glm::vec3(glm::inverse(camera.view)[3]), 1.0f };
+}
+
+void Renderer::defer_cleanup(std::function<void()>&& cleanup_function) {
+    std::lock_guard<std::mutex> lock(deferred_cleanup_mutex);
+    deferred_cleanups.push_back(DeferredCleanup{
+        .frame_number = frame_number.load(),
+        .function = std::move(cleanup_function),
+    });
+}
+
+void Renderer::run_deferred_cleanups(bool everything) {
+    // Once this frame's fence has been waited on, every frame up to frame_number - frames_in_flight is done
+    std::vector<DeferredCleanup> ready;
+    {
+        std::lock_guard<std::mutex> lock(deferred_cleanup_mutex);
+        auto first_pending = std::stable_partition(deferred_cleanups.begin(), deferred_cleanups.end(), [&](const DeferredCleanup& cleanup) {
+            return everything || cleanup.frame_number + frames_in_flight <= frame_number;
+        });
+        std::move(deferred_cleanups.begin(), first_pending, std::back_inserter(ready));
+        deferred_cleanups.erase(deferred_cleanups.begin(), first_pending);
+    }
+
+    for (DeferredCleanup& cleanup : ready) {
+        cleanup.function();
+    }
+}
+
+void Renderer::replace_pipeline(std::shared_ptr<Pipeline>& pipeline, std::shared_ptr<Pipeline> rebuilt) {
+    if (rebuilt->handle == VK_NULL_HANDLE) {
+        Logger::logError("Failed to rebuild a pipeline, keeping the old one");
+        return;
+    }
+    if (rebuilt == pipeline) return;
+
+    // Submitted frames may still bind the old one, and other users of the same pipeline keep it alive regardless
+    defer_cleanup([old_pipeline = std::move(pipeline)]() {});
+    pipeline = std::move(rebuilt);
+}
+
 void Renderer::draw() {
 
     if (window.pause_rendering){
@@ -116,12 +229,36 @@ void Renderer::draw() {
 	vkWaitForFences(device.logical_device, 1, &frame_render_fence, true, 1000000000);
 	vkResetFences(device.logical_device, 1, &frame_render_fence);
 
+    run_deferred_cleanups();
+
+    // Nothing is being recorded yet, so pipelines can be swapped before any render system binds them this frame
+    std::vector<std::string> reloaded_entry_points;
+    if (shader_manager.take_reloaded_shaders(reloaded_entry_points)) {
+        for (auto* render_system : render_systems) {
+            render_system->reload_shaders(reloaded_entry_points);
+        }
+    }
+
+    scene_graph.update();
+
+    // The fence above means the GPU is done with this frame's previous camera data
+    camera_buffers[frame_index].write_data(&camera_data, sizeof(GPUCameraData));
+    camera_data.previous_view = camera_data.view;
+    camera_data.previous_projection = camera_data.projection;
+
 	swapchain.acquire_next_image(&frame_sync[frame_index]);
 
 	Command* cmd = &frame_command[frame_index];
 	cmd->reset();
 	cmd->begin();
 
+    // Before the render systems, so the textures it swaps in are what their object data points at this frame
+    texture_streamer.update(cmd);
+
+	for (auto* render_system : render_systems) {
+		render_system->prepare(cmd);
+	}
+
 	// Transition the draw image to a writable format
     Image::transition_image(cmd, &draw_image, VK_IMAGE_LAYOUT_GENERAL);
     Image::transition_image(cmd, &depth_image, VK_IMAGE_LAYOUT_GENERAL);
@@ -130,7 +267,7 @@ void Renderer::draw() {
 	VkRenderingAttachmentInfoKHR color_attachment_info = Image::color_attachment_info(draw_image.view, &clear_value, VK_IMAGE_LAYOUT_GENERAL);
 	VkRenderingAttachmentInfoKHR depth_attachment_info = Image::depth_attachment_info(depth_image.view, VK_IMAGE_LAYOUT_GENERAL);
 
-    VkExtent2D draw_extent{
+    draw_extent = VkExtent2D{
         .width  = static_cast<uint32_t>(std::min(draw_image.extent.width, swapchain.extent.width) * render_scale),
         .height = static_cast<uint32_t>(std::min(draw_image.extent.height, swapchain.extent.height) * render_scale),
     };
@@ -163,6 +300,10 @@ void Renderer::draw() {
 
 	vkCmdEndRendering(cmd->buffer);
 
+	for (auto* render_system : render_systems) {
+		render_system->finalize(cmd);
+	}
+
 	// Transition images for copying and then presenting
 	// Draw image is going to be copied to the swapchain image, so transition it to a transfer source layout
     Image::transition_image(cmd, &draw_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
@@ -247,6 +388,11 @@ Buffer Renderer::create_instanced_buffer(size_t instance_bytes, size_t instance_
 }
 
 AllocatedImage Renderer::create_image(VkExtent3D extent, VkFormat format, VkImageUsageFlags usage_flags, bool use_mipmap) {
+    uint32_t mip_level_count = use_mipmap ? static_cast<uint32_t>(std::floor(std::log2(std::max(extent.width, extent.height)))) + 1 : 1;
+    return create_image_with_mip_levels(extent, format, usage_flags, mip_level_count);
+}
+
+AllocatedImage Renderer::create_image_with_mip_levels(VkExtent3D extent, VkFormat format, VkImageUsageFlags usage_flags, uint32_t mip_level_count) {
 
     AllocatedImage new_image;
 
@@ -256,7 +402,7 @@ AllocatedImage Renderer::create_image(VkExtent3D extent, VkFormat format, VkImag
     new_image.extent                = extent;
     new_image.format                = format;
     new_image.layout                = VK_IMAGE_LAYOUT_UNDEFINED;
-    new_image.mip_level_count       = use_mipmap ? static_cast<uint32_t>(std::floor(std::log2(std::max(extent.width, extent.height)))) + 1 : 1;
+    new_image.mip_level_count       = mip_level_count;
 
 	VkImageCreateInfo image_info{
 		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -309,11 +455,27 @@ AllocatedImage Renderer::create_image(VkExtent3D extent, VkFormat format, VkImag
 
 AllocatedImage Renderer::create_image_from_data(void* data, size_t pixel_bytes, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage_flags, bool use_mipmap) {
 
-    AllocatedImage new_image = create_image(extent, format, usage_flags | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+    // Mips come from blits on the GPU, or the CPU fallback if the format can't be blitted. Without either there's no way to fill them
+    const bool can_blit = device.supports_format_features(format,
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+    if (use_mipmap && !can_blit && !Image::can_build_mip_chain(format)) {
+        Logger::log("Image format can't be mipmapped, creating it with a single level");
+        use_mipmap = false;
+    }
+
+    AllocatedImage new_image = create_image(extent, format, usage_flags | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, use_mipmap);
     Image::copy_data_to_image(&new_image, data, pixel_bytes);
 
     return new_image;
 }
 
+AllocatedImage Renderer::create_image_from_mip_levels(const void* data, size_t data_size, std::span<const size_t> level_offsets, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage_flags) {
+
+    AllocatedImage new_image = create_image_with_mip_levels(extent, format, usage_flags | VK_IMAGE_USAGE_TRANSFER_DST_BIT, static_cast<uint32_t>(level_offsets.size()));
+    Image::copy_mip_levels_to_image(&new_image, data, data_size, level_offsets);
+
+    return new_image;
+}
+
 
 
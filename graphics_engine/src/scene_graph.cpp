@@ -0,0 +1,82 @@
+#include "scene_graph.h"
+#include "logger.h"
+#include <algorithm>
+#include <string>
+
+void SceneGraph::initialize() {
+    any_dirty = false;
+}
+
+void SceneGraph::cleanup() {
+    parents.clear();
+    translations.clear();
+    rotations.clear();
+    scales.clear();
+    world_transforms.clear();
+    dirty.clear();
+    world_changed.clear();
+}
+
+uint32_t SceneGraph::add_node(uint32_t parent, glm::vec3 translation, glm::quat rotation, glm::vec3 scale) {
+    if (parent != NO_NODE && parent >= size()) {
+        Logger::logError("Scene node parent " + std::to_string(parent) + " doesn't exist, adding the node as a root");
+        parent = NO_NODE;
+    }
+
+    uint32_t node = size();
+    parents.push_back(parent);
+    translations.push_back(translation);
+    rotations.push_back(rotation);
+    scales.push_back(scale);
+    world_transforms.push_back(glm::mat4{ 1.0f });
+    dirty.push_back(1);
+    world_changed.push_back(0);
+    any_dirty = true;
+    return node;
+}
+
+void SceneGraph::mark_dirty(uint32_t node) {
+    dirty[node] = 1;
+    any_dirty = true;
+}
+
+void SceneGraph::set_translation(uint32_t node, glm::vec3 translation) {
+    translations[node] = translation;
+    mark_dirty(node);
+}
+
+void SceneGraph::set_rotation(uint32_t node, glm::quat rotation) {
+    rotations[node] = rotation;
+    mark_dirty(node);
+}
+
+void SceneGraph::set_scale(uint32_t node, glm::vec3 scale) {
+    scales[node] = scale;
+    mark_dirty(node);
+}
+
+void SceneGraph::update() {
+    if (!any_dirty) {
+        std::fill(world_changed.begin(), world_changed.end(), 0);
+        return;
+    }
+
+    // A node changes if it was touched itself or its parent changed earlier in this same pass
+    const uint32_t node_count = size();
+    for (uint32_t i_node = 0; i_node < node_count; i_node++) {
+        const uint32_t parent = parents[i_node];
+        const bool changed = dirty[i_node] || (parent != NO_NODE && world_changed[parent]);
+        world_changed[i_node] = changed;
+        if (!changed) continue;
+
+        glm::mat4 local = glm::mat4_cast(rotations[i_node]);
+        local[0] *= scales[i_node].x;
+        local[1] *= scales[i_node].y;
+        local[2] *= scales[i_node].z;
+        local[3] = glm::vec4(translations[i_node], 1.0f);
+
+        world_transforms[i_node] = parent == NO_NODE ? local : world_transforms[parent] * local;
+        dirty[i_node] = 0;
+    }
+    any_dirty = false;
+}
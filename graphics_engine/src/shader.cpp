@@ -4,14 +4,31 @@
 #include "slang/slang.h"
 #include "slang/slang-com-helper.h"
 #include "logger.h"
+#include "hash.h"
+#include "file_utils.h"
 #include "vulkan/vulkan_core.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <map>
+#include <optional>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 #ifdef SHADER_DIR
 // Global variable for the shaders folder
 static const std::string shader_directory{SHADER_DIR};
@@ -27,8 +44,25 @@ static void reportDiagnostics(const std::string& shader_name, slang::IBlob* diag
     }
 }
 
-void ShaderManager::initialize() {
+void ShaderManager::initialize(const std::filesystem::path& cache_directory, bool hot_reload) {
+    this->cache_directory = cache_directory;
+    watching = false;
     compile_shaders();
+
+    if (hot_reload) {
+#ifdef __linux__
+        watching = true;
+        watch_thread = std::thread(&ShaderManager::watch_shaders, this);
+#else
+        Logger::logError("Shader hot reload relies on inotify and is only available on Linux");
+#endif
+    }
+}
+
+void ShaderManager::cleanup() {
+    if (!watch_thread.joinable()) return;
+    watching = false;
+    watch_thread.join();
 }
 
 void ShaderManager::find_shaders() {
@@ -49,45 +83,52 @@ void ShaderManager::find_shaders() {
     }
 }
 
-void ShaderManager::compile_shaders() {
-
-    Slang::ComPtr<slang::IGlobalSession> global_session;
-
+// Everything create_session() sets that changes the output. compiler_key() hashes these same values, so cached modules
+// built with anything else get recompiled
+static constexpr SlangCompileTarget session_target = SLANG_SPIRV;
+static constexpr const char* session_profile = "spirv_1_6";
+static constexpr SlangMatrixLayoutMode session_matrix_layout = SLANG_MATRIX_LAYOUT_COLUMN_MAJOR;
+// For now, we just want spir-v to be directly output from the compiler
+static const std::array<slang::CompilerOptionEntry, 2> session_options = {{
+    {slang::CompilerOptionName::EmitSpirvDirectly, {slang::CompilerOptionValueKind::Int, 1, 0, nullptr, nullptr}},
+    {slang::CompilerOptionName::VulkanEmitReflection, {slang::CompilerOptionValueKind::Int, 1, 0, nullptr, nullptr}},
+}};
+
+Slang::ComPtr<slang::ISession> ShaderManager::create_session(Slang::ComPtr<slang::IGlobalSession>& global_session) {
     // A slang global session is simply a connection to the API (like a global context)
     SlangGlobalSessionDesc global_desc{};
     if (slang::createGlobalSession(&global_desc, global_session.writeRef()) != SLANG_OK) {
         Logger::logError("Failed to create a slang global session!");
+        return nullptr;
     }
 
     // A session is a more localized context that maintains caching for reuse
     slang::SessionDesc session_desc{
-        .defaultMatrixLayoutMode = SLANG_MATRIX_LAYOUT_COLUMN_MAJOR
+        .defaultMatrixLayoutMode = session_matrix_layout
     };
 
     // Define a target descriptor
     slang::TargetDesc target_desc{
-        .format  = SLANG_SPIRV,
-        .profile = global_session->findProfile("spirv_1_6"),
+        .format  = session_target,
+        .profile = global_session->findProfile(session_profile),
     };
     session_desc.targetCount = 1;
     session_desc.targets = &target_desc;
 
-    // Enable compiler options. For now, we just want spir-v to be directly output from the compiler
-    slang::CompilerOptionEntry options[2] = {
-        {slang::CompilerOptionName::EmitSpirvDirectly, {slang::CompilerOptionValueKind::Int, 1, 0, nullptr, nullptr}},
-        {slang::CompilerOptionName::VulkanEmitReflection, {slang::CompilerOptionValueKind::Int, 1, 0, nullptr, nullptr}},
-    };
-    session_desc.compilerOptionEntryCount = 2;
-    session_desc.compilerOptionEntries = options;
+    // Enable compiler options
+    std::array options = session_options; // The session desc wants them mutable
+    session_desc.compilerOptionEntryCount = static_cast<uint32_t>(options.size());
+    session_desc.compilerOptionEntries = options.data();
 
     Slang::ComPtr<slang::ISession> session;
 
     // Now create the session
     global_session->createSession(session_desc, session.writeRef());
+    return session;
+}
 
-    Logger::logError("Finding Shaders and Creating Modules...");
-
-    // Search the shaders directory for all the .slang files and convert them into modules
+void ShaderManager::compile_shaders() {
+    // Search the shaders directory for all the .slang files
     find_shaders();
 
     if (found_shaders.size() < 1) {
@@ -95,87 +136,427 @@ void ShaderManager::compile_shaders() {
         return;
     }
 
-    std::vector<Slang::ComPtr<slang::IModule>> slang_modules;
-    for (int i_shader = 0; i_shader < found_shaders.size(); i_shader++) {
-        Slang::ComPtr<slang::IBlob> diagnostic;
-        std::string filepath = shader_directory + found_shaders[i_shader];
-        Slang::ComPtr<slang::IModule> module(session->loadModule(filepath.c_str(), diagnostic.writeRef()));
+    std::vector<std::string> stale_shaders;
+    for (const std::string& shader_name : found_shaders) {
+        if (!load_cached_module(shader_name)) stale_shaders.push_back(shader_name);
+    }
+    if (stale_shaders.empty()) {
+        Logger::log("All shaders loaded from the cache");
+        return;
+    }
 
-        reportDiagnostics(found_shaders[i_shader], diagnostic);
-        Logger::logError("filepath" + filepath);
+    Logger::logError("Finding Shaders and Creating Modules...");
+    compile_modules(stale_shaders, compiled_spirv);
+}
 
-        slang_modules.push_back(module);
+uint32_t ShaderManager::compile_modules(const std::vector<std::string>& shader_names, std::map<std::string, std::vector<uint32_t>>& output) {
+    // Modules don't depend on each other's output, so they compile in parallel. Slang sessions (global ones included)
+    // must stay on one thread, so each worker starts its own. That start up isn't free, hence no more workers than modules
+    const uint32_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    const uint32_t worker_count = std::min(static_cast<uint32_t>(shader_names.size()), hardware_threads);
+    std::atomic<size_t> next_shader = 0;
+    std::atomic<uint32_t> compiled_shaders = 0;
+
+    auto compile_worker = [&]() {
+        Slang::ComPtr<slang::IGlobalSession> global_session;
+        Slang::ComPtr<slang::ISession> session = create_session(global_session);
+        if (!session) return;
+
+        // Workers take the next module as they finish, so one slow module doesn't hold up a fixed share of the rest
+        for (size_t i_shader = next_shader++; i_shader < shader_names.size(); i_shader = next_shader++) {
+            if (compile_module(session, shader_names[i_shader], output)) compiled_shaders++;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i_worker = 1; i_worker < worker_count; i_worker++) {
+        workers.emplace_back(compile_worker);
+    }
+    compile_worker(); // The calling thread is one of the workers
+    for (std::thread& worker : workers) {
+        worker.join();
     }
 
+    Logger::log("Compiled " + std::to_string(compiled_shaders) + "/" + std::to_string(shader_names.size()) +
+                " shader modules on " + std::to_string(worker_count) + " threads");
+    return compiled_shaders;
+}
+
+static std::optional<uint64_t> hash_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return std::nullopt;
+    std::vector<char> contents(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(contents.data(), static_cast<std::streamsize>(contents.size()));
+    if (!file) return std::nullopt;
+    return Hash::hash_bytes(contents.data(), contents.size());
+}
+
+bool ShaderManager::compile_module(slang::ISession* session, const std::string& shader_name, std::map<std::string, std::vector<uint32_t>>& output) {
+    Slang::ComPtr<slang::IBlob> diagnostic;
+    std::string filepath = shader_directory + shader_name;
+    Slang::ComPtr<slang::IModule> module(session->loadModule(filepath.c_str(), diagnostic.writeRef()));
+
+    reportDiagnostics(shader_name, diagnostic);
+    Logger::logError("filepath" + filepath);
+    if (!module) return false;
+
     Logger::logError("Finding Entry Points...");
 
     // Get the entry points to each shader program. For now each will have a vertex and fragment, but
     // this should be generalized in the future
-    Slang::ComPtr<slang::IBlob> diagnostic;
-    for (int i_shader = 0; i_shader < slang_modules.size(); i_shader++) {
-        const auto& module = slang_modules[i_shader];
-        int entry_point_count = module->getDefinedEntryPointCount();
-        std::vector<Slang::ComPtr<slang::IEntryPoint>> module_entry_points;
-        for (int i_entry_point = 0; i_entry_point < entry_point_count; i_entry_point++) {
-            Slang::ComPtr<slang::IEntryPoint> entry_point;
-            module->getDefinedEntryPoint(i_entry_point, entry_point.writeRef());
-            if (!entry_point) {
-                Logger::logError("Error getting entry points from shader!");
-            }
-            module_entry_points.push_back(entry_point);
+    int entry_point_count = module->getDefinedEntryPointCount();
+    std::vector<Slang::ComPtr<slang::IEntryPoint>> module_entry_points;
+    for (int i_entry_point = 0; i_entry_point < entry_point_count; i_entry_point++) {
+        Slang::ComPtr<slang::IEntryPoint> entry_point;
+        module->getDefinedEntryPoint(i_entry_point, entry_point.writeRef());
+        if (!entry_point) {
+            Logger::logError("Error getting entry points from shader!");
+            return false;
         }
+        module_entry_points.push_back(entry_point);
+    }
 
-        Logger::logError("Composing Programs...");
+    Logger::logError("Composing Programs...");
 
-        Slang::ComPtr<slang::IComponentType> composed_programs;
-        std::vector<slang::IComponentType*> program_components;
-        program_components.push_back(module); // Push back the module component to the composedProgram
-        // Since there may be multiple entry points per shader, the entry points multimap needs to return a range
-        for (const auto& ep : module_entry_points) {
-            program_components.push_back(ep);
-        }
+    Slang::ComPtr<slang::IComponentType> composed_programs;
+    std::vector<slang::IComponentType*> program_components;
+    program_components.push_back(module); // Push back the module component to the composedProgram
+    // Since there may be multiple entry points per shader, the entry points multimap needs to return a range
+    for (const auto& ep : module_entry_points) {
+        program_components.push_back(ep);
+    }
+
+    SlangResult result = session->createCompositeComponentType(program_components.data(), program_components.size(), composed_programs.writeRef(), diagnostic.writeRef());
+    reportDiagnostics(shader_name, diagnostic);
+    if (SLANG_FAILED(result) || !composed_programs) {
+        Logger::logError("Failed to compose programs for shader: " + shader_name);
+        return false;
+    }
 
-        SlangResult result = session->createCompositeComponentType(program_components.data(), program_components.size(), composed_programs.writeRef(), diagnostic.writeRef());
-        reportDiagnostics(found_shaders[i_shader], diagnostic);
+    Logger::logError("Linking programs...");
 
-        Logger::logError("Linking programs...");
+    // Lastly, make sure there are no missing dependencies by linking the composed programs
+    Slang::ComPtr<slang::IComponentType> linked_program;
+    result = composed_programs->link(linked_program.writeRef(), diagnostic.writeRef());
 
-        // Lastly, make sure there are no missing dependencies by linking the composed programs
-        Slang::ComPtr<slang::IComponentType> linked_program;
-        result = composed_programs->link(linked_program.writeRef(), diagnostic.writeRef());
+    reportDiagnostics(shader_name, diagnostic);
+    if (SLANG_FAILED(result) || !linked_program) {
+        Logger::logError("Failed to link shader: " + shader_name);
+        return false;
+    }
 
-        reportDiagnostics(found_shaders[i_shader], diagnostic);
+    // Finally, we can get the compiled target code for each entry points
+    slang::ProgramLayout* layout = linked_program->getLayout();
+    if (!layout) {
+        Logger::logError("No program layout for shader");
+        return false;
+    }
+
+    // Compile each entry point. They share the linked program, so they stay on this thread
+    bool compiled = true;
+    std::map<std::string, std::vector<uint32_t>> module_spirv;
+    for (int i_entry_point = 0; i_entry_point < entry_point_count; i_entry_point++) {
+        Slang::ComPtr<slang::IBlob> diagnostic;
 
-        // Finally, we can get the compiled target code for each entry points
-        slang::ProgramLayout* layout = linked_program->getLayout();
-        if (!layout) {
-            Logger::logError("No program layout for shader");
+        // Compiled code gets stored into an IBlob
+        Slang::ComPtr<slang::IBlob> spirv_code;
+        linked_program->getEntryPointCode(i_entry_point, 0, spirv_code.writeRef(), diagnostic.writeRef());
+        reportDiagnostics(shader_name, diagnostic);
+
+        slang::EntryPointReflection* entry_point_reflect = layout->getEntryPointByIndex(i_entry_point);
+        if (!entry_point_reflect || !spirv_code) {
+            Logger::logError("No entry point reflection or code for index: " + std::to_string(i_entry_point));
+            compiled = false;
+            continue;
         }
+        std::string entry_point_name = std::string(entry_point_reflect->getName());
+        Logger::logError("entry point: " + entry_point_name);
 
-        // Compile each entry point
-        for (int i_entry_point = 0; i_entry_point < entry_point_count; i_entry_point++) {
-            Slang::ComPtr<slang::IBlob> diagnostic;
+        const uint32_t* words = static_cast<const uint32_t*>(spirv_code->getBufferPointer());
+        module_spirv[entry_point_name] = std::vector<uint32_t>(words, words + spirv_code->getBufferSize() / sizeof(uint32_t));
+    }
 
-            // Compiled code gets stored into an IBlob
-            Slang::ComPtr<slang::IBlob> spirv_code;
-            linked_program->getEntryPointCode(i_entry_point, 0, spirv_code.writeRef(), diagnostic.writeRef());
+    // A module that failed anywhere isn't cached, so the next run tries again and shows the errors
+    if (!compiled) return false;
 
-            slang::EntryPointReflection* entry_point_reflect = layout->getEntryPointByIndex(i_entry_point);
-            if (!entry_point_reflect) {
-                Logger::logError("No entry point reflection for index: " + std::to_string(i_entry_point));
-            }
-            std::string entry_point_name = std::string(entry_point_reflect->getName());
-            Logger::logError("entry point: " + entry_point_name);
+    // Slang knows every file that went into the module, including the module's own
+    std::vector<std::string> dependency_paths{ std::filesystem::absolute(module->getFilePath()).string() };
+    for (SlangInt32 i_dependency = 0; i_dependency < module->getDependencyFileCount(); i_dependency++) {
+        std::string dependency = std::filesystem::absolute(module->getDependencyFilePath(i_dependency)).string();
+        if (std::find(dependency_paths.begin(), dependency_paths.end(), dependency) == dependency_paths.end()) dependency_paths.push_back(dependency);
+    }
+    std::vector<ShaderDependency> dependencies;
+    for (const std::string& path : dependency_paths) {
+        // A file that's gone can't be compared against later, the module just counts as modified until it compiles again
+        dependencies.push_back(ShaderDependency{ .path = path, .content_hash = hash_file(path).value_or(0) });
+    }
+    save_cached_module(shader_name, dependencies, module_spirv);
+
+    std::lock_guard<std::mutex> lock(compile_mutex);
+    module_dependencies[shader_name] = std::move(dependencies);
+    for (auto& [name, spirv] : module_spirv) {
+        output[name] = std::move(spirv);
+    }
+    return true;
+}
+
+// SHADER CACHE ------------------------------------------------------------------------
+
+// One file per module: the header, then each dependency as (path length, path, content hash), then each entry point as
+// (name length, name, word count, SPIR-V words). The header's payload hash covers everything after it
+struct ShaderCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t compiler_key;     // Slang version and compiler options
+    uint64_t payload_size;
+    uint64_t payload_hash;
+    uint32_t dependency_count;
+    uint32_t entry_point_count;
+};
+
+static constexpr uint32_t shader_cache_magic = 0x43444853; // "SHDC"
+static constexpr uint32_t shader_cache_version = 1;
+
+static uint64_t compiler_key() {
+    // spGetBuildTagString() works without a global session, so checking the cache doesn't need Slang started
+    uint64_t key = Hash::hash_string(spGetBuildTagString());
+    key = Hash::combine(key, static_cast<uint64_t>(session_target));
+    key = Hash::combine(key, Hash::hash_string(session_profile));
+    key = Hash::combine(key, static_cast<uint64_t>(session_matrix_layout));
+    for (const slang::CompilerOptionEntry& option : session_options) {
+        key = Hash::combine(key, static_cast<uint64_t>(option.name));
+        key = Hash::combine(key, static_cast<uint64_t>(option.value.kind));
+        key = Hash::combine(key, static_cast<uint64_t>(static_cast<uint32_t>(option.value.intValue0)));
+        key = Hash::combine(key, static_cast<uint64_t>(static_cast<uint32_t>(option.value.intValue1)));
+        key = Hash::combine(key, Hash::hash_string(option.value.stringValue0 ? option.value.stringValue0 : ""));
+        key = Hash::combine(key, Hash::hash_string(option.value.stringValue1 ? option.value.stringValue1 : ""));
+    }
+    return key;
+}
+
+// Bounds checked reads out of a loaded cache file
+struct ShaderCacheReader {
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+
+    template <typename T>
+    bool read(T& value) {
+        if (size - offset < sizeof(T)) return false;
+        std::memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    }
 
-            compiled_spirv.insert({entry_point_name, spirv_code});
+    bool read_string(std::string& value) {
+        uint32_t length;
+        if (!read(length) || size - offset < length) return false;
+        value.assign(reinterpret_cast<const char*>(data + offset), length);
+        offset += length;
+        return true;
+    }
+};
+
+static std::filesystem::path cache_file_path(const std::filesystem::path& cache_directory, const std::string& shader_name) {
+    return cache_directory / (shader_name + ".spvcache");
+}
+
+bool ShaderManager::load_cached_module(const std::string& shader_name) {
+    if (cache_directory.empty()) return false;
+
+    std::ifstream file(cache_file_path(cache_directory, shader_name), std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    std::vector<uint8_t> contents(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(contents.data()), static_cast<std::streamsize>(contents.size()));
+
+    ShaderCacheHeader header;
+    if (!file || contents.size() < sizeof(header)) return false;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    if (header.magic != shader_cache_magic || header.version != shader_cache_version || header.compiler_key != compiler_key()) return false;
+    if (header.payload_size != contents.size() - sizeof(header)) return false;
+
+    const uint8_t* payload = contents.data() + sizeof(header);
+    if (Hash::hash_bytes(payload, header.payload_size) != header.payload_hash) return false;
+    ShaderCacheReader reader{ .data = payload, .size = header.payload_size };
+
+    // Any file that went into the module having changed since makes the whole module stale
+    std::vector<ShaderDependency> dependencies(header.dependency_count);
+    for (ShaderDependency& dependency : dependencies) {
+        if (!reader.read_string(dependency.path) || !reader.read(dependency.content_hash)) return false;
+        if (hash_file(dependency.path) != dependency.content_hash) return false;
+    }
+
+    // Only publish once the whole file checked out, a half-loaded module would shadow the recompiled one
+    std::vector<std::pair<std::string, std::vector<uint32_t>>> entry_points(header.entry_point_count);
+    for (auto& [name, spirv] : entry_points) {
+        uint32_t word_count;
+        if (!reader.read_string(name) || !reader.read(word_count)) return false;
+        if ((reader.size - reader.offset) / sizeof(uint32_t) < word_count) return false;
+        spirv.resize(word_count);
+        std::memcpy(spirv.data(), reader.data + reader.offset, word_count * sizeof(uint32_t));
+        reader.offset += word_count * sizeof(uint32_t);
+    }
+    for (auto& [name, spirv] : entry_points) {
+        compiled_spirv[name] = std::move(spirv);
+    }
+    module_dependencies[shader_name] = std::move(dependencies);
+
+    Logger::log("Shader loaded from cache: " + shader_name);
+    return true;
+}
+
+template <typename T>
+static void append(std::vector<uint8_t>& bytes, const T& value) {
+    const uint8_t* value_bytes = reinterpret_cast<const uint8_t*>(&value);
+    bytes.insert(bytes.end(), value_bytes, value_bytes + sizeof(T));
+}
+
+static void append_string(std::vector<uint8_t>& bytes, const std::string& value) {
+    append(bytes, static_cast<uint32_t>(value.size()));
+    bytes.insert(bytes.end(), value.begin(), value.end());
+}
+
+void ShaderManager::save_cached_module(const std::string& shader_name, const std::vector<ShaderDependency>& dependencies, const std::map<std::string, std::vector<uint32_t>>& entry_points) {
+    if (cache_directory.empty()) return;
+
+    std::vector<uint8_t> payload;
+    for (const ShaderDependency& dependency : dependencies) {
+        append_string(payload, dependency.path);
+        append(payload, dependency.content_hash);
+    }
+    for (const auto& [entry_point, spirv] : entry_points) {
+        append_string(payload, entry_point);
+        append(payload, static_cast<uint32_t>(spirv.size()));
+        const uint8_t* spirv_bytes = reinterpret_cast<const uint8_t*>(spirv.data());
+        payload.insert(payload.end(), spirv_bytes, spirv_bytes + spirv.size() * sizeof(uint32_t));
+    }
+
+    ShaderCacheHeader header{
+        .magic = shader_cache_magic,
+        .version = shader_cache_version,
+        .compiler_key = compiler_key(),
+        .payload_size = payload.size(),
+        .payload_hash = Hash::hash_bytes(payload.data(), payload.size()),
+        .dependency_count = static_cast<uint32_t>(dependencies.size()),
+        .entry_point_count = static_cast<uint32_t>(entry_points.size()),
+    };
+
+    FileUtils::write_file_atomically(
+        cache_file_path(cache_directory, shader_name),
+        std::span(reinterpret_cast<const uint8_t*>(&header), sizeof(header)),
+        payload
+    );
+}
+
+// HOT RELOAD --------------------------------------------------------------------------
+
+bool ShaderManager::module_modified(const std::string& shader_name) const {
+    auto dependencies = module_dependencies.find(shader_name);
+    if (dependencies == module_dependencies.end()) return true;
+
+    for (const ShaderDependency& dependency : dependencies->second) {
+        if (hash_file(dependency.path) != dependency.content_hash) return true;
+    }
+    return false;
+}
+
+void ShaderManager::reload_modified_shaders() {
+    // Picks up new modules too, they have never compiled so they count as modified
+    find_shaders();
+
+    std::vector<std::string> modified_shaders;
+    for (const std::string& shader_name : found_shaders) {
+        if (module_modified(shader_name)) modified_shaders.push_back(shader_name);
+    }
+    if (modified_shaders.empty()) return;
+
+    // A fresh session every time, sessions keep the modules they loaded and would hand back the old code.
+    // Modules that fail to compile leave nothing behind, so whatever was running keeps running
+    std::map<std::string, std::vector<uint32_t>> reloaded;
+    compile_modules(modified_shaders, reloaded);
+
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    for (auto& [name, spirv] : reloaded) {
+        reloaded_spirv[name] = std::move(spirv);
+    }
+}
+
+bool ShaderManager::take_reloaded_shaders(std::vector<std::string>& entry_points) {
+    entry_points.clear();
+
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    for (auto& [name, spirv] : reloaded_spirv) {
+        // Edits to comments or to code an entry point doesn't reach compile to the same thing, nothing to rebuild then
+        std::vector<uint32_t>& current = compiled_spirv[name];
+        if (current == spirv) continue;
+        current = std::move(spirv);
+        entry_points.push_back(name);
+    }
+    reloaded_spirv.clear();
+
+    if (!entry_points.empty()) Logger::log("Reloaded " + std::to_string(entry_points.size()) + " shader entry points");
+    return !entry_points.empty();
+}
 
-//            std::ofstream file(entry_point_name+"debug.spv", std::ios::binary);
-//            file.write(reinterpret_cast<const char*>(spirv_code->getBufferPointer()),
-//                    spirv_code->getBufferSize());
-//            file.close();
+#ifdef __linux__
+void ShaderManager::watch_shaders() {
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        Logger::logError("Failed to watch the shader directory, hot reload is off");
+        return;
+    }
+
+    // inotify doesn't recurse, every directory gets its own watch. Events only carry the file name, so the directory
+    // of each watch is kept to find new subdirectories by path
+    const uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR;
+    std::unordered_map<int, std::filesystem::path> watched_directories;
+    auto add_watch = [&](const std::filesystem::path& directory) {
+        int watch = inotify_add_watch(inotify_fd, directory.c_str(), watch_mask);
+        if (watch >= 0) watched_directories[watch] = directory;
+    };
+    add_watch(shader_directory);
+    std::error_code error;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(shader_directory, error)) {
+        if (entry.is_directory()) add_watch(entry.path());
+    }
+
+    // Editors save in bursts (write a temporary, rename it over, touch it), so compiling waits for the directory to settle
+    constexpr auto settle_time = std::chrono::milliseconds(100);
+    bool changes_pending = false;
+    std::chrono::steady_clock::time_point last_change;
+
+    alignas(inotify_event) char events[4096];
+    while (watching) {
+        // Wakes up regularly even without events, so cleanup() never waits long on this thread
+        pollfd poll_fd{ .fd = inotify_fd, .events = POLLIN };
+        if (poll(&poll_fd, 1, 50) > 0) {
+            ssize_t length;
+            while ((length = read(inotify_fd, events, sizeof(events))) > 0) {
+                for (const char* event_data = events; event_data < events + length;) {
+                    const inotify_event* event = reinterpret_cast<const inotify_event*>(event_data);
+                    event_data += sizeof(inotify_event) + event->len;
+
+                    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len > 0) {
+                        add_watch(watched_directories[event->wd] / event->name);
+                    }
+                    changes_pending = true;
+                    last_change = std::chrono::steady_clock::now();
+                }
+            }
+        }
+
+        // Anything may have changed, module_modified() sorts out which modules it actually touched
+        if (changes_pending && std::chrono::steady_clock::now() - last_change >= settle_time) {
+            changes_pending = false;
+            reload_modified_shaders();
         }
     }
+
+    close(inotify_fd);
 }
+#endif // __linux__
 
 // SHADER ------------------------------------------------------------------------------
 
@@ -189,6 +570,15 @@ static bool is_filename(std::string potential_file) {
     return false;
 }
 
+static ShaderCodeId shader_code_id(const uint32_t* code, size_t code_size) {
+    const uint64_t check_seed = 0x9e3779b97f4a7c15ULL;
+    return ShaderCodeId{
+        .hash = Hash::hash_bytes(code, code_size),
+        .check_hash = Hash::hash_bytes(code, code_size, check_seed),
+        .size = code_size,
+    };
+}
+
 void Shader::initialize(Device* device, ShaderManager* shader_manager, VkShaderStageFlagBits stage_flag, const std::string& shader) {
 
     this->device = device;
@@ -230,6 +620,7 @@ void Shader::build_shader_from_file(const std::string& filepath) {
 	if (vkCreateShaderModule(device->logical_device, &create_info, nullptr, &module) != VK_SUCCESS) {
         Logger::logError("Error: vkCreateShaderModule() failed while creating " + std::string(filepath));
 	}
+    code_id = shader_code_id(buffer.data(), buffer.size() * sizeof(uint32_t));
     Logger::log("Shader successfully loaded: " + filepath);
 }
 
@@ -245,6 +636,7 @@ void Shader::build_shader_from_code(const std::string& shader_name) {
 	if (vkCreateShaderModule(device->logical_device, &create_info, nullptr, &module) != VK_SUCCESS) {
         Logger::logError("Error: vkCreateShaderModule() failed");
 	}
+    code_id = shader_code_id(create_info.pCode, create_info.codeSize);
 
     Logger::log("Shader successfully loaded: " + shader_name);
 }
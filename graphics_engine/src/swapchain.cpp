@@ -98,7 +98,7 @@ void Swapchain::cleanup() {
 }
 
 void Swapchain::recreate() {
-    vkDeviceWaitIdle(renderer->device.logical_device);
+    renderer->wait_for_idle();
 	cleanup(); // Destroy old swapchain
 	create_swapchain(); // Recreate the swapchain
     window->resized = false;
@@ -129,7 +129,11 @@ void Swapchain::present_to_screen(VkQueue queue, Semaphore& render_semaphore) {
             .pSwapchains = &handle,
             .pImageIndices = &image_index
     };
-    VkResult e = vkQueuePresentKHR(queue, &present_info);
+    VkResult e;
+    {
+        std::lock_guard<std::mutex> queue_lock(renderer->device.queue_mutex);
+        e = vkQueuePresentKHR(queue, &present_info);
+    }
     if (e == VK_ERROR_OUT_OF_DATE_KHR) { // This is a point of entry for the information that the window has been resized.
         window->resized = true;
     } else if (e != VK_SUCCESS) {
@@ -0,0 +1,369 @@
+#include "texture_streamer.h"
+#include "asset_loading.h"
+#include "renderer.h"
+#include "logger.h"
+#include <algorithm>
+#include <cmath>
+
+void TextureStreamer::initialize(Renderer* renderer, uint64_t budget_bytes) {
+    this->renderer = renderer;
+    this->budget_bytes = budget_bytes;
+    resident_bytes = 0;
+    initial_max_size = 128;
+    max_promotions_per_frame = 4;
+    request_timeout_frames = 8;
+    staging_bytes_per_frame = 16 * 1024 * 1024;
+    staging_buffers.resize(renderer->frames_in_flight, StagingBuffer{ .capacity = 0, .used = 0 });
+}
+
+void TextureStreamer::cleanup() {
+    // The current images belong to their TextureAssets, pending ones were never handed out. The device is idle by now
+    std::lock_guard<std::mutex> lock(textures_mutex);
+    for (auto& [key, streamed] : textures) {
+        if (streamed.pending) streamed.pending->image.cleanup();
+    }
+    textures.clear();
+    resident_bytes = 0;
+
+    for (StagingBuffer& staging : staging_buffers) {
+        if (staging.capacity > 0) staging.buffer.cleanup();
+    }
+    staging_buffers.clear();
+}
+
+uint64_t TextureStreamer::current_budget() {
+    if (budget_bytes > 0) return budget_bytes;
+
+    // Without the budget extension the driver's numbers are only VMA's guesses, so stick to a fixed share of VRAM
+    if (!renderer->device.extension_enabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+        return renderer->device_memory_manager.device_local_heap_bytes() / 2;
+    }
+
+    // What's left on the device plus what we already hold, minus some headroom for buffers and render targets
+    const uint64_t available = renderer->device_memory_manager.available_device_local_bytes() + resident_bytes;
+    return available / 10 * 8;
+}
+
+size_t TextureStreamer::resident_size(const StreamedTexture& streamed, uint32_t base_level) {
+    return streamed.data.size() - streamed.level_offsets[base_level];
+}
+
+// Every staged level starts 16 byte aligned, which satisfies the copy alignment of every block size
+static size_t staging_align(size_t offset) {
+    return (offset + 15) & ~size_t(15);
+}
+
+size_t TextureStreamer::staged_end(const StreamedTexture& streamed, uint32_t first_level, uint32_t end_level, size_t offset) {
+    for (uint32_t i_level = first_level; i_level < end_level; i_level++) {
+        const size_t next_offset = i_level + 1 < streamed.level_offsets.size() ? streamed.level_offsets[i_level + 1] : streamed.data.size();
+        offset = staging_align(offset) + next_offset - streamed.level_offsets[i_level];
+    }
+    return offset;
+}
+
+void TextureStreamer::ensure_staging_capacity(StagingBuffer& staging, size_t bytes) {
+    if (staging.capacity >= bytes) return;
+    if (staging.capacity > 0) {
+        renderer->defer_cleanup([buffer = staging.buffer]() mutable { buffer.cleanup(); });
+    }
+    staging.capacity = std::max(bytes, staging_bytes_per_frame);
+    staging.buffer = renderer->create_buffer(staging.capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+}
+
+AllocatedImage TextureStreamer::create_level_image(const StreamedTexture& streamed, uint32_t base_level) {
+    // The image only contains levels [base_level, end), so rebase their offsets onto the first one
+    const size_t base_offset = streamed.level_offsets[base_level];
+    std::vector<size_t> level_offsets(streamed.level_offsets.begin() + base_level, streamed.level_offsets.end());
+    for (size_t& offset : level_offsets) offset -= base_offset;
+
+    return renderer->create_image_from_mip_levels(
+        streamed.data.data() + base_offset,
+        streamed.data.size() - base_offset,
+        level_offsets,
+        Image::mip_extent(streamed.extent, base_level),
+        streamed.format,
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT // Kept levels are copied out of it when the resident levels change
+    );
+}
+
+std::shared_ptr<TextureAsset> TextureStreamer::add_texture(ImageData&& image_data) {
+    StreamedTexture streamed{
+        .format = image_data.format,
+        .extent = VkExtent3D{ image_data.width, image_data.height, 1 },
+    };
+
+    if (image_data.level_offsets.empty()) {
+        // Decoded images come as a single level. Build the rest now so any level can be uploaded on its own later
+        const uint32_t level_count = static_cast<uint32_t>(std::floor(std::log2(std::max(image_data.width, image_data.height)))) + 1;
+        streamed.data = Image::build_mip_chain(image_data.pixels.data(), streamed.extent, image_data.format, level_count, streamed.level_offsets);
+        image_data.pixels = {};
+    } else {
+        streamed.data = std::move(image_data.pixels);
+        streamed.level_offsets = std::move(image_data.level_offsets);
+    }
+
+    // Start from the largest level that fits in initial_max_size, or the smallest level there is
+    const uint32_t last_level = static_cast<uint32_t>(streamed.level_offsets.size()) - 1;
+    uint32_t initial_level = 0;
+    while (initial_level < last_level) {
+        VkExtent3D level_extent = Image::mip_extent(streamed.extent, initial_level);
+        if (std::max(level_extent.width, level_extent.height) <= initial_max_size) break;
+        initial_level++;
+    }
+    streamed.initial_level = initial_level;
+    streamed.resident_level = initial_level;
+    streamed.wanted_level = initial_level;
+    streamed.last_requested_frame = 0;
+
+    Renderer* renderer = this->renderer;
+    std::shared_ptr<TextureAsset> texture(new TextureAsset(), [renderer](TextureAsset* texture) {
+        // Frames in flight may still be sampling it through its bindless slot
+        renderer->defer_cleanup([renderer, image = texture->image, slot = texture->bindless_index]() mutable {
+            renderer->bindless_descriptors.remove_image(slot);
+            image.cleanup();
+        });
+        delete texture;
+    });
+    texture->name = image_data.name;
+    texture->image = create_level_image(streamed, initial_level);
+    texture->bindless_index = renderer->bindless_descriptors.add_image(&texture->image);
+    if (texture->bindless_index == UINT32_MAX) {
+        Logger::logError("Bindless image table is full, " + texture->name + " is drawn with the default texture");
+    }
+    streamed.texture = texture;
+
+    std::lock_guard<std::mutex> lock(textures_mutex);
+    auto [entry, inserted] = textures.try_emplace(texture.get());
+    if (!inserted) {
+        // A freed texture's address got reused before update() noticed it was gone
+        StreamedTexture& stale = entry->second;
+        resident_bytes -= resident_size(stale, stale.pending ? stale.pending->base_level : stale.resident_level);
+        if (stale.pending) {
+            renderer->defer_cleanup([image = stale.pending->image]() mutable { image.cleanup(); });
+        }
+    }
+    resident_bytes += resident_size(streamed, initial_level);
+    entry->second = std::move(streamed);
+    return texture;
+}
+
+void TextureStreamer::request(const TextureAsset* texture, float screen_size) {
+    std::lock_guard<std::mutex> lock(textures_mutex);
+    auto entry = textures.find(texture);
+    if (entry == textures.end()) return;
+    StreamedTexture& streamed = entry->second;
+
+    // One level per halving of the texture's size relative to its footprint on screen
+    const float texture_size = static_cast<float>(std::max(streamed.extent.width, streamed.extent.height));
+    const float texels_per_pixel = texture_size / std::max(screen_size, 1.0f);
+    uint32_t level = texels_per_pixel <= 1.0f ? 0 : static_cast<uint32_t>(std::floor(std::log2(texels_per_pixel)));
+    level = std::min(level, static_cast<uint32_t>(streamed.level_offsets.size()) - 1);
+
+    // Textures shared by several objects want whatever the closest one needs
+    if (streamed.last_requested_frame != renderer->frame_number) {
+        streamed.wanted_level = level;
+        streamed.last_requested_frame = renderer->frame_number;
+    } else {
+        streamed.wanted_level = std::min(streamed.wanted_level, level);
+    }
+}
+
+void TextureStreamer::record_level_change(Command* cmd, StreamedTexture& streamed, TextureAsset* texture, uint32_t base_level) {
+    const uint32_t level_count = static_cast<uint32_t>(streamed.level_offsets.size());
+    AllocatedImage new_image = renderer->create_image_with_mip_levels(
+        Image::mip_extent(streamed.extent, base_level),
+        streamed.format,
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        level_count - base_level
+    );
+    Image::transition_image(cmd, &new_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+    // Levels the GPU doesn't have yet come from the CPU copy, through this frame's staging buffer
+    StagingBuffer& staging = staging_buffers[renderer->frame_index];
+    std::vector<VkBufferImageCopy> uploads;
+    for (uint32_t i_level = base_level; i_level < streamed.resident_level; i_level++) {
+        const size_t level_start = staging_align(staging.used);
+        staging.used = staged_end(streamed, i_level, i_level + 1, staging.used);
+        staging.buffer.write_data(streamed.data.data() + streamed.level_offsets[i_level], staging.used - level_start, level_start);
+        uploads.push_back(VkBufferImageCopy{
+            .bufferOffset = level_start,
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource = {
+                .aspectMask = new_image.aspect_flags,
+                .mipLevel = i_level - base_level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+            .imageExtent = Image::mip_extent(streamed.extent, i_level),
+        });
+    }
+    if (!uploads.empty()) {
+        vkCmdCopyBufferToImage(cmd->buffer, staging.buffer.handle, new_image.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(uploads.size()), uploads.data());
+    }
+
+    // Levels both images have are copied on the GPU instead of uploaded again
+    std::vector<VkImageCopy> copies;
+    for (uint32_t i_level = std::max(base_level, streamed.resident_level); i_level < level_count; i_level++) {
+        copies.push_back(VkImageCopy{
+            .srcSubresource = {
+                .aspectMask = texture->image.aspect_flags,
+                .mipLevel = i_level - streamed.resident_level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+            .srcOffset = { 0, 0, 0 },
+            .dstSubresource = {
+                .aspectMask = new_image.aspect_flags,
+                .mipLevel = i_level - base_level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+            .dstOffset = { 0, 0, 0 },
+            .extent = Image::mip_extent(streamed.extent, i_level),
+        });
+    }
+    if (!copies.empty()) {
+        // This frame still samples the old image, so it goes back to being readable right after
+        Image::transition_image(cmd, &texture->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        vkCmdCopyImage(cmd->buffer, texture->image.handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, new_image.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(copies.size()), copies.data());
+        Image::transition_image(cmd, &texture->image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    }
+    Image::transition_image(cmd, &new_image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    resident_bytes -= resident_size(streamed, streamed.resident_level);
+    resident_bytes += resident_size(streamed, base_level);
+    streamed.pending = PendingImage{
+        .image = new_image,
+        .base_level = base_level,
+        .frame_number = renderer->frame_number,
+    };
+}
+
+void TextureStreamer::swap_in_pending(StreamedTexture& streamed, TextureAsset* texture) {
+    PendingImage pending = *streamed.pending;
+    streamed.pending.reset();
+
+    // Frames still in flight may be sampling the old image, so it gets a fresh slot instead of overwriting the old one.
+    // If there's none left the texture just stays at the levels it has
+    uint32_t new_slot = renderer->bindless_descriptors.add_image(&pending.image);
+    if (new_slot == UINT32_MAX) {
+        Logger::logError("Bindless image table is full, can't change the resident levels of " + texture->name);
+        pending.image.cleanup(); // The frame that filled it is done and nothing else ever saw it
+        resident_bytes -= resident_size(streamed, pending.base_level);
+        resident_bytes += resident_size(streamed, streamed.resident_level);
+        return;
+    }
+
+    AllocatedImage old_image = texture->image;
+    uint32_t old_slot = texture->bindless_index;
+    texture->image = pending.image;
+    texture->bindless_index = new_slot;
+    renderer->defer_cleanup([renderer = renderer, old_image, old_slot]() mutable {
+        renderer->bindless_descriptors.remove_image(old_slot);
+        old_image.cleanup();
+    });
+    streamed.resident_level = pending.base_level;
+
+    if (on_texture_changed) on_texture_changed(texture);
+}
+
+bool TextureStreamer::evict_one(Command* cmd, const StreamedTexture* keep) {
+    // Expects textures_mutex to already be held. Never evicts anything that was requested this frame or is already changing
+    StreamedTexture* victim = nullptr;
+    std::shared_ptr<TextureAsset> victim_texture;
+    for (auto& [key, streamed] : textures) {
+        if (&streamed == keep || streamed.pending || streamed.resident_level >= streamed.initial_level) continue;
+        if (streamed.last_requested_frame == renderer->frame_number) continue;
+        if (victim && streamed.last_requested_frame >= victim->last_requested_frame) continue;
+
+        std::shared_ptr<TextureAsset> texture = streamed.texture.lock();
+        if (!texture) continue;
+        victim = &streamed;
+        victim_texture = std::move(texture);
+    }
+    if (!victim) return false;
+
+    // The kept levels are all on the GPU already, so this is only an image to image copy
+    record_level_change(cmd, *victim, victim_texture.get(), victim->initial_level);
+    return true;
+}
+
+void TextureStreamer::update(Command* cmd) {
+    std::lock_guard<std::mutex> lock(textures_mutex);
+
+    // Forget textures nobody holds anymore. Their deleter already queued their images to be freed,
+    // a pending image may still be getting filled by a frame in flight
+    for (auto entry = textures.begin(); entry != textures.end();) {
+        StreamedTexture& streamed = entry->second;
+        if (streamed.texture.expired()) {
+            resident_bytes -= resident_size(streamed, streamed.pending ? streamed.pending->base_level : streamed.resident_level);
+            if (streamed.pending) {
+                renderer->defer_cleanup([image = streamed.pending->image]() mutable { image.cleanup(); });
+            }
+            entry = textures.erase(entry);
+        } else {
+            entry++;
+        }
+    }
+
+    // Same rule as the deferred cleanups: once this frame's fence was waited on, frames up to frame_number - frames_in_flight are done
+    for (auto& [key, streamed] : textures) {
+        if (!streamed.pending || streamed.pending->frame_number + renderer->frames_in_flight > renderer->frame_number) continue;
+        std::shared_ptr<TextureAsset> texture = streamed.texture.lock();
+        if (texture) swap_in_pending(streamed, texture.get());
+    }
+
+    StagingBuffer& staging = staging_buffers[renderer->frame_index];
+    ensure_staging_capacity(staging, staging_bytes_per_frame);
+    staging.used = 0;
+
+    // The budget can shrink while running (other applications, new render targets), so get back under it first.
+    // Evicted memory is only freed once the copies are done, so this can stay over budget for a few frames
+    const uint64_t budget = current_budget();
+    while (resident_bytes > budget && evict_one(cmd, nullptr)) {}
+
+    // Textures that were seen most recently and are furthest from the detail they want go first.
+    // Ones that haven't been requested in a while keep a stale wanted_level, so it drops back to where they started
+    std::vector<StreamedTexture*> promotions;
+    for (auto& [key, streamed] : textures) {
+        if (renderer->frame_number - streamed.last_requested_frame > request_timeout_frames) {
+            streamed.wanted_level = streamed.initial_level;
+        }
+        if (!streamed.pending && streamed.wanted_level < streamed.resident_level) promotions.push_back(&streamed);
+    }
+    std::sort(promotions.begin(), promotions.end(), [](const StreamedTexture* a, const StreamedTexture* b) {
+        if (a->last_requested_frame != b->last_requested_frame) return a->last_requested_frame > b->last_requested_frame;
+        return a->resident_level - a->wanted_level > b->resident_level - b->wanted_level;
+    });
+
+    uint32_t promotion_count = 0;
+    for (StreamedTexture* streamed : promotions) {
+        if (promotion_count == max_promotions_per_frame) break;
+
+        std::shared_ptr<TextureAsset> texture = streamed->texture.lock();
+        if (!texture) continue;
+
+        // Only as many levels as fit in what's left of the staging buffer, the rest follow in later frames.
+        // A single level larger than the whole buffer grows it, but only as the frame's first upload
+        uint32_t level = streamed->wanted_level;
+        while (level < streamed->resident_level && staged_end(*streamed, level, streamed->resident_level, staging.used) > staging.capacity) {
+            level++;
+        }
+        if (level == streamed->resident_level) {
+            if (staging.used > 0) continue;
+            level = streamed->resident_level - 1;
+            ensure_staging_capacity(staging, staged_end(*streamed, level, streamed->resident_level, 0));
+        }
+
+        const size_t extra_bytes = resident_size(*streamed, level) - resident_size(*streamed, streamed->resident_level);
+        bool fits = true;
+        while (fits && resident_bytes + extra_bytes > budget) {
+            fits = evict_one(cmd, streamed);
+        }
+        if (!fits) continue; // Everything else is in use, maybe a smaller promotion later in the list still fits
+
+        record_level_change(cmd, *streamed, texture.get(), level);
+        promotion_count++;
+    }
+}
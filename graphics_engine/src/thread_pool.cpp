@@ -0,0 +1,92 @@
+#include "thread_pool.h"
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
+
+void ThreadPool::initialize(uint32_t thread_count) {
+    stopping = false;
+
+    // Leave a core for the main thread, but always have at least one worker
+    if (thread_count == 0) {
+        uint32_t hardware_threads = std::thread::hardware_concurrency();
+        thread_count = std::max(hardware_threads, 2u) - 1;
+    }
+
+    workers.reserve(thread_count);
+    for (uint32_t i_thread = 0; i_thread < thread_count; i_thread++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+    Logger::log("Thread pool started with " + std::to_string(thread_count) + " workers");
+}
+
+void ThreadPool::cleanup() {
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        stopping = true;
+    }
+    jobs_available.notify_all();
+
+    // Workers drain whatever is left in the queue before exiting
+    for (auto& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+    workers.clear();
+}
+
+void ThreadPool::enqueue(std::function<void()>&& job) {
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobs_available.notify_one();
+}
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t index)>& function) {
+    if (count == 0) return;
+
+    // Helpers can start after every index has been claimed (or even after we return), so the
+    // shared counters live on the heap. They only touch function while holding a valid index.
+    struct SharedState {
+        std::atomic<size_t> next_index{ 0 };
+        std::atomic<size_t> finished_count{ 0 };
+        std::mutex mutex;
+        std::condition_variable all_finished;
+    };
+    auto state = std::make_shared<SharedState>();
+
+    auto run = [state, count, function_ptr = &function]() {
+        size_t index;
+        while ((index = state->next_index.fetch_add(1)) < count) {
+            (*function_ptr)(index);
+            if (state->finished_count.fetch_add(1) + 1 == count) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->all_finished.notify_all();
+            }
+        }
+    };
+
+    size_t helper_count = std::min(count - 1, workers.size());
+    for (size_t i_helper = 0; i_helper < helper_count; i_helper++) {
+        enqueue(run);
+    }
+
+    // If every worker is busy, the caller just ends up doing all the work itself instead of deadlocking
+    run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->all_finished.wait(lock, [&]() { return state->finished_count.load() == count; });
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_available.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return; // Only reachable when stopping
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
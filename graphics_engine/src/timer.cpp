@@ -3,6 +3,7 @@
 void Timer::initialize() {
     this->frame_time   = 0.0f;
     this->fps          = 0.0f;
+    this->fps_smoothing = 0.9f;
     this->current_time = std::chrono::steady_clock::now();
 }
 
@@ -5,25 +5,224 @@
 #include "pipeline.h"
 #include "mesh.h"
 #include "descriptor.h"
+#include "camera.h"
+#include "depth_pyramid.h"
+#include "scene_graph.h"
+#include "slot_map.h"
+#include "bvh.h"
+#include <array>
+#include <cfloat>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 class MeshAsset;
+class MaterialAsset;
+class TextureAsset;
+class CollisionMesh;
+struct GeometricSurface;
 
+using RenderableHandle = SlotHandle;
+
+// What the system keeps per added mesh. The shared_ptr holds the mesh's GPU buffers alive, drawing never goes through it
+struct Renderable {
+    std::shared_ptr<MeshAsset> mesh;
+    uint32_t node; // Scene graph node the mesh's instances are placed under
+};
+
+// Pipeline variant a surface is drawn with, picked from its material. Also the top field of the draw sort key, so the
+// order here is the draw order: opaque first, then alpha tested, and blended last
+enum MaterialPipeline : uint32_t {
+    MATERIAL_PIPELINE_OPAQUE,
+    MATERIAL_PIPELINE_OPAQUE_DOUBLE_SIDED,
+    MATERIAL_PIPELINE_MASKED,
+    MATERIAL_PIPELINE_MASKED_DOUBLE_SIDED,
+    MATERIAL_PIPELINE_BLENDED,
+    MATERIAL_PIPELINE_BLENDED_DOUBLE_SIDED,
+    MATERIAL_PIPELINE_COUNT,
+};
+
+// What a ray hit, see MeshRenderSystem::pick()
+struct PickResult {
+    RenderableHandle renderable;
+    uint32_t surface;   // Index into the mesh's surfaces
+    uint32_t instance;  // Index into the mesh's instance_transforms
+    uint32_t triangle;  // The triangle's first index in the mesh's index buffer, divided by 3
+    float distance;     // Along the ray, in the units of its direction
+    glm::vec3 position; // World space
+};
+
+// Draws every surface of every renderable on the GPU's terms. All instances of all surfaces live in one object buffer,
+// a compute pass frustum and occlusion culls them and writes the surviving draws, and render() issues one indirect
+// count draw per geometry buffer and pipeline. Occlusion is tested against a depth pyramid built from the previous frame.
+// The CPU keeps the object bounds in a BVH to skip groups that are entirely off-screen and to only stream in
+// textures for visible objects.
+// Blended surfaces stay out of all that. They need a back to front order the GPU cull can't give, so the CPU sorts the
+// visible ones and draws them one by one after everything opaque.
 class MeshRenderSystem : public RenderSystem {
 public:
+    void prepare(Command* cmd);
     void render(Command* cmd);
+    void finalize(Command* cmd);
+    void reload_shaders(const std::vector<std::string>& entry_points);
 
-    void initialize(Renderer* renderer, std::vector<DescriptorSet> descriptor_sets);
+    // @param vertex_pulling - fetch vertices in the shader through buffer device addresses instead of fixed-function vertex input
+    void initialize(Renderer* renderer, bool vertex_pulling = true);
     void cleanup();
 
-    void add_renderable(std::shared_ptr<MeshAsset> renderable);
-    void update_push_constants(GPUDrawPushConstants* push_constants);
+    // @param node - scene graph node the mesh's instances are placed under, NO_NODE keeps them where they were imported
+    RenderableHandle add_renderable(std::shared_ptr<MeshAsset> renderable, uint32_t node = SceneGraph::NO_NODE);
+    // @brief Stops drawing the renderable. Its mesh is let go once the frames in flight are done with it
+    void remove_renderable(RenderableHandle handle);
+
+    // @brief Finds the closest triangle of any renderable along a world space ray, e.g. one from Camera::screen_ray().
+    // Walks the object BVH and then the hit meshes' triangle BVHs, all on the CPU. Objects are where the last prepare() put them,
+    // and meshes loaded without a collision mesh are skipped
+    std::optional<PickResult> pick(glm::vec3 origin, glm::vec3 direction, float max_distance = FLT_MAX) const;
+
+    // @brief Tells the texture streamer how large each renderable's textures appear from this camera. Call before Renderer::draw()
+    void request_texture_residency(const Camera& camera, float viewport_height);
+
+    Renderer* renderer;
 
-    Pipeline simple_mesh_pipeline;
-    std::vector<std::shared_ptr<MeshAsset>> renderables;
-    GPUDrawPushConstants* push_constants;
-    std::vector<DescriptorSet> descriptor_sets;
+    // All from the renderer's PipelineRegistry, so variants that come out the same share one pipeline and bind as one
+    std::array<std::shared_ptr<Pipeline>, MATERIAL_PIPELINE_COUNT> mesh_pipelines;
+    // Only opaque surfaces take part in the prepass, indexed by MATERIAL_PIPELINE_OPAQUE or MATERIAL_PIPELINE_OPAQUE_DOUBLE_SIDED
+    std::array<std::shared_ptr<Pipeline>, 2> depth_prepass_pipelines;    // Depth only, position only vertex input and no pixel shader
+    std::array<std::shared_ptr<Pipeline>, 2> depth_equal_mesh_pipelines; // Shades only what matches the prepass depth, without writing depth again
+    std::shared_ptr<Pipeline> cull_pipeline;
+    SlotMap<Renderable> renderables;
+    bool vertex_pulling;
+    bool occlusion_culling;
+    float cpu_cull_time; // Milliseconds the last CPU frustum cull took
+    bool depth_prepass; // Pays for a second geometry pass so every pixel gets shaded only once
+    DepthPyramid depth_pyramid;
 
 private:
-    // This is just for internal use so we can bind all descriptor_sets at once
-    std::vector<VkDescriptorSet> contiguous_sets;
+    enum class MeshPass {
+        COLOR,
+        DEPTH_PREPASS,
+        COLOR_AFTER_PREPASS,
+    };
+
+    // Sort key of a blended object, how far it is from the camera this frame
+    struct BlendedDraw {
+        float distance;
+        uint32_t object;
+    };
+
+    // One surface of one renderable, copied out of the mesh so building objects doesn't chase pointers.
+    // Draws are sorted by sort_key so the objects of each draw group end up contiguous
+    struct MeshDraw {
+        uint64_t sort_key;
+        MaterialPipeline pipeline;
+        const GPUMeshBuffer* geometry;
+        const MaterialAsset* material;
+        glm::vec4 bounding_sphere;
+        uint32_t first_index;
+        uint32_t index_count;
+        uint32_t node;
+        uint32_t first_instance; // Range in instance_transforms
+        uint32_t instance_count;
+        const CollisionMesh* collision;
+        RenderableHandle renderable;
+        uint32_t surface;
+    };
+
+    // Where an object came from, so picks can be traced back to a renderable
+    struct ObjectSource {
+        const CollisionMesh* collision; // nullptr if the mesh has none
+        RenderableHandle renderable;
+        uint32_t surface;
+        uint32_t instance;
+    };
+
+    // A run of objects sharing a geometry buffer and pipeline, drawn by a single vkCmdDrawIndexedIndirectCount
+    struct DrawGroup {
+        const GPUMeshBuffer* geometry;
+        MaterialPipeline pipeline;
+        uint32_t first_command; // Where this group's commands start in the command buffer
+        uint32_t max_draw_count;
+        bool visible;           // Whether the CPU cull found any of its objects on screen this frame
+        float distance;         // To the closest of its visible objects, for drawing front to back
+    };
+
+    // The cull pass rewrites these every frame, so each frame in flight gets its own
+    struct FrameDrawBuffers {
+        Buffer commands;
+        Buffer counts;
+        uint32_t commands_index; // Bindless storage buffer slots
+        uint32_t counts_index;
+        uint32_t capacity;       // Commands that fit in the buffer
+    };
+
+    // Frames in flight read the object buffer of the frame they were recorded in, so each one keeps its own persistent copy.
+    // Changes are queued for every copy and written into it the next time its frame comes around
+    struct FrameObjectBuffer {
+        Buffer buffer;
+        uint32_t index;                        // Bindless storage buffer slot, UINT32_MAX until the buffer exists
+        uint32_t capacity;                     // Objects that fit in the buffer
+        bool full_upload;                      // Every object changed, pending_objects doesn't matter then
+        std::vector<uint32_t> pending_objects; // Changed since this copy was last written
+    };
+
+    const char* vertex_entry_point(MeshPass pass) const;
+    static const char* pixel_entry_point(MeshPass pass, MaterialPipeline material_pipeline); // nullptr for the prepass
+    std::shared_ptr<Pipeline> build_mesh_pipeline(MeshPass pass, MaterialPipeline material_pipeline);
+    std::shared_ptr<Pipeline> build_cull_pipeline();
+    const Pipeline& group_pipeline(MeshPass pass, MaterialPipeline material_pipeline) const;
+    // @param bound_layout - layout the camera and bindless sets were last bound with, they stay bound for pipelines sharing it
+    void bind_mesh_pipeline(Command* cmd, const Pipeline& pipeline, VkPipelineLayout& bound_layout);
+    void bind_geometry(Command* cmd, const Pipeline& pipeline, const GPUMeshBuffer* geometry);
+    void draw_visible_groups(Command* cmd, MeshPass pass);
+    void draw_blended_objects(Command* cmd);
+    void build_draw_list();
+    void rebuild_objects();
+    void update_object_transforms(bool moved_only);
+    bool renderables_moved();
+    void cull_objects();
+    // @brief Returns false if the bindless table had no room for the buffers, nothing is drawn indirectly this frame then
+    bool ensure_frame_buffers(FrameDrawBuffers& frame_buffers);
+    // @brief Points the objects using texture at its new bindless slot after the streamer swapped it
+    void update_object_textures(const TextureAsset* texture);
+    // @brief Queues objects to be written into every frame's object buffer
+    void queue_object_writes(std::span<const uint32_t> changed_objects);
+    void queue_full_object_upload();
+    // @brief Writes the queued objects into this frame's buffer. Returns false if it has no bindless slot, nothing can be drawn then
+    bool sync_frame_objects(FrameObjectBuffer& frame_objects);
+
+    // Only rebuilt when the renderables or their textures change, kept around so their memory is reused
+    std::vector<MeshDraw> draw_list;
+    std::vector<MeshDraw> sort_scratch;
+    std::vector<glm::mat4> instance_transforms; // Every renderable's instances back to back
+    std::unordered_map<const MaterialAsset*, uint32_t> material_ids;
+    std::unordered_map<const GPUMeshBuffer*, uint32_t> geometry_ids;
+
+    bool objects_dirty;
+    std::vector<GPUObjectData> objects;
+    std::vector<uint32_t> object_nodes;                  // Kept so moving a node only redoes the transforms
+    std::vector<glm::mat4> object_instance_transforms;
+    uint32_t object_buffer_index; // Slot of the current frame's object buffer, set by prepare()
+    uint32_t object_count;
+    uint32_t culled_object_count; // Objects before the blended ones, the only ones the GPU cull pass sees
+    std::vector<DrawGroup> draw_groups;
+    std::vector<uint32_t> group_order; // Visible groups, front to back within opaque and then within alpha tested
+
+    // CPU side copies, indexed like the object buffer
+    BoundingSphereSoA object_spheres;
+    BVH object_bvh;                      // Built from object_spheres
+    std::vector<uint32_t> moved_objects;
+    std::vector<uint32_t> visible_objects;
+    std::vector<ObjectSource> object_sources;
+    std::vector<const GPUMeshBuffer*> blended_geometries; // From culled_object_count on, blended objects draw without a group
+    std::vector<MaterialPipeline> blended_pipelines;
+    std::vector<BlendedDraw> blended_draws;              // Visible this frame, back to front
+    std::vector<const TextureAsset*> object_textures;
+    std::vector<uint8_t> object_visibility;
+    std::vector<FrameDrawBuffers> frame_draw_buffers;
+    std::vector<FrameObjectBuffer> frame_object_buffers;
 };
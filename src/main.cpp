@@ -10,8 +10,11 @@
 #include "input_manager.h"
 #include "asset_loading.h"
 #include "gui.h"
+#include "timer.h"
 #include <cstdint>
 #include <filesystem>
+#include <future>
+#include <optional>
 #include <string>
 
 #define GLM_ENABLE_EXPERIMENTAL
@@ -34,7 +37,7 @@ static std::vector<const char*> requested_validation_layers = {
 
 static std::vector<const char*> requested_device_extensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME, // Necessary extension to use swapchains
-    VK_GOOGLE_USER_TYPE_EXTENSION_NAME
+    VK_GOOGLE_USER_TYPE_EXTENSION_NAME,
 };
 
 #ifdef ROOT_DIR
@@ -52,12 +55,6 @@ struct CameraParams {
     float rotation;
 };
 
-struct CameraBuffer {
-    glm::mat4 projection{1.0f};
-    glm::mat4 view{1.0f};
-    glm::mat4 model{1.0f};
-};
-
 int main (int argc, char *argv[]) {
 
     Renderer renderer;
@@ -68,74 +65,31 @@ int main (int argc, char *argv[]) {
         .window_width      = APPLICATION_WIDTH,
         .window_height     = APPLICATION_HEIGHT,
         .validation_layers = &requested_validation_layers,
-        .device_extensions = &requested_device_extensions
+        .device_extensions = &requested_device_extensions,
+        .cache_directory   = std::filesystem::path(root_directory) / "cache",
+        .shader_hot_reload = true,
     };
 
-    renderer.initialize(&renderer_info);
+    if (!renderer.initialize(&renderer_info)) return 1;
     input_manager.initialize(&renderer.window);
 
-    Buffer global_uniform_buffer = renderer.create_buffer(sizeof(CameraBuffer), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-    CameraBuffer camera_buffer{};
-
-    std::vector<DescriptorSet> mesh_descriptors;
-
-    DescriptorSet global_buffer_descriptor = renderer.descriptor_builder
-        .add_buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, &global_uniform_buffer)
-        .build();
-    renderer.descriptor_builder.clear();
-    mesh_descriptors.push_back(global_buffer_descriptor);
-
-    uint32_t white = glm::packUnorm4x8(glm::vec4{ 1.0f, 1.0f, 1.0f, 1.0f });
-    AllocatedImage white_texture = renderer.create_image_from_data(&white, sizeof(uint32_t), VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT);
-
-    uint32_t grey  = glm::packUnorm4x8(glm::vec4{ 0.66f, 0.66f, 0.66f, 1.0f });
-    AllocatedImage grey_texture = renderer.create_image_from_data(&grey, sizeof(uint32_t), VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT);
-
-    uint32_t black = glm::packUnorm4x8(glm::vec4{ 0.0f, 0.0f, 0.0f, 1.0f });
-    AllocatedImage black_texture = renderer.create_image_from_data(&black, sizeof(uint32_t), VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT);
-
-    const int texture_size = 16;
-    uint32_t magenta = glm::packUnorm4x8(glm::vec4(1, 0, 1, 1));
-    std::array<uint32_t, texture_size * texture_size> pink_checkerboard;
-    std::array<uint32_t, texture_size * texture_size> checkerboard;
-    for (int i = 0; i < texture_size; i++) {
-        for (int j = 0; j < texture_size; j++) {
-            pink_checkerboard[i*texture_size + j] = (i % 2) ^ (j % 2) ? magenta : black;
-            checkerboard[i*texture_size + j] = (i % 2) ^ (j % 2) ? white : black;
-        }
-    }
-    AllocatedImage error_texture = renderer.create_image_from_data(&checkerboard, sizeof(uint32_t), VkExtent3D{ texture_size, texture_size, 1 }, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT);
-
-    // TODO: Combine samplers with images to make Textures
-    VkSamplerCreateInfo sampler_info{
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-    };
-
-    VkSampler sampler_nearest;
-    sampler_info.minFilter = VK_FILTER_NEAREST;
-    sampler_info.magFilter = VK_FILTER_NEAREST;
-    vkCreateSampler(renderer.device.logical_device, &sampler_info, nullptr, &sampler_nearest);
-
-    VkSampler sampler_linear;
-    sampler_info.minFilter = VK_FILTER_LINEAR;
-    sampler_info.magFilter = VK_FILTER_LINEAR;
-    vkCreateSampler(renderer.device.logical_device, &sampler_info, nullptr, &sampler_linear);
-
-    DescriptorSet texture_descriptor = renderer.descriptor_builder
-        .add_image(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, &error_texture, sampler_nearest)
-        .build();
-    mesh_descriptors.push_back(texture_descriptor);
-
     MeshRenderSystem mesh_render_system;
-    mesh_render_system.initialize(&renderer, mesh_descriptors);
+    mesh_render_system.initialize(&renderer);
     renderer.add_render_system(&mesh_render_system);
 
     static Gui& gui = Gui::get_gui();
     gui.initialize(&renderer);
 
-    // Create meshes
-    auto test_meshes = renderer.asset_manager.load_mesh_GLTF(std::filesystem::absolute(root_directory + "/assets/basicmesh.glb"));
-    mesh_render_system.add_renderable(test_meshes.value()[2]);
+    // The test mesh hangs off its own scene node, which the rotation slider turns
+    const uint32_t mesh_node = renderer.scene_graph.add_node();
+
+    // Create meshes. These stream in on the asset manager's threads and show up once they are on the GPU
+    std::shared_future<MeshLoadResult> test_meshes = renderer.asset_manager.load_mesh_GLTF_async(
+        std::filesystem::absolute(root_directory + "/assets/basicmesh.glb"),
+        [&](const MeshLoadResult& meshes) {
+            if (meshes.has_value()) mesh_render_system.add_renderable(meshes.value()[2], mesh_node);
+        }
+    );
 
     // Set up camera
     Camera world_camera;
@@ -149,11 +103,17 @@ int main (int argc, char *argv[]) {
         .ortho_scale = 5.0f,
         .rotation = 0.0f
     };
+    float applied_rotation = camera_config.rotation; // The node starts out unrotated
+
+    static Timer& timer = Timer::get_timer();
+    timer.initialize();
 
     // Main loop
     while (!renderer.window.window_should_close) {
+        timer.update();
         input_manager.process_inputs();
         renderer.resize_callback();
+        renderer.asset_manager.publish_completed_loads();
 
         gui.start_frame();
         gui.add_widget("Camera", [&](){
@@ -169,6 +129,10 @@ int main (int argc, char *argv[]) {
         });
         gui.add_widget("Renderer", [&](){
             ImGui::DragFloat("Render Scale", &renderer.render_scale, 0.001f, 0.3f, 1.0f);
+            ImGui::Checkbox("Occlusion Culling", &mesh_render_system.occlusion_culling);
+            ImGui::Checkbox("Depth Prepass", &mesh_render_system.depth_prepass);
+            ImGui::Text("Frame time: %.2f ms (%.0f fps)", timer.frame_time * 1000.0f, timer.fps);
+            ImGui::Text("CPU cull: %.3f ms", mesh_render_system.cpu_cull_time);
         });
         //glm::mat4 view = glm::lookAt(camera_config.position, camera_config.center, up);
         //world_camera.set_view_direction(camera_config.position, camera_config.center);
@@ -179,12 +143,30 @@ int main (int argc, char *argv[]) {
             world_camera.set_projection_orthographic(-renderer.window.aspect_ratio/2.0f*camera_config.ortho_scale, renderer.window.aspect_ratio/2.0f*camera_config.ortho_scale, -0.5f*camera_config.ortho_scale, 0.5f*camera_config.ortho_scale, camera_config.near_plane, camera_config.far_plane);
         }
         const glm::vec3 up = {0.0f, 1.0f, 0.0f};
-        glm::mat4 model = glm::rotate(camera_config.rotation, up);
+        // Setting it marks the node dirty, which re-uploads its objects, so only do it when the slider actually moved
+        if (camera_config.rotation != applied_rotation) {
+            renderer.scene_graph.set_rotation(mesh_node, glm::angleAxis(camera_config.rotation, up));
+            applied_rotation = camera_config.rotation;
+        }
 
-        camera_buffer.projection = world_camera.projection;
-        camera_buffer.view = world_camera.view;
-        camera_buffer.model = model;
-        global_uniform_buffer.write_data(&camera_buffer);
+        // Whatever is under the cursor, straight from the CPU-side BVHs so it never waits on the GPU
+        glm::vec3 ray_origin, ray_direction;
+        world_camera.screen_ray(glm::vec2(input_manager.mouse_pos_x, input_manager.mouse_pos_y),
+                                glm::vec2(renderer.window.logical_extent.width, renderer.window.logical_extent.height), ray_origin, ray_direction);
+        std::optional<PickResult> hovered = mesh_render_system.pick(ray_origin, ray_direction);
+        gui.add_widget("Picking", [&](){
+            const Renderable* renderable = hovered ? mesh_render_system.renderables.get(hovered->renderable) : nullptr;
+            if (!renderable) {
+                ImGui::Text("Nothing under the cursor");
+                return;
+            }
+            ImGui::Text("Mesh: %s (surface %u, instance %u)", renderable->mesh->name.c_str(), hovered->surface, hovered->instance);
+            ImGui::Text("Triangle: %u", hovered->triangle);
+            ImGui::Text("Position: %.3f %.3f %.3f", hovered->position.x, hovered->position.y, hovered->position.z);
+        });
+
+        renderer.set_camera(world_camera);
+        mesh_render_system.request_texture_residency(world_camera, renderer.draw_image.extent.height * renderer.render_scale);
 
         renderer.draw();
 
@@ -193,14 +175,10 @@ int main (int argc, char *argv[]) {
 
     renderer.wait_for_idle();
 
-    vkDestroySampler(renderer.device.logical_device, sampler_nearest, nullptr);
-    vkDestroySampler(renderer.device.logical_device, sampler_linear, nullptr);
-    global_uniform_buffer.cleanup();
-    global_buffer_descriptor.cleanup();
-    texture_descriptor.cleanup();
-    white_texture.cleanup(); grey_texture.cleanup(); black_texture.cleanup(); error_texture.cleanup();
-
-    for (auto& mesh : test_meshes.value()) mesh->cleanup();
+    // Blocks if the load is somehow still running, we can't free buffers that are mid-upload.
+    // The meshes free themselves once the last holder lets go, which has to happen before the device is gone
+    test_meshes.wait();
+    test_meshes = {};
     gui.cleanup();
     mesh_render_system.cleanup();
     renderer.cleanup();
@@ -2,80 +2,809 @@
 #include "pipeline.h"
 #include "renderer.h"
 #include "mesh.h"
+#include "asset_loading.h"
 #include "logger.h"
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
 
 #ifdef SHADER_DIR
 static const std::string shader_directory{SHADER_DIR};
 #endif
 
-void MeshRenderSystem::initialize(Renderer* renderer, std::vector<DescriptorSet> descriptor_sets) {
-    // Start building the mesh render pipeline
+static bool is_opaque(MaterialPipeline material_pipeline) {
+    return material_pipeline == MATERIAL_PIPELINE_OPAQUE || material_pipeline == MATERIAL_PIPELINE_OPAQUE_DOUBLE_SIDED;
+}
+
+static bool is_blended(MaterialPipeline material_pipeline) {
+    return material_pipeline == MATERIAL_PIPELINE_BLENDED || material_pipeline == MATERIAL_PIPELINE_BLENDED_DOUBLE_SIDED;
+}
+
+static bool is_double_sided(MaterialPipeline material_pipeline) {
+    return material_pipeline == MATERIAL_PIPELINE_OPAQUE_DOUBLE_SIDED || material_pipeline == MATERIAL_PIPELINE_MASKED_DOUBLE_SIDED || material_pipeline == MATERIAL_PIPELINE_BLENDED_DOUBLE_SIDED;
+}
+
+static MaterialPipeline material_pipeline_of(const MaterialAsset* material) {
+    if (!material) return MATERIAL_PIPELINE_OPAQUE;
+
+    uint32_t pipeline = MATERIAL_PIPELINE_OPAQUE;
+    if (material->alpha_mode == MATERIAL_ALPHA_MODE_MASK) pipeline = MATERIAL_PIPELINE_MASKED;
+    if (material->alpha_mode == MATERIAL_ALPHA_MODE_BLEND) pipeline = MATERIAL_PIPELINE_BLENDED;
+
+    // Every variant has its double sided twin right after it
+    return static_cast<MaterialPipeline>(pipeline + (material->double_sided ? 1 : 0));
+}
+
+const char* MeshRenderSystem::vertex_entry_point(MeshPass pass) const {
+    if (pass == MeshPass::DEPTH_PREPASS) return vertex_pulling ? "depth_vertex_pulling_main" : "depth_vertex_main";
+    return vertex_pulling ? "vertex_pulling_main" : "vertex_main";
+}
+
+const char* MeshRenderSystem::pixel_entry_point(MeshPass pass, MaterialPipeline material_pipeline) {
+    // The prepass has no pixel shader at all, rasterization alone writes the depth
+    if (pass == MeshPass::DEPTH_PREPASS) return nullptr;
+    const bool masked = !is_opaque(material_pipeline) && !is_blended(material_pipeline);
+    return masked ? "pixel_masked_main" : "pixel_main";
+}
+
+std::shared_ptr<Pipeline> MeshRenderSystem::build_mesh_pipeline(MeshPass pass, MaterialPipeline material_pipeline) {
+    const bool depth_only = pass == MeshPass::DEPTH_PREPASS;
     renderer->pipeline_builder.clear();
-    this->descriptor_sets = descriptor_sets;
 
-    contiguous_sets.reserve(descriptor_sets.size());
-    for (auto& set : descriptor_sets) {
-        contiguous_sets.push_back(set.handle);
-    }
+	Shader vertex_shader;
+    vertex_shader.initialize(&renderer->device, &renderer->shader_manager, VK_SHADER_STAGE_VERTEX_BIT, vertex_entry_point(pass));
+    renderer->pipeline_builder.set_shader(vertex_shader);
 
-	Shader basic_vertex_shader;
-    basic_vertex_shader.initialize(&renderer->device, &renderer->shader_manager, VK_SHADER_STAGE_VERTEX_BIT, "vertex_main");
-	Shader basic_pixel_shader;
-    basic_pixel_shader.initialize(&renderer->device, &renderer->shader_manager, VK_SHADER_STAGE_FRAGMENT_BIT, "pixel_main");
+	Shader pixel_shader;
+    if (!depth_only) {
+        pixel_shader.initialize(&renderer->device, &renderer->shader_manager, VK_SHADER_STAGE_FRAGMENT_BIT, pixel_entry_point(pass, material_pipeline));
+        renderer->pipeline_builder.set_shader(pixel_shader);
+    }
 
-    VkPushConstantRange push_constant_range{
+    // The vertex shader finds its object through the instance index, everything else comes from the object buffer
+    VkPushConstantRange mesh_push_constant_range{
         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
         .offset = 0,
-        .size = sizeof(GPUDrawPushConstants),
+        .size = sizeof(GPUMeshPushConstants),
     };
 
-    simple_mesh_pipeline = renderer->pipeline_builder
-     //   .add_push_constant(push_constant_range)
-        .set_shader(basic_vertex_shader)
-        .set_shader(basic_pixel_shader)
-        .add_vertex_binding_description(PipelineBuilder::vertex_input_binding_description(0, sizeof(MeshVertex), VK_VERTEX_INPUT_RATE_VERTEX))
-        .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(MeshVertex, position)))
-        .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 1, VK_FORMAT_R32_SFLOAT, offsetof(MeshVertex, uv_x)))
-        .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 2, VK_FORMAT_R32G32B32_SFLOAT, offsetof(MeshVertex, normal)))
-        .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 3, VK_FORMAT_R32_SFLOAT, offsetof(MeshVertex, uv_y)))
-        .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 4, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(MeshVertex, color)))
-        .add_descriptor(descriptor_sets[0].layout)
-        .add_descriptor(descriptor_sets[1].layout)
+    if (!vertex_pulling) {
+        renderer->pipeline_builder
+            .add_vertex_binding_description(PipelineBuilder::vertex_input_binding_description(0, sizeof(MeshVertex), VK_VERTEX_INPUT_RATE_VERTEX))
+            .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(MeshVertex, position)));
+        if (!depth_only) {
+            renderer->pipeline_builder
+                .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 1, VK_FORMAT_R32_SFLOAT, offsetof(MeshVertex, uv_x)))
+                .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 2, VK_FORMAT_R32G32B32_SFLOAT, offsetof(MeshVertex, normal)))
+                .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 3, VK_FORMAT_R32_SFLOAT, offsetof(MeshVertex, uv_y)))
+                .add_vertex_attribute_description(PipelineBuilder::vertex_input_attribute_description(0, 4, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(MeshVertex, color)));
+        }
+    }
+
+    renderer->pipeline_builder
+        .add_push_constant(mesh_push_constant_range)
+        .add_descriptor(renderer->camera_descriptors[0].layout, renderer->camera_descriptors[0].layout_description) // Set 0: this frame's camera
+        .add_descriptor(renderer->bindless_descriptors.layout, renderer->bindless_descriptors.layout_description) // Set 1: every texture, sampler and storage buffer
         .set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
         .set_polygon_mode(VK_POLYGON_MODE_FILL)
-        .set_cull_mode(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE)
+        // The projection flips Y so the image comes out upright, which keeps glTF's counter-clockwise front faces as they are
+        .set_cull_mode(is_double_sided(material_pipeline) ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE)
         .set_multisampling(VK_SAMPLE_COUNT_1_BIT)
-        .set_blending(BlendingType::BLENDING_TYPE_ALPHA)
+        .set_blending(is_blended(material_pipeline) ? BlendingType::BLENDING_TYPE_ALPHA : BlendingType::BLENDING_TYPE_NONE)
         .set_color_attachment_format(renderer->draw_image.format)
-        .set_depth_attachment_format(renderer->depth_image.format)
-        .set_depth_test(VK_COMPARE_OP_GREATER_OR_EQUAL)
-        .build();
+        .set_depth_attachment_format(renderer->depth_image.format);
+
+    // After a prepass the depth buffer already holds the closest surface, so only the fragments that match it get shaded
+    switch (pass) {
+        case MeshPass::DEPTH_PREPASS:
+            renderer->pipeline_builder.set_color_write_mask(0).set_depth_test(VK_COMPARE_OP_GREATER_OR_EQUAL);
+            break;
+        case MeshPass::COLOR:
+            // Blended surfaces are sorted against each other, not by depth, and must not hide what's behind them
+            renderer->pipeline_builder.set_depth_test(VK_COMPARE_OP_GREATER_OR_EQUAL, !is_blended(material_pipeline));
+            break;
+        case MeshPass::COLOR_AFTER_PREPASS:
+            renderer->pipeline_builder.set_depth_test(VK_COMPARE_OP_EQUAL, false);
+            break;
+    }
 
-    basic_pixel_shader.cleanup();
-    basic_vertex_shader.cleanup();
+    std::shared_ptr<Pipeline> pipeline = renderer->pipeline_registry.build(renderer->pipeline_builder);
+
+    if (!depth_only) pixel_shader.cleanup();
+    vertex_shader.cleanup();
+    return pipeline;
+}
+
+std::shared_ptr<Pipeline> MeshRenderSystem::build_cull_pipeline() {
+    // Same set layout as the mesh pipeline so the bindless table sits at set 1 in both
+    Shader cull_shader;
+    cull_shader.initialize(&renderer->device, &renderer->shader_manager, VK_SHADER_STAGE_COMPUTE_BIT, "cull_main");
+
+    VkPushConstantRange cull_push_constant_range{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(GPUCullPushConstants),
+    };
+
+    renderer->pipeline_builder.clear();
+    renderer->pipeline_builder
+        .add_push_constant(cull_push_constant_range)
+        .set_shader(cull_shader)
+        .add_descriptor(renderer->camera_descriptors[0].layout, renderer->camera_descriptors[0].layout_description)
+        .add_descriptor(renderer->bindless_descriptors.layout, renderer->bindless_descriptors.layout_description);
+    std::shared_ptr<Pipeline> pipeline = renderer->pipeline_registry.build_compute(renderer->pipeline_builder);
+
+    cull_shader.cleanup();
+    return pipeline;
+}
+
+void MeshRenderSystem::initialize(Renderer* renderer, bool vertex_pulling) {
+    this->renderer = renderer;
+    this->vertex_pulling = vertex_pulling;
+    depth_prepass = false;
+
+    for (uint32_t i_pipeline = 0; i_pipeline < MATERIAL_PIPELINE_COUNT; i_pipeline++) {
+        mesh_pipelines[i_pipeline] = build_mesh_pipeline(MeshPass::COLOR, static_cast<MaterialPipeline>(i_pipeline));
+    }
+    for (MaterialPipeline material_pipeline : { MATERIAL_PIPELINE_OPAQUE, MATERIAL_PIPELINE_OPAQUE_DOUBLE_SIDED }) {
+        depth_prepass_pipelines[material_pipeline] = build_mesh_pipeline(MeshPass::DEPTH_PREPASS, material_pipeline);
+        depth_equal_mesh_pipelines[material_pipeline] = build_mesh_pipeline(MeshPass::COLOR_AFTER_PREPASS, material_pipeline);
+    }
+
+    cull_pipeline = build_cull_pipeline();
+
+    depth_pyramid.initialize(renderer);
+    occlusion_culling = true;
+    cpu_cull_time = 0.0f;
+
+    objects_dirty = false;
+    object_buffer_index = UINT32_MAX;
+    object_count = 0;
+    culled_object_count = 0;
+    frame_draw_buffers.resize(renderer->frames_in_flight, FrameDrawBuffers{ .capacity = 0 });
+    frame_object_buffers.resize(renderer->frames_in_flight, FrameObjectBuffer{ .index = UINT32_MAX, .capacity = 0, .full_upload = true });
+
+    // A streamed texture that gets swapped moves to another bindless slot, which the object buffer has to pick up
+    renderer->texture_streamer.on_texture_changed = [this](TextureAsset* texture) { update_object_textures(texture); };
 }
 
 void MeshRenderSystem::cleanup() {
-    simple_mesh_pipeline.cleanup();
+    renderer->texture_streamer.on_texture_changed = nullptr;
+    renderables.clear();
+    object_bvh.clear();
+
+    for (FrameDrawBuffers& frame_buffers : frame_draw_buffers) {
+        if (frame_buffers.capacity == 0) continue;
+        renderer->bindless_descriptors.remove_storage_buffer(frame_buffers.commands_index);
+        renderer->bindless_descriptors.remove_storage_buffer(frame_buffers.counts_index);
+        frame_buffers.commands.cleanup();
+        frame_buffers.counts.cleanup();
+    }
+    frame_draw_buffers.clear();
+
+    for (FrameObjectBuffer& frame_objects : frame_object_buffers) {
+        if (frame_objects.capacity == 0) continue;
+        renderer->bindless_descriptors.remove_storage_buffer(frame_objects.index);
+        frame_objects.buffer.cleanup();
+    }
+    frame_object_buffers.clear();
+
+    depth_pyramid.cleanup();
+    cull_pipeline.reset();
+    for (std::shared_ptr<Pipeline>& pipeline : depth_equal_mesh_pipelines) pipeline.reset();
+    for (std::shared_ptr<Pipeline>& pipeline : depth_prepass_pipelines) pipeline.reset();
+    for (std::shared_ptr<Pipeline>& pipeline : mesh_pipelines) pipeline.reset();
+}
+
+void MeshRenderSystem::reload_shaders(const std::vector<std::string>& entry_points) {
+    auto changed = [&](const char* entry_point) {
+        return entry_point && std::find(entry_points.begin(), entry_points.end(), entry_point) != entry_points.end();
+    };
+    auto pipeline_changed = [&](MeshPass pass, MaterialPipeline material_pipeline) {
+        return changed(vertex_entry_point(pass)) || changed(pixel_entry_point(pass, material_pipeline));
+    };
+
+    for (uint32_t i_pipeline = 0; i_pipeline < MATERIAL_PIPELINE_COUNT; i_pipeline++) {
+        const MaterialPipeline material_pipeline = static_cast<MaterialPipeline>(i_pipeline);
+        if (pipeline_changed(MeshPass::COLOR, material_pipeline)) {
+            renderer->replace_pipeline(mesh_pipelines[i_pipeline], build_mesh_pipeline(MeshPass::COLOR, material_pipeline));
+        }
+    }
+    for (MaterialPipeline material_pipeline : { MATERIAL_PIPELINE_OPAQUE, MATERIAL_PIPELINE_OPAQUE_DOUBLE_SIDED }) {
+        if (pipeline_changed(MeshPass::DEPTH_PREPASS, material_pipeline)) {
+            renderer->replace_pipeline(depth_prepass_pipelines[material_pipeline], build_mesh_pipeline(MeshPass::DEPTH_PREPASS, material_pipeline));
+        }
+        if (pipeline_changed(MeshPass::COLOR_AFTER_PREPASS, material_pipeline)) {
+            renderer->replace_pipeline(depth_equal_mesh_pipelines[material_pipeline], build_mesh_pipeline(MeshPass::COLOR_AFTER_PREPASS, material_pipeline));
+        }
+    }
+    if (changed("cull_main")) renderer->replace_pipeline(cull_pipeline, build_cull_pipeline());
+
+    depth_pyramid.reload_shaders(entry_points);
+}
+
+RenderableHandle MeshRenderSystem::add_renderable(std::shared_ptr<MeshAsset> renderable, uint32_t node) {
+    objects_dirty = true;
+    return renderables.insert(Renderable{ .mesh = std::move(renderable), .node = node });
+}
+
+void MeshRenderSystem::remove_renderable(RenderableHandle handle) {
+    Renderable* renderable = renderables.get(handle);
+    if (!renderable) return;
+
+    // This might be the last reference to the mesh's buffers, and submitted frames still draw from them
+    renderer->defer_cleanup([mesh = std::move(renderable->mesh)]() {});
+    renderables.remove(handle);
+    objects_dirty = true;
+}
+
+// Non-uniform scale grows the sphere by the largest axis
+static glm::vec4 transform_sphere(const glm::mat4& transform, const glm::vec4& sphere) {
+    glm::vec3 center = transform * glm::vec4(glm::vec3(sphere), 1.0f);
+    float scale = std::max({ glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2])) });
+    return glm::vec4{ center, sphere.w * scale };
+}
+
+void MeshRenderSystem::request_texture_residency(const Camera& camera, float viewport_height) {
+    const glm::vec3 camera_position = glm::inverse(camera.view)[3];
+    const bool orthographic = camera.projection[3][3] == 1.0f;
+
+    // Pixels covered by one world unit at distance 1 (or at any distance for orthographic projections)
+    const float pixels_per_unit = std::abs(camera.projection[1][1]) * viewport_height * 0.5f;
+
+    // Off-screen objects don't get to pull in more detail. The visibility comes from the last prepare(), so it's a frame old at most
+    const bool has_visibility = object_visibility.size() == object_spheres.size();
+
+    for (size_t i_object = 0; i_object < object_textures.size(); i_object++) {
+        if (!object_textures[i_object] || (has_visibility && !object_visibility[i_object])) continue;
+
+        // Shared textures end up with whatever the closest object using them needs
+        glm::vec3 center{ object_spheres.x[i_object], object_spheres.y[i_object], object_spheres.z[i_object] };
+        float radius = object_spheres.radius[i_object];
+        float distance = orthographic ? 1.0f : std::max(glm::length(center - camera_position) - radius, 0.01f);
+        renderer->texture_streamer.request(object_textures[i_object], 2.0f * radius / distance * pixels_per_unit);
+    }
+}
+
+// Sort key layout, most significant first. Draws that share a field end up next to each other:
+// | pipeline (8) | geometry (24) | material (32) |
+// Geometry is an id of the GPUMeshBuffer, not of the renderable, so renderables sharing a MeshAsset (or identical geometry) sort together.
+// It comes before material since every geometry buffer is its own indirect draw, while materials are free to change within one
+static constexpr uint32_t sort_key_geometry_bits = 24;
+static constexpr uint32_t sort_key_material_bits = 32;
+
+static uint64_t make_sort_key(uint32_t pipeline_id, uint32_t geometry_id, uint32_t material_id) {
+    uint64_t key = pipeline_id & 0xFF;
+    key = (key << sort_key_geometry_bits) | (geometry_id & ((1u << sort_key_geometry_bits) - 1));
+    key = (key << sort_key_material_bits) | material_id;
+    return key;
+}
+
+// LSD radix sort on the 64 bit key, one byte per pass. Stable, and bytes that are the same for every draw are skipped
+template <typename T>
+static void radix_sort(std::vector<T>& items, std::vector<T>& scratch) {
+    scratch.resize(items.size());
+    T* source = items.data();
+    T* destination = scratch.data();
+
+    for (uint32_t shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256]{};
+        for (size_t i_item = 0; i_item < items.size(); i_item++) {
+            offsets[(source[i_item].sort_key >> shift) & 0xFF]++;
+        }
+        if (offsets[(source[0].sort_key >> shift) & 0xFF] == items.size()) continue;
+
+        size_t total = 0;
+        for (size_t& offset : offsets) {
+            size_t count = offset;
+            offset = total;
+            total += count;
+        }
+        for (size_t i_item = 0; i_item < items.size(); i_item++) {
+            destination[offsets[(source[i_item].sort_key >> shift) & 0xFF]++] = source[i_item];
+        }
+        std::swap(source, destination);
+    }
+
+    if (source != items.data()) items.swap(scratch);
+}
+
+void MeshRenderSystem::build_draw_list() {
+    draw_list.clear();
+    instance_transforms.clear();
+    material_ids.clear();
+    geometry_ids.clear();
+    material_ids[nullptr] = 0;
+
+    for (size_t i_renderable = 0; i_renderable < renderables.items.size(); i_renderable++) {
+        const Renderable& renderable = renderables.items[i_renderable];
+        const MeshAsset* mesh = renderable.mesh.get();
+        if (mesh->instance_transforms.empty()) continue;
+
+        const uint32_t first_instance = static_cast<uint32_t>(instance_transforms.size());
+        instance_transforms.insert(instance_transforms.end(), mesh->instance_transforms.begin(), mesh->instance_transforms.end());
+
+        // Geometry and materials get small ids in the order they're first seen, pointers would scatter them across the key
+        const GPUMeshBuffer* geometry = mesh->GPU_mesh_buffers.get();
+        auto [geometry_id, geometry_inserted] = geometry_ids.try_emplace(geometry, static_cast<uint32_t>(geometry_ids.size()));
+        for (uint32_t i_surface = 0; i_surface < mesh->surfaces.size(); i_surface++) {
+            const GeometricSurface& surface = mesh->surfaces[i_surface];
+            auto [material_id, material_inserted] = material_ids.try_emplace(surface.material.get(), static_cast<uint32_t>(material_ids.size()));
+            const MaterialPipeline pipeline = material_pipeline_of(surface.material.get());
+            draw_list.push_back(MeshDraw{
+                .sort_key = make_sort_key(pipeline, geometry_id->second, material_id->second),
+                .pipeline = pipeline,
+                .geometry = geometry,
+                .material = surface.material.get(),
+                .bounding_sphere = surface.bounding_sphere,
+                .first_index = surface.index,
+                .index_count = surface.count,
+                .node = renderable.node,
+                .first_instance = first_instance,
+                .instance_count = static_cast<uint32_t>(mesh->instance_transforms.size()),
+                .collision = mesh->collision_mesh.get(),
+                .renderable = renderables.handle_at(i_renderable),
+                .surface = i_surface,
+            });
+        }
+    }
+
+    if (draw_list.size() > 1) radix_sort(draw_list, sort_scratch);
+}
+
+void MeshRenderSystem::rebuild_objects() {
+    build_draw_list();
+
+    objects.clear();
+    object_nodes.clear();
+    object_instance_transforms.clear();
+    draw_groups.clear();
+    object_sources.clear();
+    object_textures.clear();
+    object_visibility.clear();
+    blended_geometries.clear();
+    blended_pipelines.clear();
+    for (const MeshDraw& draw : draw_list) {
+        // Blended draws sort last, so they end up after every group in the object buffer and the GPU cull never sees them
+        const bool blended = is_blended(draw.pipeline);
+        if (!blended && (draw_groups.empty() || draw_groups.back().geometry != draw.geometry || draw_groups.back().pipeline != draw.pipeline)) {
+            draw_groups.push_back(DrawGroup{
+                .geometry = draw.geometry,
+                .pipeline = draw.pipeline,
+                .first_command = static_cast<uint32_t>(objects.size()),
+                .max_draw_count = 0,
+                .visible = true,
+                .distance = 0.0f,
+            });
+        }
+
+        GPUObjectData object{
+            .bounding_sphere = draw.bounding_sphere,
+            .base_color_factor = glm::vec4{ 1.0f },
+            .first_index = draw.first_index,
+            .index_count = draw.index_count,
+            .draw_group = blended ? UINT32_MAX : static_cast<uint32_t>(draw_groups.size()) - 1,
+            .first_command = blended ? 0 : draw_groups.back().first_command,
+            .base_color_texture_index = renderer->default_texture_index,
+            .sampler_index = renderer->default_sampler_index,
+            .alpha_cutoff = 0.0f,
+        };
+        const TextureAsset* texture = nullptr;
+        if (draw.material) {
+            object.base_color_factor = draw.material->base_color_factor;
+            object.alpha_cutoff = draw.material->alpha_cutoff;
+            texture = draw.material->base_color_texture.get();
+            if (texture && texture->bindless_index != UINT32_MAX) object.base_color_texture_index = texture->bindless_index;
+        }
+
+        // Every instance is its own object so they get culled individually
+        for (uint32_t i_instance = draw.first_instance; i_instance < draw.first_instance + draw.instance_count; i_instance++) {
+            objects.push_back(object);
+            object_nodes.push_back(draw.node);
+            object_instance_transforms.push_back(instance_transforms[i_instance]);
+            object_sources.push_back(ObjectSource{
+                .collision = draw.collision,
+                .renderable = draw.renderable,
+                .surface = draw.surface,
+                .instance = i_instance - draw.first_instance,
+            });
+            object_textures.push_back(texture);
+            if (blended) {
+                blended_geometries.push_back(draw.geometry);
+                blended_pipelines.push_back(draw.pipeline);
+            }
+        }
+        if (!blended) draw_groups.back().max_draw_count += draw.instance_count;
+    }
+
+    object_count = static_cast<uint32_t>(objects.size());
+    culled_object_count = object_count - static_cast<uint32_t>(blended_geometries.size());
+    update_object_transforms(false);
+    objects_dirty = false;
+}
+
+bool MeshRenderSystem::renderables_moved() {
+    const SceneGraph& scene_graph = renderer->scene_graph;
+    return std::any_of(renderables.items.begin(), renderables.items.end(), [&](const Renderable& renderable) {
+        return renderable.node != SceneGraph::NO_NODE && scene_graph.world_changed[renderable.node];
+    });
+}
+
+void MeshRenderSystem::update_object_transforms(bool moved_only) {
+    const SceneGraph& scene_graph = renderer->scene_graph;
+    if (!moved_only) {
+        object_spheres.clear();
+        object_spheres.reserve(objects.size());
+    }
+    moved_objects.clear();
+
+    for (uint32_t i_object = 0; i_object < objects.size(); i_object++) {
+        const uint32_t node = object_nodes[i_object];
+        if (moved_only && (node == SceneGraph::NO_NODE || !scene_graph.world_changed[node])) continue;
+
+        GPUObjectData& object = objects[i_object];
+        object.transform = node == SceneGraph::NO_NODE ? object_instance_transforms[i_object] : scene_graph.world_transforms[node] * object_instance_transforms[i_object];
+        const glm::vec4 sphere = transform_sphere(object.transform, object.bounding_sphere);
+        if (moved_only) {
+            object_spheres.set(i_object, sphere);
+            object_bvh.set_sphere(i_object, sphere);
+            moved_objects.push_back(i_object);
+        } else {
+            object_spheres.push_back(sphere);
+        }
+    }
+
+    // A new set of objects gets a fresh SAH build, objects that only moved just stretch the boxes above them
+    if (moved_only) {
+        object_bvh.refit(moved_objects);
+    } else {
+        object_bvh.build(object_spheres);
+    }
+
+    if (moved_only) {
+        queue_object_writes(moved_objects);
+    } else {
+        queue_full_object_upload();
+    }
+}
+
+void MeshRenderSystem::update_object_textures(const TextureAsset* texture) {
+    // Only the texture slot changed, the draw list, groups and BVH all stay as they are
+    const uint32_t texture_index = texture->bindless_index != UINT32_MAX ? texture->bindless_index : renderer->default_texture_index;
+    std::vector<uint32_t> changed_objects;
+    for (uint32_t i_object = 0; i_object < object_textures.size(); i_object++) {
+        if (object_textures[i_object] != texture) continue;
+        objects[i_object].base_color_texture_index = texture_index;
+        changed_objects.push_back(i_object);
+    }
+    queue_object_writes(changed_objects);
+}
+
+void MeshRenderSystem::queue_object_writes(std::span<const uint32_t> changed_objects) {
+    for (FrameObjectBuffer& frame_objects : frame_object_buffers) {
+        if (frame_objects.full_upload) continue;
+        frame_objects.pending_objects.insert(frame_objects.pending_objects.end(), changed_objects.begin(), changed_objects.end());
+    }
+}
+
+void MeshRenderSystem::queue_full_object_upload() {
+    for (FrameObjectBuffer& frame_objects : frame_object_buffers) {
+        frame_objects.full_upload = true;
+        frame_objects.pending_objects.clear();
+    }
+}
+
+bool MeshRenderSystem::sync_frame_objects(FrameObjectBuffer& frame_objects) {
+    const uint32_t total_objects = static_cast<uint32_t>(objects.size());
+    if (frame_objects.capacity < total_objects) {
+        // Only ever grows. This frame's fence was waited on, but like the draw buffers the slot is still freed late to be safe
+        if (frame_objects.capacity > 0) {
+            renderer->defer_cleanup([renderer = renderer, buffer = frame_objects.buffer, slot = frame_objects.index]() mutable {
+                renderer->bindless_descriptors.remove_storage_buffer(slot);
+                buffer.cleanup();
+            });
+        }
+
+        frame_objects.capacity = std::max(total_objects, frame_objects.capacity * 2);
+        frame_objects.buffer = renderer->create_buffer(frame_objects.capacity * sizeof(GPUObjectData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame_objects.index = renderer->bindless_descriptors.add_storage_buffer(&frame_objects.buffer);
+        frame_objects.full_upload = true;
+        if (frame_objects.index == UINT32_MAX) {
+            // Nothing can draw without the object buffer, so meshes are skipped until a slot frees up
+            Logger::logError("Bindless storage buffer table is full, meshes can't be drawn");
+            frame_objects.buffer.cleanup();
+            frame_objects.capacity = 0;
+            return false;
+        }
+    }
+
+    if (frame_objects.full_upload) {
+        frame_objects.buffer.write_data(objects.data(), objects.size() * sizeof(GPUObjectData), 0);
+    } else {
+        // The same object can be queued by several frames of movement in a row
+        std::sort(frame_objects.pending_objects.begin(), frame_objects.pending_objects.end());
+        auto last = std::unique(frame_objects.pending_objects.begin(), frame_objects.pending_objects.end());
+        for (auto i_object = frame_objects.pending_objects.begin(); i_object != last; i_object++) {
+            frame_objects.buffer.write_data(&objects[*i_object], sizeof(GPUObjectData), *i_object * sizeof(GPUObjectData));
+        }
+    }
+    frame_objects.full_upload = false;
+    frame_objects.pending_objects.clear();
+    return true;
+}
+
+std::optional<PickResult> MeshRenderSystem::pick(glm::vec3 origin, glm::vec3 direction, float max_distance) const {
+    float closest = max_distance;
+    uint32_t closest_triangle = UINT32_MAX;
+
+    // The object BVH only knows bounding boxes, the actual distance comes from the mesh's triangles
+    float hit_distance;
+    const uint32_t hit_object = object_bvh.raycast(origin, direction, max_distance, [&](uint32_t i_object) {
+        const ObjectSource& source = object_sources[i_object];
+        if (!source.collision) return -1.0f;
+
+        // The direction isn't normalized again, so distances along the object space ray are the same as in world space
+        const GPUObjectData& object = objects[i_object];
+        const glm::mat4 object_from_world = glm::inverse(object.transform);
+        const glm::vec3 object_origin = object_from_world * glm::vec4(origin, 1.0f);
+        const glm::vec3 object_direction = object_from_world * glm::vec4(direction, 0.0f);
+
+        float distance;
+        const uint32_t triangle = source.collision->raycast(object_origin, object_direction, closest, distance, object.first_index / 3, object.index_count / 3);
+        if (triangle == UINT32_MAX) return -1.0f;
+        closest = distance;
+        closest_triangle = triangle;
+        return distance;
+    }, hit_distance);
+    if (hit_object == UINT32_MAX) return std::nullopt;
+
+    const ObjectSource& source = object_sources[hit_object];
+    return PickResult{
+        .renderable = source.renderable,
+        .surface = source.surface,
+        .instance = source.instance,
+        .triangle = closest_triangle,
+        .distance = hit_distance,
+        .position = origin + direction * hit_distance,
+    };
+}
+
+bool MeshRenderSystem::ensure_frame_buffers(FrameDrawBuffers& frame_buffers) {
+    const uint32_t group_count = static_cast<uint32_t>(draw_groups.size());
+    if (frame_buffers.capacity >= object_count && frame_buffers.counts.total_bytes >= group_count * sizeof(uint32_t)) return true;
+
+    // Only ever grows. This frame's slot is free once its fence was waited on, but descriptors are still freed late to be safe
+    if (frame_buffers.capacity > 0) {
+        renderer->defer_cleanup([renderer = renderer, old_buffers = frame_buffers]() mutable {
+            renderer->bindless_descriptors.remove_storage_buffer(old_buffers.commands_index);
+            renderer->bindless_descriptors.remove_storage_buffer(old_buffers.counts_index);
+            old_buffers.commands.cleanup();
+            old_buffers.counts.cleanup();
+        });
+    }
+
+    frame_buffers.capacity = std::max(object_count, 1u);
+    frame_buffers.commands = renderer->create_buffer(
+        frame_buffers.capacity * sizeof(VkDrawIndexedIndirectCommand),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY
+    );
+    frame_buffers.counts = renderer->create_buffer(
+        std::max(group_count, 1u) * sizeof(uint32_t),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY
+    );
+    frame_buffers.commands_index = renderer->bindless_descriptors.add_storage_buffer(&frame_buffers.commands);
+    frame_buffers.counts_index = renderer->bindless_descriptors.add_storage_buffer(&frame_buffers.counts);
+
+    // These were never used, so they can go right away and be tried again next frame
+    if (frame_buffers.commands_index == UINT32_MAX || frame_buffers.counts_index == UINT32_MAX) {
+        Logger::logError("Bindless storage buffer table is full, skipping this frame's indirect draws");
+        renderer->bindless_descriptors.remove_storage_buffer(frame_buffers.commands_index);
+        renderer->bindless_descriptors.remove_storage_buffer(frame_buffers.counts_index);
+        frame_buffers.commands.cleanup();
+        frame_buffers.counts.cleanup();
+        frame_buffers.capacity = 0;
+        return false;
+    }
+    return true;
 }
 
-void MeshRenderSystem::add_renderable(std::shared_ptr<MeshAsset> renderable) {
-    renderables.push_back(renderable);
+void MeshRenderSystem::cull_objects() {
+    visible_objects.clear();
+    const auto cull_start = std::chrono::steady_clock::now();
+    object_bvh.query_frustum(FrustumCulling::extract_planes(renderer->camera_data.view_projection), visible_objects);
+    cpu_cull_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - cull_start).count();
+    object_visibility.assign(object_count, 0);
+    for (DrawGroup& group : draw_groups) {
+        group.visible = false;
+        group.distance = FLT_MAX;
+    }
+    blended_draws.clear();
+
+    // A group is drawn if any of its objects survived, and is as close as the closest of them
+    const glm::vec3 camera_position{ renderer->camera_data.position };
+    for (uint32_t i_object : visible_objects) {
+        object_visibility[i_object] = 1;
+        const glm::vec3 center{ object_spheres.x[i_object], object_spheres.y[i_object], object_spheres.z[i_object] };
+        const float center_distance = glm::length(center - camera_position);
+        if (i_object >= culled_object_count) {
+            blended_draws.push_back(BlendedDraw{ .distance = center_distance, .object = i_object });
+            continue;
+        }
+
+        DrawGroup& group = draw_groups[objects[i_object].draw_group];
+        group.visible = true;
+        group.distance = std::min(group.distance, center_distance - object_spheres.radius[i_object]);
+    }
+
+    // Opaque before alpha tested, since the discard in the latter keeps the GPU from rejecting fragments early.
+    // Within each, closest first so the nearest surfaces fill the depth buffer before the ones they hide get shaded
+    group_order.clear();
+    for (uint32_t i_group = 0; i_group < draw_groups.size(); i_group++) {
+        if (draw_groups[i_group].visible) group_order.push_back(i_group);
+    }
+    std::sort(group_order.begin(), group_order.end(), [&](uint32_t a, uint32_t b) {
+        const bool a_opaque = is_opaque(draw_groups[a].pipeline);
+        const bool b_opaque = is_opaque(draw_groups[b].pipeline);
+        if (a_opaque != b_opaque) return a_opaque;
+        return draw_groups[a].distance < draw_groups[b].distance;
+    });
+
+    // Blending only composes correctly back to front
+    std::sort(blended_draws.begin(), blended_draws.end(), [](const BlendedDraw& a, const BlendedDraw& b) {
+        return a.distance > b.distance;
+    });
+}
+
+void MeshRenderSystem::prepare(Command* cmd) {
+    if (objects_dirty) {
+        rebuild_objects();
+    } else if (renderables_moved()) {
+        update_object_transforms(true);
+    }
+    if (object_count == 0) return;
+
+    FrameObjectBuffer& frame_objects = frame_object_buffers[renderer->frame_index];
+    object_buffer_index = sync_frame_objects(frame_objects) ? frame_objects.index : UINT32_MAX;
+    if (object_buffer_index == UINT32_MAX) return;
+
+    // Nothing on screen means nothing for the GPU to do either. Blended objects are drawn straight from the CPU cull
+    cull_objects();
+    if (group_order.empty()) return;
+
+    FrameDrawBuffers& frame_buffers = frame_draw_buffers[renderer->frame_index];
+    if (!ensure_frame_buffers(frame_buffers)) {
+        group_order.clear();
+        return;
+    }
+
+    // Every group starts out empty, the cull pass appends whatever survives
+    vkCmdFillBuffer(cmd->buffer, frame_buffers.counts.handle, 0, draw_groups.size() * sizeof(uint32_t), 0);
+    cmd->memory_barrier(VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+    GPUCullPushConstants cull_constants{
+        .object_count = culled_object_count,
+        .object_buffer_index = object_buffer_index,
+        .command_buffer_index = frame_buffers.commands_index,
+        .count_buffer_index = frame_buffers.counts_index,
+        .depth_pyramid_index = occlusion_culling && depth_pyramid.valid ? depth_pyramid.image_index : UINT32_MAX,
+        .depth_pyramid_sampler_index = depth_pyramid.min_sampler_index,
+        .depth_pyramid_size = glm::vec2(depth_pyramid.extent.width, depth_pyramid.extent.height),
+    };
+
+    vkCmdBindPipeline(cmd->buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline->handle);
+    vkCmdBindDescriptorSets(cmd->buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline->layout, 0, 1, &renderer->camera_descriptors[renderer->frame_index].handle, 0, nullptr);
+    renderer->bindless_descriptors.bind(cmd, cull_pipeline->layout, 1, VK_PIPELINE_BIND_POINT_COMPUTE);
+    vkCmdPushConstants(cmd->buffer, cull_pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUCullPushConstants), &cull_constants);
+    vkCmdDispatch(cmd->buffer, (culled_object_count + 63) / 64, 1, 1);
+
+    cmd->memory_barrier(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
 }
 
-void MeshRenderSystem::update_push_constants(GPUDrawPushConstants* push_constants) {
-    this->push_constants = push_constants;
+const Pipeline& MeshRenderSystem::group_pipeline(MeshPass pass, MaterialPipeline material_pipeline) const {
+    // Alpha tested surfaces aren't in the prepass, so they keep testing and writing depth themselves
+    if (is_opaque(material_pipeline)) {
+        if (pass == MeshPass::DEPTH_PREPASS) return *depth_prepass_pipelines[material_pipeline];
+        if (pass == MeshPass::COLOR_AFTER_PREPASS) return *depth_equal_mesh_pipelines[material_pipeline];
+    }
+    return *mesh_pipelines[material_pipeline];
+}
+
+void MeshRenderSystem::bind_mesh_pipeline(Command* cmd, const Pipeline& pipeline, VkPipelineLayout& bound_layout) {
+    vkCmdBindPipeline(cmd->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.handle);
+    if (pipeline.layout == bound_layout) return;
+
+    vkCmdBindDescriptorSets(cmd->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.layout, 0, 1, &renderer->camera_descriptors[renderer->frame_index].handle, 0, nullptr);
+    renderer->bindless_descriptors.bind(cmd, pipeline.layout, 1);
+    bound_layout = pipeline.layout;
+}
+
+void MeshRenderSystem::bind_geometry(Command* cmd, const Pipeline& pipeline, const GPUMeshBuffer* geometry) {
+    GPUMeshPushConstants mesh_constants{
+        .vertex_buffer_address = vertex_pulling ? geometry->vertex_buffer_address : 0,
+        .object_buffer_index = object_buffer_index,
+    };
+    vkCmdPushConstants(cmd->buffer, pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUMeshPushConstants), &mesh_constants);
+
+    if (!vertex_pulling) {
+        VkDeviceSize offset = 0;
+        vkCmdBindVertexBuffers(cmd->buffer, 0, 1, &geometry->vertex_buffer.handle, &offset);
+    }
+    vkCmdBindIndexBuffer(cmd->buffer, geometry->index_buffer.handle, 0, VK_INDEX_TYPE_UINT32);
+}
+
+void MeshRenderSystem::draw_visible_groups(Command* cmd, MeshPass pass) {
+    FrameDrawBuffers& frame_buffers = frame_draw_buffers[renderer->frame_index];
+    const Pipeline* bound_pipeline = nullptr;
+    VkPipelineLayout bound_layout = VK_NULL_HANDLE;
+
+    // The cull pass decided how many draws each group gets, the CPU just points at where they are
+    for (uint32_t i_group : group_order) {
+        const DrawGroup& group = draw_groups[i_group];
+        if (pass == MeshPass::DEPTH_PREPASS && !is_opaque(group.pipeline)) continue;
+
+        const Pipeline& pipeline = group_pipeline(pass, group.pipeline);
+        if (&pipeline != bound_pipeline) {
+            bind_mesh_pipeline(cmd, pipeline, bound_layout);
+            bound_pipeline = &pipeline;
+        }
+        bind_geometry(cmd, pipeline, group.geometry);
+        vkCmdDrawIndexedIndirectCount(
+            cmd->buffer,
+            frame_buffers.commands.handle, group.first_command * sizeof(VkDrawIndexedIndirectCommand),
+            frame_buffers.counts.handle, i_group * sizeof(uint32_t),
+            group.max_draw_count, sizeof(VkDrawIndexedIndirectCommand)
+        );
+    }
+}
+
+void MeshRenderSystem::draw_blended_objects(Command* cmd) {
+    const Pipeline* bound_pipeline = nullptr;
+    VkPipelineLayout bound_layout = VK_NULL_HANDLE;
+    const GPUMeshBuffer* bound_geometry = nullptr;
+
+    for (const BlendedDraw& draw : blended_draws) {
+        const uint32_t i_blended = draw.object - culled_object_count;
+        const Pipeline& pipeline = *mesh_pipelines[blended_pipelines[i_blended]];
+        if (&pipeline != bound_pipeline) {
+            bind_mesh_pipeline(cmd, pipeline, bound_layout);
+            bound_pipeline = &pipeline;
+            bound_geometry = nullptr;
+        }
+        if (blended_geometries[i_blended] != bound_geometry) {
+            bound_geometry = blended_geometries[i_blended];
+            bind_geometry(cmd, pipeline, bound_geometry);
+        }
+
+        // Same command the cull pass would have written, firstInstance carries the object index
+        const GPUObjectData& object = objects[draw.object];
+        vkCmdDrawIndexed(cmd->buffer, object.index_count, 1, object.first_index, 0, draw.object);
+    }
 }
 
 void MeshRenderSystem::render(Command* cmd) {
-    vkCmdBindPipeline(cmd->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, simple_mesh_pipeline.handle);
-    vkCmdBindDescriptorSets(cmd->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, simple_mesh_pipeline.layout, 0, descriptor_sets.size(), contiguous_sets.data(), 0, nullptr);
-    //if (this->push_constants) vkCmdPushConstants(cmd->buffer, simple_mesh_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushConstants), push_constants);
-    for (auto renderable : this->renderables) {
-        VkDeviceSize offsets{0};
-        vkCmdBindVertexBuffers(cmd->buffer, 0, 1, &renderable->GPU_mesh_buffers.vertex_buffer.handle, &offsets);
-        vkCmdBindIndexBuffer(cmd->buffer, renderable->GPU_mesh_buffers.index_buffer.handle, 0, VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(cmd->buffer, renderable->surfaces[0].count, 1, renderable->surfaces[0].index, 0, 0);
+    if (object_count == 0 || object_buffer_index == UINT32_MAX) return;
+
+    // Both passes reuse the same indirect commands, the prepass just lays down depth first
+    if (depth_prepass) {
+        draw_visible_groups(cmd, MeshPass::DEPTH_PREPASS);
+        draw_visible_groups(cmd, MeshPass::COLOR_AFTER_PREPASS);
+    } else {
+        draw_visible_groups(cmd, MeshPass::COLOR);
+    }
+
+    // Last, so everything opaque is already there to blend over
+    draw_blended_objects(cmd);
+}
+
+void MeshRenderSystem::finalize(Command* cmd) {
+    // A pyramid that skipped a frame no longer matches the previous camera
+    if (!occlusion_culling) {
+        depth_pyramid.valid = false;
+        return;
     }
+    depth_pyramid.build(cmd, &renderer->depth_image, renderer->draw_extent);
 }